@@ -0,0 +1,162 @@
+#include "capture.h"
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+bool Capture::m_enabled = false;
+std::atomic<uint32_t> Capture::m_next_conn(1);
+char *Capture::m_ring = NULL;
+uint64_t Capture::m_size = 0;
+std::atomic<uint64_t> Capture::m_head(0);
+std::atomic<uint64_t> Capture::m_tail(0);
+FILE *Capture::m_file = NULL;
+pthread_t Capture::m_thread;
+std::atomic<bool> Capture::m_stop(false);
+std::atomic<uint64_t> Capture::m_records(0);
+std::atomic<uint64_t> Capture::m_bytes(0);
+std::atomic<uint64_t> Capture::m_dropped(0);
+std::atomic<uint64_t> Capture::m_written(0);
+
+static const uint64_t READY = 1ull << 63;
+static const size_t HEADER = sizeof(uint64_t);
+
+bool Capture::start(const char *path, long buffer_size) {
+    uint64_t size = MIN_BUFFER;
+    while(size < (uint64_t)buffer_size) {
+        size <<= 1;
+    }
+    m_file = fopen(path, "wb");
+    if(!m_file) {
+        perror("open capture file");
+        return false;
+    }
+    // 全部清零，后台线程靠记录头的最高位判断记录是否写完
+    m_ring = (char *)new uint64_t[size / sizeof(uint64_t)]();
+    m_size = size;
+    setvbuf(m_file, NULL, _IOFBF, 1024 * 1024);
+    fwrite(MAGIC, sizeof(MAGIC), 1, m_file);
+    m_written.store(sizeof(MAGIC), std::memory_order_relaxed);
+
+    if(pthread_create(&m_thread, NULL, writer, NULL) != 0) {
+        fclose(m_file);
+        delete [] (uint64_t *)m_ring;
+        m_file = NULL;
+        m_ring = NULL;
+        return false;
+    }
+    m_enabled = true;
+    printf("capturing to %s buffer=%lu\n", path, m_size);
+    return true;
+}
+
+// 调用时其他线程已经不再写入记录
+void Capture::stop() {
+    if(!m_enabled) {
+        return;
+    }
+    m_enabled = false;
+    m_stop.store(true, std::memory_order_release);
+    pthread_join(m_thread, NULL);
+    fclose(m_file);
+    delete [] (uint64_t *)m_ring;
+    m_file = NULL;
+    m_ring = NULL;
+}
+
+void Capture::copy_in(uint64_t pos, const void *src, size_t len) {
+    uint64_t off = pos & (m_size - 1);
+    size_t first = len < m_size - off ? len : m_size - off;
+    memcpy(m_ring + off, src, first);
+    memcpy(m_ring, (const char *)src + first, len - first);
+}
+
+void Capture::copy_out(uint64_t pos, void *dst, size_t len) {
+    uint64_t off = pos & (m_size - 1);
+    size_t first = len < m_size - off ? len : m_size - off;
+    memcpy(dst, m_ring + off, first);
+    memcpy((char *)dst + first, m_ring, len - first);
+}
+
+void Capture::clear(uint64_t pos, size_t len) {
+    uint64_t off = pos & (m_size - 1);
+    size_t first = len < m_size - off ? len : m_size - off;
+    memset(m_ring + off, 0, first);
+    memset(m_ring, 0, len - first);
+}
+
+void Capture::append(uint32_t conn, TYPE type, const void *data, uint32_t len) {
+    // 只有DATA记录带数据，SKIP的len是跳过的字节数
+    uint32_t payload = type == DATA ? len : 0;
+    uint64_t need = (HEADER + sizeof(Record) + payload + 7) & ~7ull;
+    uint64_t pos = m_head.load(std::memory_order_relaxed);
+    do {
+        // 剩余空间不够，丢弃这条记录
+        if(need > m_size || pos + need - m_tail.load(std::memory_order_acquire) > m_size) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while(!m_head.compare_exchange_weak(pos, pos + need, std::memory_order_relaxed));
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    Record rec;
+    rec.ts_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    rec.conn = conn;
+    rec.len = len;
+    rec.type = type;
+    copy_in(pos + HEADER, &rec, sizeof(rec));
+    if(payload) {
+        copy_in(pos + HEADER + sizeof(rec), data, payload);
+    }
+    // 记录头8字节对齐，不会跨过缓冲区末尾
+    std::atomic_ref<uint64_t> header(*(uint64_t *)(m_ring + (pos & (m_size - 1))));
+    header.store(need | READY, std::memory_order_release);
+
+    m_records.fetch_add(1, std::memory_order_relaxed);
+    m_bytes.fetch_add(payload, std::memory_order_relaxed);
+}
+
+// 后台线程，按预留顺序把记录写入文件。某条记录还没写完时，后面的记录也要等它
+void *Capture::writer(void *) {
+    char *buf = new char[sizeof(Record) + m_size];
+    while(true) {
+        uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        std::atomic_ref<uint64_t> header(*(uint64_t *)(m_ring + (tail & (m_size - 1))));
+        uint64_t h = header.load(std::memory_order_acquire);
+        if(!(h & READY)) {
+            // 停止时生产者都已退出，预留的记录也都写完了
+            if(m_stop.load(std::memory_order_acquire) && m_head.load(std::memory_order_relaxed) == tail) {
+                break;
+            }
+            fflush(m_file);
+            usleep(POLL_US);
+            continue;
+        }
+        uint64_t need = h & ~READY;
+        Record rec;
+        copy_out(tail + HEADER, &rec, sizeof(rec));
+        size_t total = sizeof(rec) + (rec.type == DATA ? rec.len : 0);
+        copy_out(tail + HEADER, buf, total);
+        // 清零后空间才能重新分配，之后的记录头可能落在这段数据中间
+        clear(tail, need);
+        m_tail.store(tail + need, std::memory_order_release);
+
+        if(fwrite(buf, total, 1, m_file) == 1) {
+            m_written.fetch_add(total, std::memory_order_relaxed);
+        }
+    }
+    fflush(m_file);
+    delete [] buf;
+    return NULL;
+}
+
+void Capture::dump() {
+    if(!m_enabled) {
+        return;
+    }
+    printf("capture: records=%lu bytes=%lu dropped=%lu written=%lu buffered=%lu\n",
+        m_records.load(std::memory_order_relaxed), m_bytes.load(std::memory_order_relaxed),
+        m_dropped.load(std::memory_order_relaxed), m_written.load(std::memory_order_relaxed),
+        m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_relaxed));
+    fflush(stdout);
+}
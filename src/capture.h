@@ -0,0 +1,86 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <pthread.h>
+
+// 流量录制
+// 把客户端发来的原始字节连同连接编号和时间戳写入二进制日志，用tools/replay按原来的节奏重放。
+// 主线程和工作线程(上传)都会写入记录，先放进无锁环形缓冲区，由后台线程批量写文件；
+// 缓冲区满时丢弃记录并计数，不会阻塞请求处理
+class Capture {
+public:
+    enum TYPE {
+        OPEN = 1,           // 建立连接
+        DATA,               // 收到的数据，后面跟着len字节
+        SKIP,               // 用splice直接写入文件的上传请求体，只记录长度
+        CLOSE,              // 连接关闭
+    };
+
+    // 日志文件以MAGIC开头，之后是一条条记录，DATA记录的数据紧跟在记录头后面
+    struct Record {
+        uint64_t ts_ns;     // CLOCK_REALTIME，多个工作进程的日志可以按时间合并
+        uint32_t conn;      // 连接编号，同一个文件中唯一
+        uint32_t len;
+        uint8_t type;
+    } __attribute__((packed));
+
+    static constexpr char MAGIC[8] = { 'W', 'S', 'C', 'A', 'P', '0', '1', '\n' };
+
+    static bool start(const char *path, long buffer_size);  // 开始录制，buffer_size会向上取整为2的幂
+    static void stop();                                     // 写完缓冲区中的记录后关闭文件
+    static void dump();
+
+    // 新连接的编号，没有开启录制时返回0，之后的记录都会被忽略
+    static inline uint32_t open_conn() {
+        if(!m_enabled) {
+            return 0;
+        }
+        uint32_t conn = m_next_conn.fetch_add(1, std::memory_order_relaxed);
+        append(conn, OPEN, NULL, 0);
+        return conn;
+    }
+    static inline void record(uint32_t conn, TYPE type, const void *data, uint32_t len) {
+        if(conn) {
+            append(conn, type, data, len);
+        }
+    }
+
+public:
+    static const long DEFAULT_BUFFER = 16 * 1024 * 1024;
+    static const long MIN_BUFFER = 1024 * 1024;
+    static const int POLL_US = 5000;                        // 缓冲区为空时后台线程的休眠时间
+
+private:
+    static void append(uint32_t conn, TYPE type, const void *data, uint32_t len);
+    static void *writer(void *arg);
+    static void copy_in(uint64_t pos, const void *src, size_t len);
+    static void copy_out(uint64_t pos, void *dst, size_t len);
+    static void clear(uint64_t pos, size_t len);
+
+private:
+    static bool m_enabled;
+    static std::atomic<uint32_t> m_next_conn;
+
+    // 环形缓冲区中每条记录前有8字节的头：低32位是整条记录占用的字节数(8字节对齐)，
+    // 最高位表示记录已经写完。生产者用CAS移动m_head预留空间，写完数据后再置位；
+    // 后台线程按顺序取出已写完的记录，清零后移动m_tail，把空间还给生产者
+    static char *m_ring;
+    static uint64_t m_size;
+    static std::atomic<uint64_t> m_head;
+    static std::atomic<uint64_t> m_tail;
+
+    static FILE *m_file;
+    static pthread_t m_thread;
+    static std::atomic<bool> m_stop;
+
+    // 统计
+    static std::atomic<uint64_t> m_records;
+    static std::atomic<uint64_t> m_bytes;
+    static std::atomic<uint64_t> m_dropped;
+    static std::atomic<uint64_t> m_written;                 // 已写入文件的字节数
+};
+
+#endif
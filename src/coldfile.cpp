@@ -0,0 +1,120 @@
+#include "coldfile.h"
+#include <cstdio>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+Locker ColdFile::m_lock;
+Cond ColdFile::m_cond;
+std::unordered_map<std::string, ColdFile::Flight *> ColdFile::m_flights;
+unsigned long ColdFile::m_hot = 0;
+unsigned long ColdFile::m_loaded = 0;
+unsigned long ColdFile::m_waited = 0;
+unsigned long ColdFile::m_warmed = 0;
+
+// addr是mmap的返回值，页对齐
+bool ColdFile::resident(char *addr, long len) {
+    long page = sysconf(_SC_PAGESIZE);
+    long pages = (len + page - 1) / page;
+    std::vector<unsigned char> vec(pages);
+    if(mincore(addr, len, vec.data()) == -1) {
+        return false;
+    }
+    for(long i=0; i<pages; i++) {
+        if(!(vec[i] & 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// addr是mmap的返回值，off可以不对齐，按所在的页检查
+long ColdFile::resident_bytes(char *addr, long off, long len) {
+    static const long page = sysconf(_SC_PAGESIZE);
+    long start = off / page * page;
+    long pages = (off + len - start + page - 1) / page;
+    std::vector<unsigned char> vec(pages);
+    // 无法判断时按在内存中处理，不影响发送
+    if(mincore(addr + start, off + len - start, vec.data()) == -1) {
+        return len;
+    }
+    long i = 0;
+    while(i < pages && (vec[i] & 1)) {
+        i++;
+    }
+    long bytes = start + i * page - off;
+    return bytes < len ? (bytes > 0 ? bytes : 0) : len;
+}
+
+// 在工作线程中逐页访问，缺页不会阻塞主线程
+void ColdFile::warm(char *addr, long off, long len) {
+    static const long page = sysconf(_SC_PAGESIZE);
+    long start = off / page * page;
+    madvise(addr + start, off + len - start, MADV_WILLNEED);
+    const volatile char *p = addr;
+    for(long pos=start; pos<off+len; pos+=page) {
+        (void)p[pos];
+    }
+    __sync_fetch_and_add(&m_warmed, 1);
+}
+
+void ColdFile::load(int fd, char *addr, long size, long len) {
+    // 整个文件交给内核异步预读，开头部分在这里逐页访问，缺页发生在工作线程中
+    posix_fadvise(fd, 0, size, POSIX_FADV_WILLNEED);
+    madvise(addr, len, MADV_WILLNEED);
+    long page = sysconf(_SC_PAGESIZE);
+    const volatile char *p = addr;
+    for(long off=0; off<len; off+=page) {
+        (void)p[off];
+    }
+}
+
+void ColdFile::prefetch(const char *path, int fd, char *addr, long size) {
+    long len = size < WARM_BYTES ? size : WARM_BYTES;
+    if(resident(addr, len)) {
+        __sync_fetch_and_add(&m_hot, 1);
+        return;
+    }
+
+    std::string key(path);
+    m_lock.lock();
+    std::unordered_map<std::string, Flight *>::iterator it = m_flights.find(key);
+    if(it != m_flights.end()) {
+        // 已有线程在加载这个文件，等它完成
+        Flight *f = it->second;
+        f->waiters++;
+        while(!f->done) {
+            m_cond.wait(m_lock.get());
+        }
+        if(--f->waiters == 0) {
+            delete f;
+        }
+        m_waited++;
+        m_lock.unlock();
+        return;
+    }
+    Flight *f = new Flight;
+    f->done = false;
+    f->waiters = 0;
+    m_flights[key] = f;
+    m_lock.unlock();
+
+    load(fd, addr, size, len);
+
+    m_lock.lock();
+    f->done = true;
+    m_flights.erase(key);
+    // 有等待者时由最后一个等待者释放
+    if(f->waiters == 0) {
+        delete f;
+    }
+    m_loaded++;
+    m_cond.broadcast();
+    m_lock.unlock();
+}
+
+void ColdFile::dump() {
+    printf("coldfile: hot=%lu loaded=%lu waited=%lu warmed=%lu\n", m_hot, m_loaded, m_waited, m_warmed);
+    fflush(stdout);
+}
@@ -0,0 +1,43 @@
+#ifndef COLDFILE_H
+#define COLDFILE_H
+
+#include <string>
+#include <unordered_map>
+
+#include "locker.h"
+
+// 冷文件预热
+// 主线程writev时如果映射的页不在页缓存中，会因缺页阻塞整个事件循环。
+// 工作线程在do_request中用mincore检查文件开头是否已在内存中，不在则先把它读进来；
+// 同一个文件同时只有一个线程加载，其余请求等待加载完成(single-flight)。
+// 超过WARM_BYTES的部分可能在发送时已被换出，主线程每次writev前用resident_bytes检查，
+// 不在内存中的部分交给工作线程用warm读进来
+class ColdFile {
+public:
+    static void prefetch(const char *path, int fd, char *addr, long size);
+    static long resident_bytes(char *addr, long off, long len);    // 从off开始连续在内存中的字节数
+    static void warm(char *addr, long off, long len);
+    static void dump();
+
+public:
+    static const long WARM_BYTES = 8L * 1024 * 1024;    // 同步预热的长度，其余部分交给内核异步预读
+
+private:
+    struct Flight {
+        bool done;
+        int waiters;
+    };
+
+    static bool resident(char *addr, long len);
+    static void load(int fd, char *addr, long size, long len);
+
+    static Locker m_lock;
+    static Cond m_cond;
+    static std::unordered_map<std::string, Flight *> m_flights;    // 正在加载的文件
+    static unsigned long m_hot;             // 已在内存中
+    static unsigned long m_loaded;          // 由本线程加载
+    static unsigned long m_waited;          // 等待其他线程加载
+    static unsigned long m_warmed;          // 发送过程中交给工作线程预热
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include "completion.h"
+#include <cstdint>
+#include <exception>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+CompletionQueue::CompletionQueue(size_t capacity): m_tail(0), m_head(0), m_signaled(false) {
+    // 容量取2的幂
+    size_t n = 1;
+    while(n < capacity) {
+        n <<= 1;
+    }
+    m_mask = n - 1;
+    m_cells = new Cell[n];
+    for(size_t i=0; i<n; i++) {
+        m_cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_eventfd == -1) {
+        delete [] m_cells;
+        throw std::exception();
+    }
+}
+
+CompletionQueue::~CompletionQueue() {
+    close(m_eventfd);
+    delete [] m_cells;
+}
+
+bool CompletionQueue::try_push(const Completion &c) {
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    while(true) {
+        Cell &cell = m_cells[pos & m_mask];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0) {
+            if(m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                cell.data = c;
+                cell.seq.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        else if(diff < 0) {
+            // 队列已满
+            return false;
+        }
+        else {
+            pos = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void CompletionQueue::post(int fd, TYPE type) {
+    Completion c = { fd, type };
+    // 每个连接同时最多只有一条消息，容量不小于连接数时不会满
+    while(!try_push(c)) {
+        sched_yield();
+    }
+    // 主线程还没被唤醒时才写eventfd，合并多次唤醒
+    if(!m_signaled.exchange(true)) {
+        uint64_t one = 1;
+        ::write(m_eventfd, &one, sizeof(one));
+    }
+}
+
+int CompletionQueue::drain(Completion *out, int max) {
+    uint64_t value;
+    ::read(m_eventfd, &value, sizeof(value));
+    // 先清标志再取消息，之后投递的消息会重新唤醒主线程
+    m_signaled.store(false);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    int n = 0;
+    while(n < max) {
+        Cell &cell = m_cells[m_head & m_mask];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        if(seq != m_head + 1) {
+            break;
+        }
+        out[n++] = cell.data;
+        cell.seq.store(m_head + m_mask + 1, std::memory_order_release);
+        m_head++;
+    }
+    return n;
+}
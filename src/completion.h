@@ -0,0 +1,48 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <atomic>
+#include <cstddef>
+
+// 工作线程 -> 主线程的完成队列
+// 工作线程处理完请求后不再直接操作epoll，而是投递消息，由主线程统一处理
+// 多生产者单消费者的有界环形队列，用一个eventfd唤醒主线程
+class CompletionQueue {
+public:
+    enum TYPE {
+        WRITE = 0,      // 响应已生成，主线程立即尝试发送
+        READ,           // 请求不完整，主线程重新注册EPOLLIN
+        CLOSE,          // 关闭连接
+        PUBLISH         // 有待广播的WebSocket消息，fd无意义
+    };
+
+    struct Completion {
+        int fd;
+        TYPE type;
+    };
+
+    explicit CompletionQueue(size_t capacity);
+    ~CompletionQueue();
+
+    int fd() const { return m_eventfd; }
+    void post(int fd, TYPE type);               // 工作线程调用
+    int drain(Completion *out, int max);        // 主线程调用，返回取出的消息数
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        Completion data;
+    };
+
+    bool try_push(const Completion &c);
+
+private:
+    Cell *m_cells;
+    size_t m_mask;
+    std::atomic<size_t> m_tail;                 // 生产者写入位置
+    size_t m_head;                              // 消费者读取位置，只有主线程访问
+    std::atomic<bool> m_signaled;               // 已经写过eventfd且主线程还没有处理
+    int m_eventfd;
+};
+
+#endif
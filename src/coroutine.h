@@ -0,0 +1,60 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+
+// 协程模式：每个连接是一个无栈协程，在主线程中等待可读/可写事件
+
+// 协程帧内存池，帧只在主线程中创建和销毁，不需要加锁
+class FramePool {
+public:
+    static void *alloc(size_t size) {
+        if(size > BLOCK_SIZE) {
+            return ::operator new(size);
+        }
+        if(m_free) {
+            Block *b = m_free;
+            m_free = b->next;
+            return b;
+        }
+        return ::operator new(BLOCK_SIZE);
+    }
+
+    static void free(void *p, size_t size) {
+        if(size > BLOCK_SIZE) {
+            ::operator delete(p);
+            return;
+        }
+        Block *b = (Block *)p;
+        b->next = m_free;
+        m_free = b;
+    }
+
+public:
+    static const size_t BLOCK_SIZE = 512;
+
+private:
+    struct Block {
+        Block *next;
+    };
+    static inline Block *m_free = nullptr;
+};
+
+// 连接协程的返回类型，协程创建后立即运行到第一次co_await，结束时自动释放帧
+struct ConnTask {
+    struct promise_type {
+        ConnTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(size_t size) { return FramePool::alloc(size); }
+        static void operator delete(void *p, size_t size) { FramePool::free(p, size); }
+    };
+};
+
+#endif
@@ -0,0 +1,40 @@
+#include "filecache.h"
+#include <functional>
+
+FileCache::Shard FileCache::m_shards[SHARDS];
+
+FileCache::Shard &FileCache::shard(const std::string &url) {
+    return m_shards[std::hash<std::string>()(url) % SHARDS];
+}
+
+bool FileCache::lookup(const char *url, int len, long &size) {
+    std::string key(url, len);
+    Shard &s = shard(key);
+    s.lock.lock();
+    std::unordered_map<std::string, long>::iterator it = s.table.find(key);
+    bool found = it != s.table.end();
+    if(found) {
+        size = it->second;
+    }
+    s.lock.unlock();
+    return found;
+}
+
+void FileCache::update(const char *url, long size) {
+    std::string key(url);
+    Shard &s = shard(key);
+    s.lock.lock();
+    if(s.table.size() >= MAX_ENTRIES && !s.table.count(key)) {
+        s.table.clear();
+    }
+    s.table[key] = size;
+    s.lock.unlock();
+}
+
+void FileCache::invalidate(const char *url) {
+    std::string key(url);
+    Shard &s = shard(key);
+    s.lock.lock();
+    s.table.erase(key);
+    s.lock.unlock();
+}
@@ -0,0 +1,32 @@
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <string>
+#include <unordered_map>
+
+#include "locker.h"
+
+// URL -> 文件大小的缓存，do_request时更新
+// 主线程在请求入队前用它估计请求的开销
+class FileCache {
+public:
+    static bool lookup(const char *url, int len, long &size);
+    static void update(const char *url, long size);
+    static void invalidate(const char *url);
+
+public:
+    static const int SHARDS = 16;
+    static const size_t MAX_ENTRIES = 4096;         // 每个分片的上限，超过后整个分片清空
+
+private:
+    struct Shard {
+        Locker lock;
+        std::unordered_map<std::string, long> table;
+    };
+
+    static Shard &shard(const std::string &url);
+
+    static Shard m_shards[SHARDS];
+};
+
+#endif
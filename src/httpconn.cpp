@@ -2,6 +2,7 @@
 #include <asm-generic/errno-base.h>
 #include <asm-generic/errno.h>
 #include <cerrno>
+#include <climits>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
@@ -12,22 +13,25 @@
 #include <sys/stat.h>
 #include <sys/ucontext.h>
 
-// 定义HTTP响应的一些状态信息
-const char* ok_200_title = "OK";
-const char* error_400_title = "Bad Request";
-const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char* error_403_title = "Forbidden";
-const char* error_403_form = "You do not have permission to get file from this server.\n";
-const char* error_404_title = "Not Found";
-const char* error_404_form = "The requested file was not found on this server.\n";
-const char* error_500_title = "Internal Error";
-const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+// 定义HTTP响应的一些状态信息，状态行见httpheader.cpp
+const Fragment error_400_form = FRAGMENT("Your request has bad syntax or is inherently impossible to satisfy.\n");
+const Fragment error_403_form = FRAGMENT("You do not have permission to get file from this server.\n");
+const Fragment error_404_form = FRAGMENT("The requested file was not found on this server.\n");
+const Fragment error_413_form = FRAGMENT("The uploaded file is too large.\n");
+const Fragment error_414_form = FRAGMENT("The requested URL is too long.\n");
+const Fragment error_426_form = FRAGMENT("Only WebSocket protocol version 13 is supported.\n");
+const Fragment error_429_form = FRAGMENT("Too many requests, please slow down.\n");
+const Fragment error_500_form = FRAGMENT("There was an unusual problem serving the requested file.\n");
+const Fragment error_502_form = FRAGMENT("The upstream server is unavailable.\n");
+const Fragment error_507_form = FRAGMENT("There is not enough space to store the uploaded file.\n");
 
 // 网站的根目录
 const char* doc_root = "/home/ubuntu/www";
 
 int Httpconn::m_epollfd = -1;
 int Httpconn::m_user_count = 0;
+bool Httpconn::m_coroutine = false;
+CompletionQueue *Httpconn::m_completions = NULL;
 
 void setnoblocking(int fd) {
     int old_flag = fcntl(fd, F_GETFL);
@@ -63,9 +67,26 @@ void modifyfd(int epollfd, int fd, int event) {
 } 
 
 // 初始化连接
-void Httpconn::init(int sockfd, const sockaddr_in &addr) {
+void Httpconn::init(int sockfd, const sockaddr_storage &addr, Listener *listener) {
     m_addr = addr;
+    m_listener = listener;
     m_sockfd = sockfd;
+    m_file_address = NULL;
+    m_proxy_resp.buf = NULL;
+    m_proxy_resp.fd = -1;
+    memset(m_ts, 0, sizeof(m_ts));
+    m_co = nullptr;
+    m_websocket = false;
+    m_ws_closing = false;
+    m_ws_offset = 0;
+    m_ws_opcode = 0;
+    m_ws_left = 0;
+    m_ws_fin = false;
+    m_send_queued = false;
+    m_send_tokens = SendSched::burst();
+    m_send_last_ns = SendSched::rate() > 0 ? SendSched::now_ns() : 0;
+    m_capture_id = Capture::open_conn();
+    Trace::stamp(m_ts, Trace::ACCEPT);
 
     // 端口复用
     int opt = 1;
@@ -88,14 +109,27 @@ void Httpconn::init() {
     m_url = NULL;
     m_version = NULL;
     m_content_len = 0;
+    m_content = NULL;
     m_host = NULL;
+    m_ws_upgrade = false;
+    m_ws_accepted = false;
+    m_ws_key = NULL;
+    m_ws_version = 0;
+    m_conn_upgrade = false;
+    m_expect_continue = false;
+    m_proxy_body_left = 0;
+    m_file_resident = 0;
+    m_file_warming = false;
     m_checked_index = 0;
     m_start_line = 0;
 
     m_read_idx = 0;
     m_write_idx = 0; 
+    m_request_end = 0;
+    m_header_begin = 0;
+    m_header_end = 0;
 
-    bzero(m_read_buf, READ_BUFFER_SIZE);
+    // 读缓冲区按m_read_idx使用，不需要清零；保持连接时其中可能还有流水线请求
     bzero(m_write_buf, WRITE_BUFFER_SIZE);
     bzero(m_real_file, FILENAME_LEN);
 }
@@ -104,6 +138,29 @@ void Httpconn::init() {
 void Httpconn::close_conn() {
     printf("关闭socket %d \n", m_sockfd);
     if(m_sockfd != -1) {
+        // 连接被主线程关闭时销毁还挂起的协程
+        if(m_co) {
+            std::coroutine_handle<> h = m_co;
+            m_co = nullptr;
+            h.destroy();
+        }
+        unmap();
+        // 上传没有完成，删除临时文件
+        m_upload.abort();
+        m_send_queued = false;
+        if(m_websocket) {
+            WebSocket::unsubscribe(this);
+            m_ws_queue.clear();
+            std::string().swap(m_ws_message);
+        }
+        IpLimit::on_close(m_addr);
+        // 测试中直接用socketpair创建的连接没有监听地址
+        if(m_listener) {
+            m_listener->on_close();
+        }
+        PROBE1(close, m_sockfd);
+        Prefork::on_close();
+        Capture::record(m_capture_id, Capture::CLOSE, NULL, 0);
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
         m_user_count--;
@@ -114,8 +171,10 @@ bool Httpconn::read() {
     if(m_read_idx >= READ_BUFFER_SIZE) {
         return false;
     }
+    Trace::stamp_once(m_ts, Trace::READ_BEGIN);
 
-    while(true) {
+    // 缓冲区满了交给process判断，recv长度为0会被误认为对方关闭
+    while(m_read_idx < READ_BUFFER_SIZE) {
         int bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
         if(bytes_read == -1) {
             // 没有数据
@@ -128,10 +187,13 @@ bool Httpconn::read() {
         else if(bytes_read == 0) {
             return false;
         }
+        Capture::record(m_capture_id, Capture::DATA, m_read_buf + m_read_idx, bytes_read);
         m_read_idx += bytes_read;
     }
 
-    printf("读取到的数据 %s \n", m_read_buf);
+    printf("读取到的数据 %.*s \n", m_read_idx, m_read_buf);
+    Trace::stamp(m_ts, Trace::READ_END);
+    PROBE2(read, m_sockfd, m_read_idx);
 
     return true;
 }
@@ -141,12 +203,10 @@ bool Httpconn::read() {
 Httpconn::HTTP_CODE Httpconn::process_read() {
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
-    int cnt = 0;
-
     char *text = 0;
+    // 请求体不按行解析，不完整时直接等待下次读，否则parse_line会把m_checked_index移过已收到的请求体
     while( (m_check_state == CHECK_STATE_CONTENT && line_status == LINE_OK) ||
-        ((line_status = parse_line()) == LINE_OK)) {
-        if(cnt++ >= 100) break;
+        (m_check_state != CHECK_STATE_CONTENT && (line_status = parse_line()) == LINE_OK)) {
         // 解析到了一行完整的数据
         text = get_line();
         m_start_line = m_checked_index;
@@ -164,14 +224,20 @@ Httpconn::HTTP_CODE Httpconn::process_read() {
                 if(ret == BAD_REQUEST) {
                     return BAD_REQUEST;
                 }else if(ret == GET_REQUEST) {
-                    return do_request();
+                    m_request_end = m_checked_index;
+                    ret = do_request();
+                    PROBE3(request, m_sockfd, ret, m_url);
+                    return ret;
                 }
                 break;
             }
             case CHECK_STATE_CONTENT: {
                 ret = parse_content(text);
                 if(ret == GET_REQUEST) {
-                    return do_request();
+                    m_request_end = m_checked_index + m_content_len;
+                    ret = do_request();
+                    PROBE3(request, m_sockfd, ret, m_url);
+                    return ret;
                 }
                 line_status = LINE_OPEN;
                 break;
@@ -181,6 +247,10 @@ Httpconn::HTTP_CODE Httpconn::process_read() {
             }
         }
     }
+    // 单独的\r或\n
+    if(line_status == LINE_BAD) {
+        return BAD_REQUEST;
+    }
     return NO_REQUEST;
 }
 
@@ -203,6 +273,12 @@ Httpconn::HTTP_CODE Httpconn::parse_request_line(char *text) {
     if(!strcasecmp(method, "GET")) {
         m_method = GET;
     }
+    else if(!strcasecmp(method, "PUT")) {
+        m_method = PUT;
+    }
+    else if(!strcasecmp(method, "POST")) {
+        m_method = POST;
+    }
     else {
         return BAD_REQUEST;
     }
@@ -213,7 +289,14 @@ Httpconn::HTTP_CODE Httpconn::parse_request_line(char *text) {
     }
     // /index.html\0HTTP/1.1
     *m_version++ = '\0';
-    if(strcasecmp(m_version, "HTTP/1.1")) {
+    // HTTP/1.1默认保持连接，HTTP/1.0默认关闭
+    if(strcasecmp(m_version, "HTTP/1.1") == 0) {
+        m_linger = true;
+    }
+    else if(strcasecmp(m_version, "HTTP/1.0") == 0) {
+        m_linger = false;
+    }
+    else {
         return BAD_REQUEST;
     }
 
@@ -228,6 +311,7 @@ Httpconn::HTTP_CODE Httpconn::parse_request_line(char *text) {
      if(!m_url || m_url[0] != '/') {
         return BAD_REQUEST;
      }
+    m_header_begin = m_checked_index;
     m_check_state = CHECK_STATE_HEADER;
     return NO_REQUEST;
 }
@@ -235,25 +319,73 @@ Httpconn::HTTP_CODE Httpconn::parse_request_line(char *text) {
 Httpconn::HTTP_CODE Httpconn::parse_headers(char *text) {
     // 遇到空行表示头部字段解析完毕
     if(text[0] == '\0') {
-        // 表示有请求体
+        m_header_end = m_checked_index - 2;
+        // 上传的请求体不经过读缓冲区，由do_upload直接写入文件
+        // 反向代理优先于上传，读缓冲区放不下的请求体由do_proxy边收边转发
+        bool proxy = Proxy::match(m_url) != NULL;
+        if(!proxy && m_method != GET && Upload::match(m_url)) {
+            return GET_REQUEST;
+        }
+        if(proxy && m_content_len > READ_BUFFER_SIZE - m_checked_index) {
+            return GET_REQUEST;
+        }
+        // 表示有请求体，请求体必须能放进读缓冲区
+        if(m_content_len > READ_BUFFER_SIZE - m_checked_index) {
+            return BAD_REQUEST;
+        }
         if(m_content_len) {
             m_check_state = CHECK_STATE_CONTENT;
             return NO_REQUEST;
         }
         return GET_REQUEST;
     }
-    // 处理 Connection: keep-alive
-    else if(strncasecmp(text, "Connection: ", 11) == 0) {
+    // 处理 Connection: keep-alive，可能有多个值，如 keep-alive, Upgrade
+    else if(strncasecmp(text, "Connection:", 11) == 0) {
         text += 11;
-        text += strspn(text, " \t");
-        if(strcasecmp(text, "kep-alive") == 0) {
-            m_linger = true;
+        while(*text) {
+            text += strspn(text, " \t,");
+            int len = strcspn(text, " \t,");
+            if(len == 10 && strncasecmp(text, "keep-alive", 10) == 0) {
+                m_linger = true;
+            }
+            else if(len == 5 && strncasecmp(text, "close", 5) == 0) {
+                m_linger = false;
+            }
+            else if(len == 7 && strncasecmp(text, "upgrade", 7) == 0) {
+                m_conn_upgrade = true;
+            }
+            text += len;
         }
     }
     else if(strncasecmp(text, "Content-Length:", 15) == 0) {
         text += 15;
         text += strspn(text, " \t");
         m_content_len = atol(text);
+        if(m_content_len < 0) {
+            return BAD_REQUEST;
+        }
+    }
+    else if(strncasecmp(text, "Upgrade:", 8) == 0) {
+        text += 8;
+        text += strspn(text, " \t");
+        if(strcasecmp(text, "websocket") == 0) {
+            m_ws_upgrade = true;
+        }
+    }
+    else if(strncasecmp(text, "Sec-WebSocket-Key:", 18) == 0) {
+        text += 18;
+        text += strspn(text, " \t");
+        m_ws_key = text;
+    }
+    else if(strncasecmp(text, "Sec-WebSocket-Version:", 22) == 0) {
+        text += 22;
+        text += strspn(text, " \t");
+        m_ws_version = atoi(text);
+    }
+    else if(strncasecmp(text, "Expect:", 7) == 0) {
+        text += 7;
+        text += strspn(text, " \t");
+        m_expect_continue = strcasecmp(text, "100-continue") == 0;
     }
     else if(strncasecmp(text, "Host:", 5) == 0) {
         text += 5;
@@ -266,10 +398,10 @@ Httpconn::HTTP_CODE Httpconn::parse_headers(char *text) {
     return NO_REQUEST;
 }
 
-// 仅判断是否完整读入
+// 仅判断是否完整读入，请求体按长度使用，不在末尾补'\0'以免破坏流水线中的下一个请求
 Httpconn::HTTP_CODE Httpconn::parse_content(char *text) {
     if(m_read_idx >= (m_content_len + m_checked_index)) {
-        text[m_content_len] = '\0';
+        m_content = text;
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -292,7 +424,7 @@ Httpconn::LINE_STATUS Httpconn::parse_line() {
             return LINE_BAD;
         }
         else if(temp == '\n') {
-            if(m_checked_index > 1 && m_read_buf[m_checked_index-1] == '\r') {
+            if(m_checked_index >= 1 && m_read_buf[m_checked_index-1] == '\r') {
                 m_read_buf[m_checked_index-1] = '\0';
                 m_read_buf[m_checked_index++] = '\0';
                 return LINE_OK;
@@ -300,16 +432,57 @@ Httpconn::LINE_STATUS Httpconn::parse_line() {
             return LINE_BAD;
         }
     }
-    return LINE_OK;
+    // 行还没有读完整
+    return LINE_OPEN;
 }
 
 // 分析目标文件属性，如果目标文件存在不是目录，且可读
 // 则使用mmap将其用射到内存地址m_file_address处
 Httpconn::HTTP_CODE Httpconn::do_request() {
-    // 获取目标文件绝对路径
-    strcpy(m_real_file, doc_root);
+    Trace::stamp(m_ts, Trace::PARSED);
+
+    // WebSocket握手，帧的收发在主线程中进行，协程模式下不支持
+    if(m_ws_upgrade && !m_coroutine && WebSocket::match(m_url)) {
+        // 握手失败后关闭连接，非GET请求的请求体可能还在socket中
+        if(m_method != GET || !m_conn_upgrade || !m_ws_key) {
+            m_linger = false;
+            return BAD_HANDSHAKE;
+        }
+        if(m_ws_version != 13) {
+            m_linger = false;
+            return UPGRADE_REQUIRED;
+        }
+        return WEBSOCKET_UPGRADE;
+    }
+
+    // 命中反向代理规则的请求转发给后端
+    Proxy *proxy = Proxy::match(m_url);
+    if(proxy && m_coroutine) {
+        // 协程模式下不支持，启动时已经拒绝了这种配置；请求体可能还在socket中
+        m_linger = false;
+        return BAD_GATEWAY;
+    }
+    if(proxy) {
+        return do_proxy(proxy);
+    }
+
+    if(m_method != GET) {
+        return Upload::match(m_url) ? do_upload() : BAD_REQUEST;
+    }
+
+    // 不允许通过..访问根目录以外的文件
+    char *dots = strstr(m_url, "/..");
+    if(dots && (dots[3] == '/' || dots[3] == '\0')) {
+        return FORBIDDEN_REQUEST;
+    }
+
+    // 获取目标文件绝对路径，放不下时拒绝，截断后会指向另一个文件
     int len = strlen(doc_root);
-    strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+    if(len + (int)strlen(m_url) >= FILENAME_LEN) {
+        return URI_TOO_LONG;
+    }
+    strcpy(m_real_file, doc_root);
+    strcpy(m_real_file + len, m_url);
     printf("filepath = %s\n", m_real_file);
 
     // 获取目标文件相关信息
@@ -324,109 +497,521 @@ Httpconn::HTTP_CODE Httpconn::do_request() {
     if(S_ISDIR(m_file_stat.st_mode)) {
         return BAD_REQUEST;
     }
+    FileCache::update(m_url, m_file_stat.st_size);
+
+    // 空文件不需要映射，mmap长度为0会失败
+    if(m_file_stat.st_size == 0) {
+        m_file_address = NULL;
+        return FILE_REQUEST;
+    }
 
     // 以只读方式打开文件
     int fd = open(m_real_file, O_RDONLY);
+    if(fd == -1) {
+        return FORBIDDEN_REQUEST;
+    }
     // 创建内存映射
-    m_file_address = (char *)mmap(NULL, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    void *addr = mmap(NULL, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(addr == MAP_FAILED) {
+        close(fd);
+        return INTERNAL_ERROR;
+    }
+    // 冷文件在工作线程中预热，避免主线程writev时缺页阻塞
+    ColdFile::prefetch(m_real_file, fd, (char *)addr, m_file_stat.st_size);
     close(fd);
+    m_file_address = (char *)addr;
     return FILE_REQUEST;
 }
 
+// 上传的目标路径规则和GET相同。读缓冲区中已有的那部分请求体直接写入，其余的用splice接收
+Httpconn::HTTP_CODE Httpconn::do_upload() {
+    char *dots = strstr(m_url, "/..");
+    if(dots && (dots[3] == '/' || dots[3] == '\0')) {
+        m_linger = false;
+        return FORBIDDEN_REQUEST;
+    }
+    // 请求体还没有读，拒绝后不能继续使用这个连接
+    int len = strlen(doc_root);
+    if(len + (int)strlen(m_url) >= FILENAME_LEN) {
+        m_linger = false;
+        return URI_TOO_LONG;
+    }
+    strcpy(m_real_file, doc_root);
+    strcpy(m_real_file + len, m_url);
+
+    Upload::STATUS st = m_upload.begin(m_real_file, m_content_len);
+    if(st == Upload::DONE) {
+        int buffered = m_read_idx - m_checked_index;
+        if(buffered > m_content_len) {
+            buffered = m_content_len;
+        }
+        m_request_end = m_checked_index + buffered;
+        st = m_upload.write(m_read_buf + m_checked_index, buffered);
+        if(st == Upload::DONE) {
+            // 客户端在等100 Continue才发送请求体，此时连接归本线程所有，写缓冲区也是空的
+            if(m_expect_continue && m_upload.left() > 0) {
+                static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                send(m_sockfd, cont, sizeof(cont) - 1, MSG_NOSIGNAL);
+            }
+            return continue_upload();
+        }
+        m_upload.abort();
+    }
+    // 请求体还留在socket中，回复错误后关闭连接
+    m_linger = false;
+    switch(st) {
+        case Upload::TOO_LARGE: return PAYLOAD_TOO_LARGE;
+        case Upload::NO_SPACE: return INSUFFICIENT_STORAGE;
+        case Upload::NOT_FOUND: return NO_RESOURCE;
+        default: return INTERNAL_ERROR;
+    }
+}
+
+// socket暂时没有数据时返回NO_REQUEST，等EPOLLIN后再由线程池继续
+Httpconn::HTTP_CODE Httpconn::continue_upload() {
+    long left = m_upload.left();
+    Upload::STATUS st = m_upload.splice_from(m_sockfd);
+    // 请求体没有经过read，重放时用同样长度的数据代替
+    if(m_upload.left() < left) {
+        Capture::record(m_capture_id, Capture::SKIP, NULL, left - m_upload.left());
+    }
+    if(st == Upload::AGAIN) {
+        return NO_REQUEST;
+    }
+    if(st == Upload::DONE) {
+        st = m_upload.commit();
+    }
+    else {
+        m_upload.abort();
+    }
+    if(st == Upload::DONE) {
+        // 目标文件变了，清掉缓存的大小
+        FileCache::invalidate(m_url);
+        return UPLOAD_CREATED;
+    }
+    m_linger = false;
+    switch(st) {
+        case Upload::CLOSED: return CLOSED_CONNECTION;
+        case Upload::NO_SPACE: return INSUFFICIENT_STORAGE;
+        default: return INTERNAL_ERROR;
+    }
+}
+
+// 逐跳相关的字段只对客户端到本服务器这一段有效，不转发给后端
+static bool hop_by_hop(const char *line, const char *connection) {
+    // Expect: 100-continue由本服务器回复，转给后端会收到多余的100响应
+    static const char *names[] = { "Connection:", "Keep-Alive:", "TE:", "Trailer:", "Transfer-Encoding:",
+        "Upgrade:", "Proxy-", "Content-Length:", "Expect:" };
+    for(size_t i=0; i<sizeof(names)/sizeof(names[0]); i++) {
+        if(strncasecmp(line, names[i], strlen(names[i])) == 0) {
+            return true;
+        }
+    }
+    // Connection中列出的字段也是逐跳的，如 Connection: close, X-Trace
+    const char *colon = strchr(line, ':');
+    int name_len = colon ? colon - line : 0;
+    for(const char *p = connection; p && *p; ) {
+        p += strspn(p, " \t,");
+        int len = strcspn(p, " \t,");
+        if(len > 0 && len == name_len && strncasecmp(p, line, len) == 0) {
+            return true;
+        }
+        p += len;
+    }
+    return false;
+}
+
+// 在req后面追加格式化的内容，放不下返回false
+static bool append_format(char *req, int size, int &len, const char *format, ...) {
+    va_list arg_list;
+    va_start(arg_list, format);
+    int n = vsnprintf(req + len, size - len, format, arg_list);
+    va_end(arg_list);
+    if(n < 0 || n >= size - len) {
+        return false;
+    }
+    len += n;
+    return true;
+}
+
+// 客户端的头部原样转发，去掉逐跳字段后补上本服务器的Connection、X-Forwarded-For和Content-Length
+int Httpconn::build_proxy_request(char *req, int size) {
+    static const char *method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT" };
+    char client[INET6_ADDRSTRLEN] = "unix";
+    if(m_addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((sockaddr_in *)&m_addr)->sin_addr, client, sizeof(client));
+    }
+    else if(m_addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((sockaddr_in6 *)&m_addr)->sin6_addr, client, sizeof(client));
+    }
+
+    int len = 0;
+    if(!append_format(req, size, len, "%s %s HTTP/1.1\r\n", method_names[m_method], m_url)) {
+        return -1;
+    }
+    // 解析时每行末尾的\r\n被改成了两个'\0'
+    char *begin = m_read_buf + m_header_begin;
+    char *end = m_read_buf + m_header_end;
+    const char *connection = NULL;
+    for(char *line = begin; line < end; line += strnlen(line, end - line) + 2) {
+        if(strncasecmp(line, "Connection:", 11) == 0) {
+            connection = line + 11;
+        }
+    }
+    bool forwarded = false;
+    for(char *line = begin; line < end; ) {
+        int line_len = strnlen(line, end - line);
+        bool ok = true;
+        if(hop_by_hop(line, connection)) {
+            line += line_len + 2;
+            continue;
+        }
+        if(strncasecmp(line, "X-Forwarded-For:", 16) == 0) {
+            // 已经经过其他代理，追加在后面
+            ok = append_format(req, size, len, "%.*s, %s\r\n", line_len, line, client);
+            forwarded = true;
+        }
+        else {
+            ok = append_format(req, size, len, "%.*s\r\n", line_len, line);
+        }
+        if(!ok) {
+            return -1;
+        }
+        line += line_len + 2;
+    }
+    if(!m_host && !append_format(req, size, len, "Host: localhost\r\n")) {
+        return -1;
+    }
+    if(!forwarded && !append_format(req, size, len, "X-Forwarded-For: %s\r\n", client)) {
+        return -1;
+    }
+    if(!append_format(req, size, len, "Connection: keep-alive\r\nContent-Length: %ld\r\n\r\n", m_content_len)) {
+        return -1;
+    }
+    return len;
+}
+
+// 将请求转发给后端，在工作线程中阻塞完成
+// 读缓冲区中已有的请求体和头部一起发送，其余的由continue_proxy从socket接收后转发
+Httpconn::HTTP_CODE Httpconn::do_proxy(Proxy *proxy) {
+    char req[READ_BUFFER_SIZE + 512];
+    int len = build_proxy_request(req, sizeof(req));
+    int buffered = m_read_idx - m_checked_index;
+    if(buffered > m_content_len) {
+        buffered = m_content_len;
+    }
+    if(len < 0 || len + buffered > (int)sizeof(req)) {
+        m_linger = m_linger && buffered == m_content_len;
+        return INTERNAL_ERROR;
+    }
+    memcpy(req + len, m_read_buf + m_checked_index, buffered);
+    len += buffered;
+    m_request_end = m_checked_index + buffered;
+    m_proxy_body_left = m_content_len - buffered;
+
+    // 只有GET可以在后端出错时重试或换一个后端重发，请求体要从socket接收的也不能重发
+    bool more = m_proxy_body_left > 0;
+    if(!proxy->forward(req, len, m_method == GET && !more, more, m_proxy_resp)) {
+        Proxy::release(m_proxy_resp);
+        // 请求体还留在socket中，回复错误后关闭连接
+        m_linger = m_linger && !more;
+        m_proxy_body_left = 0;
+        return BAD_GATEWAY;
+    }
+    if(!more) {
+        return PROXY_REQUEST;
+    }
+    if(m_expect_continue) {
+        static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(m_sockfd, cont, sizeof(cont) - 1, MSG_NOSIGNAL);
+    }
+    return continue_proxy();
+}
+
+// socket暂时没有数据时返回NO_REQUEST，等EPOLLIN后再由线程池继续
+Httpconn::HTTP_CODE Httpconn::continue_proxy() {
+    char buf[16 * 1024];
+    long round = 0;
+    while(m_proxy_body_left > 0) {
+        // 和响应体一样一轮最多转发BUFFER_SIZE字节，避免一个连接长期占用工作线程
+        if(round >= Proxy::BUFFER_SIZE) {
+            return NO_REQUEST;
+        }
+        int n = recv(m_sockfd, buf, m_proxy_body_left < (long)sizeof(buf) ? m_proxy_body_left : sizeof(buf), 0);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return NO_REQUEST;
+        }
+        if(n <= 0) {
+            // 请求体没传完连接就关闭了
+            Proxy::release(m_proxy_resp);
+            m_proxy_body_left = 0;
+            m_linger = false;
+            return CLOSED_CONNECTION;
+        }
+        Capture::record(m_capture_id, Capture::DATA, buf, n);
+        round += n;
+        m_proxy_body_left -= n;
+        if(!Proxy::send_body(m_proxy_resp, buf, n)) {
+            Proxy::release(m_proxy_resp);
+            m_linger = m_linger && m_proxy_body_left == 0;
+            m_proxy_body_left = 0;
+            return BAD_GATEWAY;
+        }
+    }
+    if(!Proxy::receive(m_proxy_resp)) {
+        Proxy::release(m_proxy_resp);
+        return BAD_GATEWAY;
+    }
+    return PROXY_REQUEST;
+}
+
+// 上一段响应体已经发给客户端
+Httpconn::HTTP_CODE Httpconn::relay_proxy() {
+    // 响应头已经发出，出错时只能关闭连接，客户端按长度能发现响应不完整
+    if(!Proxy::next(m_proxy_resp)) {
+        return CLOSED_CONNECTION;
+    }
+    // 后端没有给出长度，关闭连接表示响应结束
+    if(m_proxy_resp.len == 0) {
+        return CLOSED_CONNECTION;
+    }
+    return PROXY_BODY;
+}
+
+// 主线程发现文件接下来的部分不在页缓存中，在工作线程中读进来后再继续发送
+Httpconn::HTTP_CODE Httpconn::warm_file() {
+    long off = (char *)m_iv[1].iov_base - m_file_address;
+    long len = (long)m_iv[1].iov_len < ColdFile::WARM_BYTES ? (long)m_iv[1].iov_len : ColdFile::WARM_BYTES;
+    ColdFile::warm(m_file_address, off, len);
+    m_file_warming = false;
+    return FILE_BODY;
+}
+
 void Httpconn::unmap() {
     if(m_file_address) {
         munmap(m_file_address, m_file_stat.st_size);
         m_file_address = NULL;
     }
+    if(m_proxy_resp.buf || m_proxy_resp.fd != -1) {
+        Proxy::release(m_proxy_resp);
+    }
 }
 
-// 在写缓冲区中写入待发送数据
-bool Httpconn::add_response( const char* format, ... ) {
-    if(m_write_idx >= WRITE_BUFFER_SIZE) {
-        return false;
-    }
-    va_list arg_list;
-    va_start(arg_list, format);
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx,  format, arg_list);
-    if(len >= WRITE_BUFFER_SIZE - 1 - m_write_idx) {
+// 在写缓冲区中追加一段数据
+bool Httpconn::add_fragment( const char* data, int len ) {
+    if(len > WRITE_BUFFER_SIZE - 1 - m_write_idx) {
         return false;
     }
+    memcpy(m_write_buf + m_write_idx, data, len);
     m_write_idx += len;
-    va_end(arg_list);
     return true;
 }
 
+bool Httpconn::add_fragment( const Fragment &fragment ) {
+    return add_fragment(fragment.data, fragment.len);
+}
 
-bool Httpconn::add_status_line( int status, const char* title ) {
-    return add_response("%s %d %d\r\n", "HTTP/1.1", status, title);
+bool Httpconn::add_status_line( int status ) {
+    return add_fragment(status_line(status));
 }
 
-bool Httpconn::add_headers( int content_length ) {
+bool Httpconn::add_headers( long content_length, const char *path ) {
     bool ret = true;
     ret &= add_content_length(content_length);
-    ret &= add_content_type();
+    ret &= add_content_type(path);
+    ret &= add_fragment(date_header());
     ret &= add_linger();
     ret &= add_blank_line();
     return ret;
 }
 
-bool Httpconn::add_content_type() {
-    return add_response("Content-Type:%s\r\n", "text/html");
+bool Httpconn::add_content_type( const char *path ) {
+    return add_fragment(content_type(path));
 }
 
-bool Httpconn::add_content_length( int content_length ) {
-    return add_response( "Content-Length: %d\r\n", content_length );
+bool Httpconn::add_content_length( long content_length ) {
+    static const Fragment prefix = FRAGMENT("Content-Length: ");
+    // 从后往前转换十进制
+    char buf[24];
+    char *p = buf + sizeof(buf);
+    *--p = '\n';
+    *--p = '\r';
+    do {
+        *--p = '0' + content_length % 10;
+        content_length /= 10;
+    } while(content_length > 0);
+    return add_fragment(prefix) && add_fragment(p, buf + sizeof(buf) - p);
 }
 
 bool Httpconn::add_linger() {
-    return add_response( "Connection: %s\r\n", ( m_linger == true ) ? "keep-alive" : "close" );
+    static const Fragment keep_alive = FRAGMENT("Connection: keep-alive\r\n");
+    static const Fragment close = FRAGMENT("Connection: close\r\n");
+    return add_fragment(m_linger ? keep_alive : close);
 }
 
 bool Httpconn::add_blank_line() {
-    return add_response( "%s", "\r\n" );
+    return add_fragment("\r\n", 2);
+}
+
+bool Httpconn::add_content( const Fragment &content ) {
+    return add_fragment(content);
 }
 
-bool Httpconn::add_content( const char* content ) {
-    return add_response( "%s", content );
+// 错误页面
+bool Httpconn::add_error( int status, const Fragment &form ) {
+    bool ret = add_status_line(status);
+    ret &= add_headers(form.len);
+    return ret && add_content(form);
+}
+
+// 转发后端的状态行和头部，逐跳相关的字段由本服务器重新生成
+bool Httpconn::add_proxy_headers() {
+    char *head = m_proxy_resp.buf;
+    char *end = head + m_proxy_resp.head_len - 2;
+    char *line = head;
+    bool ret = true;
+    while(line < end) {
+        char *eol = (char *)memmem(line, end - line + 2, "\r\n", 2);
+        int len = eol - line;
+        if(line == head || (strncasecmp(line, "Connection:", 11) && strncasecmp(line, "Keep-Alive:", 11) &&
+            strncasecmp(line, "Content-Length:", 15) && strncasecmp(line, "Transfer-Encoding:", 18))) {
+            ret &= add_fragment(line, len + 2);
+        }
+        line = eol + 2;
+    }
+    if(m_proxy_resp.body_len >= 0) {
+        ret &= add_content_length(m_proxy_resp.body_len);
+    }
+    ret &= add_linger();
+    ret &= add_blank_line();
+    return ret;
 }
 
 bool Httpconn::process_write(Httpconn::HTTP_CODE ret) {
     switch(ret) {
         case INTERNAL_ERROR: {
-            add_status_line(500, error_500_title);
-            add_headers(strlen(error_500_form));
-            if(!add_content(error_500_form)) {
+            if(!add_error(500, error_500_form)) {
                 return false;
             }
             break;
         }
         case BAD_REQUEST: {
-            add_status_line(400, error_400_title);
-            add_headers(strlen(error_400_form));
-            if(!add_content(error_400_form)) {
+            if(!add_error(400, error_400_form)) {
                 return false;
             }
             break;
         }
         case NO_RESOURCE: {
-            add_status_line(404, error_404_title);
-            add_headers(strlen(error_404_form));
-            if(!add_content(error_404_form)) {
+            if(!add_error(404, error_404_form)) {
                 return false;
             }
             break;
         }
         case FORBIDDEN_REQUEST: {
-            add_status_line(403, error_403_title);
-            add_headers(strlen(error_403_form));
-            if(!add_content(error_403_form)) {
+            if(!add_error(403, error_403_form)) {
+                return false;
+            }
+            break;
+        }
+        case TOO_MANY_REQUESTS: {
+            if(!add_error(429, error_429_form)) {
+                return false;
+            }
+            break;
+        }
+        case PAYLOAD_TOO_LARGE: {
+            if(!add_error(413, error_413_form)) {
                 return false;
             }
             break;
         }
+        case INSUFFICIENT_STORAGE: {
+            if(!add_error(507, error_507_form)) {
+                return false;
+            }
+            break;
+        }
+        case URI_TOO_LONG: {
+            if(!add_error(414, error_414_form)) {
+                return false;
+            }
+            break;
+        }
+        case UPLOAD_CREATED: {
+            if(!add_status_line(201) || !add_headers(0)) {
+                return false;
+            }
+            break;
+        }
+        case WEBSOCKET_UPGRADE: {
+            static const Fragment upgrade = FRAGMENT("HTTP/1.1 101 Switching Protocols\r\n"
+                "Upgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ");
+            char accept[32];
+            WebSocket::accept_key(m_ws_key, accept);
+            m_linger = true;
+            m_ws_accepted = true;
+            if(!add_fragment(upgrade) || !add_fragment(accept, strlen(accept)) || !add_fragment("\r\n\r\n", 4)) {
+                return false;
+            }
+            break;
+        }
+        case BAD_HANDSHAKE:
+        case UPGRADE_REQUIRED: {
+            // 告知客户端支持的协议版本，426还必须带上Upgrade
+            static const Fragment version = FRAGMENT("Sec-WebSocket-Version: 13\r\n");
+            static const Fragment upgrade = FRAGMENT("Upgrade: websocket\r\n");
+            int status = ret == BAD_HANDSHAKE ? 400 : 426;
+            const Fragment &form = ret == BAD_HANDSHAKE ? error_400_form : error_426_form;
+            if(!add_status_line(status) || !add_fragment(version) || (status == 426 && !add_fragment(upgrade)) ||
+                !add_headers(form.len) || !add_content(form)) {
+                return false;
+            }
+            break;
+        }
+        case BAD_GATEWAY: {
+            if(!add_error(502, error_502_form)) {
+                return false;
+            }
+            break;
+        }
+        case PROXY_REQUEST: {
+            // 后端没有给出长度时以关闭连接表示响应结束
+            if(m_proxy_resp.body_len < 0) {
+                m_linger = false;
+            }
+            // 后端的头部放不进写缓冲区，丢掉已生成的部分改为返回502
+            if(!add_proxy_headers()) {
+                printf("upstream response header is too large\n");
+                m_write_idx = 0;
+                unmap();
+                return process_write(BAD_GATEWAY);
+            }
+            m_iv[0].iov_base = m_write_buf;
+            m_iv[0].iov_len = m_write_idx;
+            m_iv[1].iov_base = m_proxy_resp.data;
+            m_iv[1].iov_len = m_proxy_resp.len;
+            m_iv_count = 2;
+            bytes_to_send = m_write_idx + m_proxy_resp.len;
+            return true;
+        }
+        case FILE_BODY: {
+            // 继续发送，m_iv保持不变
+            return true;
+        }
+        case PROXY_BODY: {
+            m_iv[0].iov_len = 0;
+            m_iv[1].iov_base = m_proxy_resp.data;
+            m_iv[1].iov_len = m_proxy_resp.len;
+            m_iv_count = 2;
+            bytes_to_send = m_proxy_resp.len;
+            return true;
+        }
         case FILE_REQUEST: {
-            add_status_line(200, ok_200_title);
-            add_headers(m_file_stat.st_size);
+            add_status_line(200);
+            add_headers(m_file_stat.st_size, m_real_file);
             m_iv[0].iov_base = m_write_buf;
             m_iv[0].iov_len = m_write_idx;
             m_iv[1].iov_base = m_file_address;
@@ -449,17 +1034,80 @@ bool Httpconn::process_write(Httpconn::HTTP_CODE ret) {
 bool Httpconn::write() {
     int temp = 0;
     if(bytes_to_send == 0) {
-        modifyfd(m_epollfd, m_sockfd, EPOLLIN);
+        if(!m_coroutine) {
+            modifyfd(m_epollfd, m_sockfd, EPOLLIN);
+        }
         init();
         return true;
     }
 
+    Trace::stamp_once(m_ts, Trace::WRITE_BEGIN);
+    // 本次事件的发送额度，开启限速时还受令牌数限制
+    long budget = SendSched::quantum() > 0 && !m_coroutine ? SendSched::quantum() : LONG_MAX;
+    bool throttled = false;
+    uint64_t now = 0;
+    if(SendSched::rate() > 0 && !m_coroutine) {
+        now = SendSched::now_ns();
+        m_send_tokens += (now - m_send_last_ns) / 1e9 * SendSched::rate();
+        if(m_send_tokens > SendSched::burst()) {
+            m_send_tokens = SendSched::burst();
+        }
+        m_send_last_ns = now;
+        if(m_send_tokens < budget) {
+            budget = (long)m_send_tokens;
+            throttled = true;
+        }
+    }
+    long sent = 0;
     while(true) {
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        if(sent >= budget) {
+            // 额度用完，让出主线程，由SendSched安排下一次发送
+            if(throttled) {
+                long need = bytes_to_send < SendSched::burst() ? bytes_to_send : SendSched::burst();
+                uint64_t wait = (uint64_t)((need - m_send_tokens) * 1e9 / SendSched::rate());
+                SendSched::delay(this, m_sockfd, now + wait);
+            }
+            else {
+                SendSched::yield(this, m_sockfd);
+            }
+            return true;
+        }
+        // 文件内容不在页缓存中时writev会在主线程中缺页阻塞，只发送已确认在内存中的部分，
+        // 头部发完后还是不在内存中就交给线程池预热。协程模式下没有线程池，不检查
+        long body_limit = LONG_MAX;
+        if(m_file_address && m_iv[1].iov_len > 0 && !m_coroutine) {
+            long off = (char *)m_iv[1].iov_base - m_file_address;
+            if(off >= m_file_resident) {
+                long len = (long)m_iv[1].iov_len < ColdFile::WARM_BYTES ? (long)m_iv[1].iov_len : ColdFile::WARM_BYTES;
+                long n = ColdFile::resident_bytes(m_file_address, off, len);
+                if(n == 0 && m_iv[0].iov_len == 0) {
+                    m_file_warming = true;
+                    return true;
+                }
+                m_file_resident = off + n;
+            }
+            body_limit = m_file_resident - off;
+        }
+        // 只发送额度以内的部分
+        struct iovec iv[2];
+        long limit = budget - sent;
+        for(int i=0; i<m_iv_count; i++) {
+            iv[i] = m_iv[i];
+            if((long)iv[i].iov_len > limit) {
+                iv[i].iov_len = limit;
+            }
+            if(i == 1 && (long)iv[i].iov_len > body_limit) {
+                iv[i].iov_len = body_limit;
+            }
+            limit -= iv[i].iov_len;
+        }
+        temp = writev(m_sockfd, iv, m_iv_count);
         if(temp <= -1) {
             // 如果TCP没有写缓冲空间
             if(errno == EAGAIN) {
-                modifyfd(m_epollfd, m_sockfd, EPOLLOUT);
+                if(!m_coroutine) {
+                    modifyfd(m_epollfd, m_sockfd, EPOLLOUT);
+                }
                 return true;
             }
             unmap();
@@ -469,23 +1117,54 @@ bool Httpconn::write() {
 
         bytes_have_send += temp;
         bytes_to_send -= temp;
+        sent += temp;
+        m_send_tokens -= temp;
+        PROBE3(writev, m_sockfd, temp, bytes_to_send);
 
-        if(bytes_have_send >= m_iv[0].iov_len) {
+        // 头部已经发完，只剩响应体
+        if(temp >= (int)m_iv[0].iov_len) {
+            int body = temp - m_iv[0].iov_len;
             m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
+            if(body > 0) {
+                m_iv[1].iov_base = (char *)m_iv[1].iov_base + body;
+                m_iv[1].iov_len -= body;
+            }
         }
         else {
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - temp;
+            m_iv[0].iov_base = (char *)m_iv[0].iov_base + temp;
+            m_iv[0].iov_len -= temp;
         }
 
+        // 这一段响应体发完了，后端还有数据，由线程池读入下一段
+        if(bytes_to_send <= 0 && m_proxy_resp.fd != -1) {
+            return true;
+        }
         // 发送完数据
         if(bytes_to_send <= 0) {
             unmap();
-            modifyfd(m_epollfd, m_sockfd, EPOLLIN);
+            Trace::stamp(m_ts, Trace::WRITE_END);
+            Trace::record(m_ts, m_sockfd, m_url);
+            Prefork::on_response(bytes_have_send);
             if(m_linger) {
+                // 把流水线中已经读到的后续请求移到缓冲区开头
+                // 只有真正回复了101才切换，请求头带Upgrade但没有升级的连接仍然是HTTP
+                bool upgrade = m_ws_accepted;
+                int left = m_read_idx - m_request_end;
+                memmove(m_read_buf, m_read_buf + m_request_end, left);
                 init();
+                m_read_idx = left;
+                if(upgrade) {
+                    return ws_open();
+                }
+                // 流水线中的下一个请求不会再经过read()，已经在缓冲区中的部分从这里开始计时
+                if(left > 0) {
+                    Trace::stamp(m_ts, Trace::READ_BEGIN);
+                    Trace::stamp(m_ts, Trace::READ_END);
+                }
+                // 有待处理的请求时由主线程直接交给线程池，不再等待EPOLLIN
+                if(!has_pending() && !m_coroutine) {
+                    modifyfd(m_epollfd, m_sockfd, EPOLLIN);
+                }
                 return true;
             }
             else {
@@ -498,22 +1177,323 @@ bool Httpconn::write() {
 }
 
 
-// 由线程池中的线程调用
+// 从还没解析的请求行中取出URL，查询缓存的文件大小
+// 0: 已知的小文件  1: 未知(第一次访问、反向代理等)  2: 已知的大文件
+int Httpconn::sched_class() {
+    // 后端响应的下一段和文件预热，和大文件一样排在后面
+    if(m_proxy_resp.fd != -1 || m_file_warming) {
+        return 2;
+    }
+    // 同一个请求的后续数据，继续处理
+    if(m_checked_index > 0) {
+        return 0;
+    }
+    char *end = m_read_buf + m_read_idx;
+    char *url = (char *)memchr(m_read_buf, ' ', m_read_idx);
+    if(!url) {
+        return 1;
+    }
+    url++;
+    char *url_end = (char *)memchr(url, ' ', end - url);
+    long size;
+    if(!url_end || !FileCache::lookup(url, url_end - url, size)) {
+        return 1;
+    }
+    return size <= SMALL_FILE_SIZE ? 0 : 2;
+}
+
+Httpconn::HTTP_CODE Httpconn::parse_request() {
+    Trace::stamp(m_ts, Trace::DEQUEUE);
+    // 新请求开始时按客户端IP限速，被拒绝的请求不再解析
+    HTTP_CODE read_ret;
+    if(m_upload.active()) {
+        // 上一轮没有收完的请求体
+        read_ret = continue_upload();
+    }
+    else if(m_proxy_body_left > 0) {
+        read_ret = continue_proxy();
+    }
+    else if(m_proxy_resp.fd != -1) {
+        read_ret = relay_proxy();
+    }
+    else if(m_file_warming) {
+        read_ret = warm_file();
+    }
+    else if(m_check_state == CHECK_STATE_REQUESTLINE && m_checked_index == 0 && !IpLimit::on_request(m_addr)) {
+        read_ret = TOO_MANY_REQUESTS;
+    }
+    else {
+        // 解析HTTP请求
+        read_ret = process_read();
+        PROBE2(parse, m_sockfd, read_ret);
+    }
+    if(read_ret == NO_REQUEST && m_read_idx >= READ_BUFFER_SIZE && !is_uploading()) {
+        // 读缓冲区已满仍然不是完整的请求
+        read_ret = BAD_REQUEST;
+    }
+    if(read_ret == BAD_REQUEST || read_ret == TOO_MANY_REQUESTS) {
+        // 回复错误后关闭连接，不再解析后面的数据
+        m_linger = false;
+    }
+    return read_ret;
+}
+
+// 由线程池中的线程调用，epoll相关的操作都通过完成队列交给主线程
 void Httpconn::process() {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if(read_ret == BAD_REQUEST) {
-        modifyfd(m_epollfd, m_sockfd, EPOLLIN);
+    HTTP_CODE read_ret = parse_request();
+    if(read_ret == NO_REQUEST) {
+        // 请求还不完整，继续读
+        m_completions->post(m_sockfd, CompletionQueue::READ);
         return;
     }
     puts("解析http请求中");
     // 生成响应
     bool write_ret = process_write(read_ret);
-    if(!write_ret) {
-        close_conn();
-    }
-    modifyfd(m_epollfd, m_sockfd, EPOLLOUT);
+    Trace::stamp(m_ts, Trace::PROCESSED);
     puts("生成响应");
     printf("read ret = %d write ret=%d\n", read_ret, write_ret);
-    printf("响应头：%s\n", m_write_buf);
-}
\ No newline at end of file
+    printf("响应头：%.*s\n", m_write_idx, m_write_buf);
+    // 投递之后连接归主线程所有，不能再访问成员
+    m_completions->post(m_sockfd, write_ret ? CompletionQueue::WRITE : CompletionQueue::CLOSE);
+}
+void Httpconn::EventAwaiter::await_suspend(std::coroutine_handle<> h) {
+    conn->m_co = h;
+    modifyfd(m_epollfd, conn->m_sockfd, event);
+}
+
+// 协程模式：在主线程中依次读请求、解析、生成响应、发送，直到连接关闭
+// do_request也在主线程中执行，适合文件都在页缓存中的场景
+ConnTask Httpconn::serve() {
+    bool alive = true;
+    while(alive) {
+        co_await wait_event(EPOLLIN);
+        // 上传的请求体由parse_request直接从socket接收
+        alive = m_upload.active() || read();
+        // 处理缓冲区中所有完整的请求
+        while(alive) {
+            HTTP_CODE ret = parse_request();
+            if(ret == NO_REQUEST) {
+                break;
+            }
+            alive = process_write(ret);
+            Trace::stamp(m_ts, Trace::PROCESSED);
+            while(alive) {
+                alive = write();
+                if(!alive || bytes_to_send == 0) {
+                    break;
+                }
+                co_await wait_event(EPOLLOUT);
+            }
+            if(!has_pending()) {
+                break;
+            }
+        }
+    }
+    close_conn();
+}
+
+bool Httpconn::ws_open() {
+    m_websocket = true;
+    WebSocket::subscribe(this);
+    // 客户端可能紧跟着握手发来了帧
+    return ws_parse() && ws_flush();
+}
+
+bool Httpconn::ws_handle(int events) {
+    if(events & EPOLLIN) {
+        if(!read() || !ws_parse()) {
+            return false;
+        }
+    }
+    return ws_flush();
+}
+
+// 数据帧的负载可以比读缓冲区大，收到多少就去掉掩码拼到m_ws_message中，
+// 消息的最后一个分片收完后整条广播；控制帧很短，等完整收到后再处理
+bool Httpconn::ws_parse() {
+    int pos = 0;
+    while(!m_ws_closing) {
+        if(m_ws_left > 0) {
+            int n = m_read_idx - pos;
+            if(n == 0) {
+                break;
+            }
+            if((uint64_t)n > m_ws_left) {
+                n = m_ws_left;
+            }
+            // 按已收到的字节数转动掩码
+            uint8_t mask[4];
+            for(int i=0; i<4; i++) {
+                mask[i] = m_ws_mask[(m_ws_mask_pos + i) % 4];
+            }
+            char *payload = m_read_buf + pos;
+            WebSocket::unmask(payload, n, mask);
+            m_ws_message.append(payload, n);
+            m_ws_mask_pos += n;
+            m_ws_left -= n;
+            pos += n;
+        }
+        // 消息的最后一个分片收完了
+        if(m_ws_left == 0 && m_ws_fin) {
+            WebSocket::broadcast(m_ws_opcode, m_ws_message.data(), m_ws_message.size());
+            m_ws_opcode = 0;
+            m_ws_fin = false;
+            // 大消息用完后释放内存
+            if(m_ws_message.capacity() > (size_t)READ_BUFFER_SIZE * 32) {
+                std::string().swap(m_ws_message);
+            }
+            m_ws_message.clear();
+        }
+        if(m_ws_left > 0 || m_read_idx - pos < 2) {
+            break;
+        }
+
+        unsigned char *p = (unsigned char *)m_read_buf + pos;
+        int avail = m_read_idx - pos;
+        bool fin = p[0] & 0x80;
+        int opcode = p[0] & 0x0f;
+        // 客户端发来的帧必须带掩码
+        if(!(p[1] & 0x80)) {
+            return false;
+        }
+        uint64_t len = p[1] & 0x7f;
+        int hdr = 2;
+        if(len == 126) {
+            if(avail < 4) {
+                break;
+            }
+            len = (uint64_t)p[2] << 8 | p[3];
+            hdr = 4;
+        }
+        else if(len == 127) {
+            if(avail < 10) {
+                break;
+            }
+            len = 0;
+            for(int i=0; i<8; i++) {
+                len = len << 8 | p[2 + i];
+            }
+            hdr = 10;
+        }
+        if(avail < hdr + 4) {
+            break;
+        }
+
+        if(opcode == WebSocket::TEXT || opcode == WebSocket::BINARY || opcode == WebSocket::CONTINUATION) {
+            // 分片必须以TEXT或BINARY开始，以CONTINUATION继续，中间不能开始新的消息
+            if((opcode == WebSocket::CONTINUATION) != (m_ws_opcode != 0)) {
+                ws_fail(1002);
+                break;
+            }
+            if(len > WebSocket::MAX_MESSAGE - m_ws_message.size()) {
+                ws_fail(1009);
+                break;
+            }
+            if(opcode != WebSocket::CONTINUATION) {
+                m_ws_opcode = opcode;
+            }
+            memcpy(m_ws_mask, p + hdr, 4);
+            m_ws_mask_pos = 0;
+            m_ws_left = len;
+            m_ws_fin = fin;
+            pos += hdr + 4;
+            continue;
+        }
+
+        // 控制帧不能分片，负载不超过125字节，可以插在数据帧的分片之间
+        if(!(opcode & 0x8) || !fin || len > WebSocket::MAX_CONTROL) {
+            ws_fail(1002);
+            break;
+        }
+        if(avail < hdr + 4 + (int)len) {
+            break;
+        }
+        uint8_t mask[4];
+        memcpy(mask, p + hdr, 4);
+        char *payload = (char *)p + hdr + 4;
+        WebSocket::unmask(payload, len, mask);
+        pos += hdr + 4 + len;
+
+        switch(opcode) {
+            case WebSocket::PING: {
+                ws_send(WebSocket::encode(WebSocket::PONG, payload, len));
+                break;
+            }
+            case WebSocket::CLOSE: {
+                // 回复关闭帧，发送完后关闭连接，之后的数据都丢弃
+                m_ws_closing = true;
+                ws_send(WebSocket::encode(WebSocket::CLOSE, payload, len < 2 ? len : 2));
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    // 已经决定关闭连接，剩下的数据都丢弃
+    if(m_ws_closing) {
+        pos = m_read_idx;
+    }
+    memmove(m_read_buf, m_read_buf + pos, m_read_idx - pos);
+    m_read_idx -= pos;
+    return true;
+}
+
+void Httpconn::ws_fail(int code) {
+    char payload[2] = { (char)(code >> 8), (char)code };
+    m_ws_closing = true;
+    ws_send(WebSocket::encode(WebSocket::CLOSE, payload, sizeof(payload)));
+}
+
+bool Httpconn::ws_send(const WsFrame &frame) {
+    if(m_ws_queue.size() >= WebSocket::MAX_QUEUE) {
+        // 消费太慢的连接直接断开，由主循环在收到EPOLLHUP时关闭
+        shutdown(m_sockfd, SHUT_RDWR);
+        return false;
+    }
+    bool idle = m_ws_queue.empty();
+    m_ws_queue.push_back(frame);
+    // 队列原来不空时已经在等待EPOLLOUT
+    if(idle && !ws_flush()) {
+        shutdown(m_sockfd, SHUT_RDWR);
+        return false;
+    }
+    return true;
+}
+
+bool Httpconn::ws_flush() {
+    while(!m_ws_queue.empty()) {
+        struct iovec iov[64];
+        int n = 0;
+        for(std::list<WsFrame>::iterator it = m_ws_queue.begin(); it != m_ws_queue.end() && n < 64; ++it, ++n) {
+            size_t off = n == 0 ? m_ws_offset : 0;
+            iov[n].iov_base = (void *)((*it)->data() + off);
+            iov[n].iov_len = (*it)->size() - off;
+        }
+        ssize_t ret = writev(m_sockfd, iov, n);
+        if(ret < 0) {
+            if(errno == EAGAIN) {
+                modifyfd(m_epollfd, m_sockfd, EPOLLIN | EPOLLOUT);
+                return true;
+            }
+            return false;
+        }
+        // 弹出已经发完的帧
+        while(ret > 0) {
+            size_t left = m_ws_queue.front()->size() - m_ws_offset;
+            if((size_t)ret >= left) {
+                ret -= left;
+                m_ws_queue.pop_front();
+                m_ws_offset = 0;
+            }
+            else {
+                m_ws_offset += ret;
+                ret = 0;
+            }
+        }
+    }
+    if(m_ws_closing) {
+        return false;
+    }
+    modifyfd(m_epollfd, m_sockfd, EPOLLIN);
+    return true;
+}
@@ -22,10 +22,27 @@
 
 #include "locker.h"
 #include "threadpool.h"
+#include "proxy.h"
+#include "httpheader.h"
+#include "trace.h"
+#include "iplimit.h"
+#include "coroutine.h"
+#include "completion.h"
+#include "filecache.h"
+#include "coldfile.h"
+#include "websocket.h"
+#include "listener.h"
+#include "probes.h"
+#include "upload.h"
+#include "sendsched.h"
+#include "prefork.h"
+#include "capture.h"
 
 class Httpconn {
+    friend class SendSched;
+    friend class Harness;                               // test/harness.h，在进程内驱动连接
 public:
-    // HTTP请求方法，这里只支持GET
+    // HTTP请求方法，这里只支持GET，上传和反向代理还支持PUT、POST
     enum METHOD {GET = 0, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT};
     
     /*
@@ -46,8 +63,21 @@ public:
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
+        PROXY_REQUEST       :   反向代理请求，已拿到后端的响应头
+        PROXY_BODY          :   已从后端读入下一段响应体
+        FILE_BODY           :   文件接下来要发送的部分已经预热
+        BAD_GATEWAY         :   后端全部不可用
+        TOO_MANY_REQUESTS   :   客户端IP请求过于频繁
+        WEBSOCKET_UPGRADE   :   升级为WebSocket连接
+        UPLOAD_CREATED      :   上传完成
+        PAYLOAD_TOO_LARGE   :   上传的文件超过大小上限
+        INSUFFICIENT_STORAGE:   磁盘空间不足
+        URI_TOO_LONG        :   URL拼上网站根目录后超过FILENAME_LEN
+        BAD_HANDSHAKE       :   WebSocket握手请求不合法
+        UPGRADE_REQUIRED    :   不支持客户端的WebSocket协议版本
     */
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION, PROXY_REQUEST, PROXY_BODY, FILE_BODY, BAD_GATEWAY, TOO_MANY_REQUESTS, WEBSOCKET_UPGRADE,
+        UPLOAD_CREATED, PAYLOAD_TOO_LARGE, INSUFFICIENT_STORAGE, URI_TOO_LONG, BAD_HANDSHAKE, UPGRADE_REQUIRED };
     
     // 从状态机的三种可能状态，即行的读取状态，分别表示
     // 1.读取到一个完整的行 2.行出错 3.行数据尚且不完整
@@ -58,29 +88,54 @@ public:
     ~Httpconn() = default;
 
     void process();                                     // 处理客户端请求
-    void init(int sockfd, const sockaddr_in &addr);     // 初始化新连接
+    int sched_class();                                  // 入队前估计请求的开销，用于线程池调度
+    bool is_websocket() const { return m_websocket; }
+    bool is_uploading() const {                         // 请求体还在接收中，不能再用read()读
+        return m_upload.active() || m_proxy_body_left > 0;
+    }
+    bool ws_handle(int events);                         // 主线程处理WebSocket连接上的事件
+    bool ws_send(const WsFrame &frame);                 // 帧放入发送队列并尝试发送
+    ConnTask serve();                                   // 协程模式下处理整个连接
+    void resume() {                                     // 协程模式下事件到来时恢复协程
+        std::coroutine_handle<> h = m_co;
+        if(h) {
+            m_co = nullptr;
+            h.resume();
+        }
+    }
+    void init(int sockfd, const sockaddr_storage &addr, Listener *listener);   // 初始化新连接
     void close_conn();                                  // 关闭连接 
     bool read();                                        // 非阻塞读
     bool write();                                       // 非阻塞写
+    bool has_pending() const {                          // 响应已发完且缓冲区中还有流水线请求，或者需要线程池准备响应的下一段
+        return m_file_warming || ((m_read_idx > 0 || m_proxy_resp.fd != -1) && bytes_to_send == 0);
+    }
    
 
 public:
     static const int READ_BUFFER_SIZE = 2048;   // 读缓冲区的大小
     static const int WRITE_BUFFER_SIZE = 2048;  // 写缓冲区的大小
     static const int FILENAME_LEN = 200;        // 文件名的最大长度
+    static const long SMALL_FILE_SIZE = 64 * 1024;  // 不超过这个大小的文件优先调度
     static int m_epollfd;
     static int m_user_count;
+    static bool m_coroutine;                    // 协程模式，由协程负责epoll事件的注册
+    static CompletionQueue *m_completions;      // 工作线程处理完后通知主线程
 
     
 
 private:
     int m_sockfd;
-    sockaddr_in m_addr;
+    sockaddr_storage m_addr;
+    Listener *m_listener;                   // 接受该连接的监听地址
 
     char m_read_buf[READ_BUFFER_SIZE];      // 读缓冲区
     int m_read_idx;                         // 标识该读的起始下标
     int m_checked_index;                    // 下一个该从缓冲区取字符的位置
     int m_start_line;                       // 当前解析的行的起始位置
+    int m_request_end;                      // 当前请求在读缓冲区中的结束位置
+    int m_header_begin;                     // 头部字段在读缓冲区中的范围，每行以两个'\0'结尾
+    int m_header_end;                       // 结束的空行所在位置
 
     CHECK_STATE m_check_state;              // 主状态机所处状态
 
@@ -89,21 +144,64 @@ private:
     METHOD m_method;                        // 请求方法
     char *m_host;                           // 主机名
     bool m_linger;                          // 是否保持连接
-    int m_content_len;                      // HTTP请求的消息总长度
+    long m_content_len;                     // HTTP请求的消息总长度
+    char *m_content;                        // 请求体
     char m_real_file[FILENAME_LEN];         // 请求的目标文件的完整路径
 
     char m_write_buf[WRITE_BUFFER_SIZE];    // 写缓冲区
     int m_write_idx;                        // 写缓冲区中待发送的字节数
     struct stat m_file_stat;                // 目标文件的状态
     char *m_file_address;                   // 目标文件被mmap到内存中的起始位置
+    long m_file_resident;                   // 文件中已确认在页缓存中的部分的结束位置
+    bool m_file_warming;                    // 接下来要发送的部分不在页缓存中，等工作线程预热
     struct iovec m_iv[2];                   
     int m_iv_count;                         // 表示被写内存块的数量
     int bytes_to_send;
     int bytes_have_send;
+    ProxyResponse m_proxy_resp;             // 反向代理时后端的响应
+    long m_proxy_body_left;                 // 还没有转发给后端的请求体字节数
+    uint64_t m_ts[Trace::POINT_COUNT];      // 各阶段的时间戳
+    std::coroutine_handle<> m_co;           // 挂起等待事件的协程
+
+    bool m_ws_upgrade;                      // 请求头要求升级为WebSocket
+    bool m_ws_accepted;                     // 已生成101响应，发送完后切换为WebSocket
+    char *m_ws_key;                         // Sec-WebSocket-Key
+    int m_ws_version;                       // Sec-WebSocket-Version，没有时为0
+    bool m_conn_upgrade;                    // Connection中有Upgrade
+    bool m_websocket;                       // 已经升级为WebSocket连接
+    bool m_ws_closing;                      // 已回复关闭帧，发送完后关闭连接
+    std::list<WsFrame> m_ws_queue;          // 待发送的帧，广播时多个连接共享同一帧
+    size_t m_ws_offset;                     // 队头帧已发送的字节数
+    std::string m_ws_message;               // 正在拼接的消息，已去掉掩码
+    int m_ws_opcode;                        // 正在拼接的消息的类型，0表示没有
+    uint64_t m_ws_left;                     // 当前数据帧还没收到的负载字节数
+    uint8_t m_ws_mask[4];                   // 当前数据帧的掩码
+    unsigned m_ws_mask_pos;                 // 当前数据帧已收到的负载字节数，决定掩码的相位
+    bool m_ws_fin;                          // 当前数据帧是消息的最后一个分片
+
+    Upload m_upload;                        // 正在接收的上传请求体
+    bool m_expect_continue;                 // 请求头中有Expect: 100-continue
+
+    bool m_send_queued;                     // 在SendSched的队列中等待继续发送
+    double m_send_tokens;                   // 限速时可以发送的字节数
+    uint64_t m_send_last_ns;                // 上次补充令牌的时间
+
+    uint32_t m_capture_id;                  // 录制流量时的连接编号，0表示不录制
     
 
 
 private:
+    // 协程等待fd上的事件
+    struct EventAwaiter {
+        Httpconn *conn;
+        int event;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        void await_resume() const noexcept {}
+    };
+    EventAwaiter wait_event(int event) { return EventAwaiter{this, event}; }
+
+    HTTP_CODE parse_request();                      // 限速检查并解析请求
     HTTP_CODE process_read();                       // 解析HTTP请求
     HTTP_CODE parse_request_line(char *text);       // 解析首行
     HTTP_CODE parse_headers(char *text);            // 解析请求头
@@ -116,17 +214,32 @@ private:
         return m_read_buf + m_start_line;
     }
     HTTP_CODE do_request();
+    HTTP_CODE do_upload();                          // 开始接收上传的请求体
+    HTTP_CODE continue_upload();                    // 继续接收，完成后提交
+    HTTP_CODE do_proxy(Proxy *proxy);
+    HTTP_CODE continue_proxy();                     // 继续转发请求体，完成后读取响应头
+    HTTP_CODE relay_proxy();                        // 读入下一段响应体
+    HTTP_CODE warm_file();                          // 预热文件接下来要发送的部分
+    int build_proxy_request(char *req, int size);   // 转发给后端的请求行和头部，放不下返回-1
+
+    bool ws_open();                                 // 握手完成，切换为WebSocket连接
+    bool ws_parse();                                // 解析读缓冲区中的帧，数据帧的负载边收边拼接
+    void ws_fail(int code);                         // 回复带状态码的关闭帧，发送完后关闭连接
+    bool ws_flush();                                // 发送队列中的帧
 
     void unmap();
     bool process_write(HTTP_CODE ret);                       // 填充HTTP响应
-    bool add_response( const char* format, ... );
-    bool add_content_type();
-    bool add_status_line( int status, const char* title );
-    bool add_headers( int content_length );
-    bool add_content_length( int content_length );
+    bool add_fragment( const char* data, int len );
+    bool add_fragment( const Fragment &fragment );
+    bool add_content_type( const char *path );
+    bool add_status_line( int status );
+    bool add_headers( long content_length, const char *path = NULL );
+    bool add_content_length( long content_length );
     bool add_linger();
     bool add_blank_line();
-    bool add_content( const char* content );
+    bool add_content( const Fragment &content );
+    bool add_error( int status, const Fragment &form );
+    bool add_proxy_headers();
 };
 
 
@@ -0,0 +1,134 @@
+#include "httpheader.h"
+#include <cstring>
+#include <ctime>
+#include <sys/time.h>
+
+const Fragment &status_line(int status) {
+    static const Fragment ok_200 = FRAGMENT("HTTP/1.1 200 OK\r\n");
+    static const Fragment created_201 = FRAGMENT("HTTP/1.1 201 Created\r\n");
+    static const Fragment error_400 = FRAGMENT("HTTP/1.1 400 Bad Request\r\n");
+    static const Fragment error_403 = FRAGMENT("HTTP/1.1 403 Forbidden\r\n");
+    static const Fragment error_404 = FRAGMENT("HTTP/1.1 404 Not Found\r\n");
+    static const Fragment error_413 = FRAGMENT("HTTP/1.1 413 Payload Too Large\r\n");
+    static const Fragment error_414 = FRAGMENT("HTTP/1.1 414 URI Too Long\r\n");
+    static const Fragment error_426 = FRAGMENT("HTTP/1.1 426 Upgrade Required\r\n");
+    static const Fragment error_429 = FRAGMENT("HTTP/1.1 429 Too Many Requests\r\n");
+    static const Fragment error_500 = FRAGMENT("HTTP/1.1 500 Internal Error\r\n");
+    static const Fragment error_502 = FRAGMENT("HTTP/1.1 502 Bad Gateway\r\n");
+    static const Fragment error_507 = FRAGMENT("HTTP/1.1 507 Insufficient Storage\r\n");
+
+    switch(status) {
+        case 200: return ok_200;
+        case 201: return created_201;
+        case 400: return error_400;
+        case 403: return error_403;
+        case 404: return error_404;
+        case 413: return error_413;
+        case 414: return error_414;
+        case 426: return error_426;
+        case 429: return error_429;
+        case 502: return error_502;
+        case 507: return error_507;
+        default: return error_500;
+    }
+}
+
+// 扩展名 -> Content-Type
+struct MimeEntry {
+    const char *ext;
+    Fragment header;
+};
+
+static const MimeEntry mime_table[] = {
+    { "",     FRAGMENT("Content-Type: text/html\r\n") },
+    { "html", FRAGMENT("Content-Type: text/html\r\n") },
+    { "htm",  FRAGMENT("Content-Type: text/html\r\n") },
+    { "css",  FRAGMENT("Content-Type: text/css\r\n") },
+    { "js",   FRAGMENT("Content-Type: application/javascript\r\n") },
+    { "json", FRAGMENT("Content-Type: application/json\r\n") },
+    { "txt",  FRAGMENT("Content-Type: text/plain\r\n") },
+    { "xml",  FRAGMENT("Content-Type: application/xml\r\n") },
+    { "png",  FRAGMENT("Content-Type: image/png\r\n") },
+    { "jpg",  FRAGMENT("Content-Type: image/jpeg\r\n") },
+    { "jpeg", FRAGMENT("Content-Type: image/jpeg\r\n") },
+    { "gif",  FRAGMENT("Content-Type: image/gif\r\n") },
+    { "svg",  FRAGMENT("Content-Type: image/svg+xml\r\n") },
+    { "ico",  FRAGMENT("Content-Type: image/x-icon\r\n") },
+    { "webp", FRAGMENT("Content-Type: image/webp\r\n") },
+    { "woff", FRAGMENT("Content-Type: font/woff\r\n") },
+    { "woff2",FRAGMENT("Content-Type: font/woff2\r\n") },
+    { "mp4",  FRAGMENT("Content-Type: video/mp4\r\n") },
+    { "pdf",  FRAGMENT("Content-Type: application/pdf\r\n") },
+    { "wasm", FRAGMENT("Content-Type: application/wasm\r\n") },
+    { "bin",  FRAGMENT("Content-Type: application/octet-stream\r\n") },
+};
+
+static int mime_index(const char *ext) {
+    switch(ext_hash(ext)) {
+        case ext_hash("html"):  return 1;
+        case ext_hash("htm"):   return 2;
+        case ext_hash("css"):   return 3;
+        case ext_hash("js"):    return 4;
+        case ext_hash("json"):  return 5;
+        case ext_hash("txt"):   return 6;
+        case ext_hash("xml"):   return 7;
+        case ext_hash("png"):   return 8;
+        case ext_hash("jpg"):   return 9;
+        case ext_hash("jpeg"):  return 10;
+        case ext_hash("gif"):   return 11;
+        case ext_hash("svg"):   return 12;
+        case ext_hash("ico"):   return 13;
+        case ext_hash("webp"):  return 14;
+        case ext_hash("woff"):  return 15;
+        case ext_hash("woff2"): return 16;
+        case ext_hash("mp4"):   return 17;
+        case ext_hash("pdf"):   return 18;
+        case ext_hash("wasm"):  return 19;
+        case ext_hash("bin"):   return 20;
+        default: return 0;
+    }
+}
+
+const Fragment &content_type(const char *path) {
+    if(!path) {
+        return mime_table[0].header;
+    }
+    const char *dot = strrchr(path, '.');
+    if(!dot || strchr(dot, '/')) {
+        return mime_table[0].header;
+    }
+
+    // 扩展名转小写，过长的扩展名不可能在表中
+    char ext[8];
+    int len = 0;
+    for(const char *p = dot + 1; *p; p++) {
+        if(len == (int)sizeof(ext) - 1) {
+            return mime_table[0].header;
+        }
+        ext[len++] = (*p >= 'A' && *p <= 'Z') ? *p - 'A' + 'a' : *p;
+    }
+    ext[len] = '\0';
+
+    // 哈希命中后再比较一次，排除表外扩展名的偶然碰撞
+    const MimeEntry &entry = mime_table[mime_index(ext)];
+    if(strcmp(entry.ext, ext) != 0) {
+        return mime_table[0].header;
+    }
+    return entry.header;
+}
+
+const Fragment &date_header() {
+    // "Date: Mon, 19 Oct 2026 16:57:25 GMT\r\n"
+    static thread_local char buf[64];
+    static thread_local Fragment date = { buf, 0 };
+    static thread_local time_t last = 0;
+
+    time_t now = time(NULL);
+    if(now != last) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        date.len = strftime(buf, sizeof(buf), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        last = now;
+    }
+    return date;
+}
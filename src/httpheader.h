@@ -0,0 +1,28 @@
+#ifndef HTTPHEADER_H
+#define HTTPHEADER_H
+
+// 预先生成的响应头片段，组装响应时直接memcpy，避免每次都vsnprintf
+
+// 一段长度在编译期确定的头部文本
+struct Fragment {
+    const char *data;
+    int len;
+};
+
+#define FRAGMENT(s) { s, sizeof(s) - 1 }
+
+// FNV-1a，编译期计算扩展名的哈希值，用作switch的case标签
+// 两个扩展名哈希冲突时case标签重复，编译直接报错
+constexpr unsigned ext_hash(const char *s) {
+    unsigned h = 2166136261u;
+    for( ; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h;
+}
+
+const Fragment &status_line(int status);        // "HTTP/1.1 200 OK\r\n"
+const Fragment &content_type(const char *path); // 根据扩展名得到 "Content-Type: ...\r\n"
+const Fragment &date_header();                  // "Date: ...\r\n"，每个线程每秒刷新一次
+
+#endif
@@ -0,0 +1,165 @@
+#include "iplimit.h"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+bool IpLimit::m_enabled = false;
+int IpLimit::m_max_conns = 0;
+double IpLimit::m_rate = 0;
+double IpLimit::m_burst = 0;
+IpLimit::Shard IpLimit::m_shards[SHARDS];
+unsigned long IpLimit::m_rejected_conns = 0;
+unsigned long IpLimit::m_rejected_requests = 0;
+
+static uint64_t coarse_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void IpLimit::init(int max_conns, double rate, double burst) {
+    m_max_conns = max_conns;
+    m_rate = rate;
+    m_burst = burst > 0 ? burst : rate;
+    m_enabled = max_conns > 0 || rate > 0;
+}
+
+// IPv4地址放在低32位，高32位全1(对应IPv6的保留地址段，不会和/64前缀冲突)
+bool IpLimit::key(const sockaddr_storage &addr, uint64_t &ip) {
+    if(addr.ss_family == AF_INET) {
+        ip = 0xffffffff00000000ull | ((const sockaddr_in &)addr).sin_addr.s_addr;
+        return true;
+    }
+    if(addr.ss_family == AF_INET6) {
+        const in6_addr &a = ((const sockaddr_in6 &)addr).sin6_addr;
+        if(IN6_IS_ADDR_V4MAPPED(&a)) {
+            uint32_t v4;
+            memcpy(&v4, a.s6_addr + 12, 4);
+            ip = 0xffffffff00000000ull | v4;
+        }
+        else {
+            memcpy(&ip, a.s6_addr, 8);
+        }
+        return true;
+    }
+    return false;
+}
+
+IpLimit::Shard &IpLimit::shard(uint64_t ip) {
+    // 同一网段的地址低位相近，先打散再取模
+    return m_shards[((ip ^ (ip >> 32)) * 0x9E3779B97F4A7C15ull) >> 58];
+}
+
+// 调用前需持有分片的锁
+IpLimit::Entry &IpLimit::entry(Shard &s, uint64_t ip, uint64_t now) {
+    std::unordered_map<uint64_t, Entry>::iterator it = s.table.find(ip);
+    if(it == s.table.end()) {
+        Entry e = { 0, m_burst, now };
+        it = s.table.insert(std::make_pair(ip, e)).first;
+    }
+    return it->second;
+}
+
+bool IpLimit::on_accept(const sockaddr_storage &addr) {
+    if(!m_enabled) {
+        return true;
+    }
+    uint64_t ip;
+    if(!key(addr, ip)) {
+        return true;
+    }
+    Shard &s = shard(ip);
+    s.lock.lock();
+    Entry &e = entry(s, ip, coarse_ns());
+    if(m_max_conns > 0 && e.conns >= m_max_conns) {
+        s.lock.unlock();
+        __sync_fetch_and_add(&m_rejected_conns, 1);
+        return false;
+    }
+    e.conns++;
+    s.lock.unlock();
+    return true;
+}
+
+void IpLimit::on_close(const sockaddr_storage &addr) {
+    if(!m_enabled) {
+        return;
+    }
+    uint64_t ip;
+    if(!key(addr, ip)) {
+        return;
+    }
+    Shard &s = shard(ip);
+    s.lock.lock();
+    std::unordered_map<uint64_t, Entry>::iterator it = s.table.find(ip);
+    if(it != s.table.end() && it->second.conns > 0) {
+        it->second.conns--;
+    }
+    s.lock.unlock();
+}
+
+bool IpLimit::on_request(const sockaddr_storage &addr) {
+    if(!m_enabled || m_rate <= 0) {
+        return true;
+    }
+    uint64_t ip;
+    if(!key(addr, ip)) {
+        return true;
+    }
+    uint64_t now = coarse_ns();
+    Shard &s = shard(ip);
+    s.lock.lock();
+    Entry &e = entry(s, ip, now);
+    // 按流逝的时间补充令牌
+    e.tokens += (now - e.last_ns) / 1e9 * m_rate;
+    if(e.tokens > m_burst) {
+        e.tokens = m_burst;
+    }
+    e.last_ns = now;
+    bool ok = e.tokens >= 1;
+    if(ok) {
+        e.tokens -= 1;
+    }
+    s.lock.unlock();
+    if(!ok) {
+        __sync_fetch_and_add(&m_rejected_requests, 1);
+    }
+    return ok;
+}
+
+void IpLimit::evict() {
+    if(!m_enabled) {
+        return;
+    }
+    uint64_t now = coarse_ns();
+    uint64_t idle = IDLE_SECONDS * 1000000000ull;
+    for(int i=0; i<SHARDS; i++) {
+        Shard &s = m_shards[i];
+        s.lock.lock();
+        std::unordered_map<uint64_t, Entry>::iterator it = s.table.begin();
+        while(it != s.table.end()) {
+            if(it->second.conns == 0 && now - it->second.last_ns > idle) {
+                it = s.table.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        s.lock.unlock();
+    }
+}
+
+void IpLimit::dump() {
+    if(!m_enabled) {
+        return;
+    }
+    unsigned long tracked = 0;
+    for(int i=0; i<SHARDS; i++) {
+        m_shards[i].lock.lock();
+        tracked += m_shards[i].table.size();
+        m_shards[i].lock.unlock();
+    }
+    printf("iplimit: tracked=%lu rejected_conns=%lu rejected_requests=%lu\n",
+        tracked, m_rejected_conns, m_rejected_requests);
+    fflush(stdout);
+}
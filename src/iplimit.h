@@ -0,0 +1,53 @@
+#ifndef IPLIMIT_H
+#define IPLIMIT_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "locker.h"
+
+// 按客户端IP限制并发连接数和请求速率(令牌桶)
+// 哈希表按IP分片，每个分片一把锁，减少主线程和工作线程之间的竞争。
+// IPv6按/64前缀计数，Unix域套接字的连接不限制
+class IpLimit {
+public:
+    static void init(int max_conns, double rate, double burst);
+    static bool on_accept(const sockaddr_storage &addr);    // 新连接，超过并发上限返回false
+    static void on_close(const sockaddr_storage &addr);     // 连接关闭
+    static bool on_request(const sockaddr_storage &addr);   // 新请求，令牌不足返回false
+    static void evict();                                // 清理长时间不活跃的IP，主循环定期调用
+    static void dump();
+
+    static bool m_enabled;
+
+public:
+    static const int SHARDS = 64;
+    static const int IDLE_SECONDS = 60;                 // 没有连接且超过这么久不活跃的IP被清理
+
+private:
+    struct Entry {
+        int conns;                                      // 当前连接数
+        double tokens;                                  // 令牌桶剩余令牌
+        uint64_t last_ns;                               // 上次补充令牌的时间
+    };
+
+    struct Shard {
+        Locker lock;
+        std::unordered_map<uint64_t, Entry> table;
+    };
+
+    static bool key(const sockaddr_storage &addr, uint64_t &ip);
+    static Shard &shard(uint64_t ip);
+    static Entry &entry(Shard &s, uint64_t ip, uint64_t now);
+
+    static int m_max_conns;                             // 每个IP的并发连接上限，0表示不限制
+    static double m_rate;                               // 每秒补充的令牌数，0表示不限制
+    static double m_burst;                              // 令牌桶容量
+    static Shard m_shards[SHARDS];
+    static unsigned long m_rejected_conns;
+    static unsigned long m_rejected_requests;
+};
+
+#endif
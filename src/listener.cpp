@@ -0,0 +1,267 @@
+#include "listener.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+std::vector<Listener *> Listener::m_listeners;
+pid_t Listener::m_owner = 0;
+
+Listener::Listener(): m_addrlen(0), m_fd(-1), m_backlog(DEFAULT_BACKLOG), m_defer_accept(0), m_fastopen(0),
+    m_nodelay(false), m_accepted(0), m_rejected(0), m_errors(0), m_active(0) {
+    bzero(m_name, sizeof(m_name));
+    bzero(&m_addr, sizeof(m_addr));
+}
+
+bool Listener::add(const char *spec) {
+    Listener *l = new Listener;
+    if(!l->parse(spec)) {
+        delete l;
+        return false;
+    }
+    m_listeners.push_back(l);
+    return true;
+}
+
+bool Listener::add_port(int port) {
+    char spec[32];
+    snprintf(spec, sizeof(spec), "0.0.0.0:%d", port);
+    return add(spec);
+}
+
+// 地址后面用逗号分隔选项
+bool Listener::parse(const char *spec) {
+    const char *comma = strchr(spec, ',');
+    int addr_len = comma ? comma - spec : strlen(spec);
+    if(addr_len == 0 || addr_len >= (int)sizeof(m_name)) {
+        return false;
+    }
+    memcpy(m_name, spec, addr_len);
+    m_name[addr_len] = '\0';
+
+    if(!strncmp(m_name, "unix:", 5)) {
+        // unix:/tmp/web.sock
+        sockaddr_un *un = (sockaddr_un *)&m_addr;
+        const char *path = m_name + 5;
+        if(strlen(path) == 0 || strlen(path) >= sizeof(un->sun_path)) {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        m_addrlen = sizeof(sockaddr_un);
+    }
+    else {
+        // 0.0.0.0:80 或 [::]:80
+        const char *colon = strrchr(m_name, ':');
+        if(!colon || colon == m_name) {
+            return false;
+        }
+        int port = atoi(colon + 1);
+        if(port <= 0 || port > 65535) {
+            return false;
+        }
+        char host[64];
+        const char *begin = m_name;
+        const char *end = colon;
+        bool v6 = m_name[0] == '[';
+        if(v6) {
+            if(end[-1] != ']') {
+                return false;
+            }
+            begin++;
+            end--;
+        }
+        if(end - begin <= 0 || end - begin >= (int)sizeof(host)) {
+            return false;
+        }
+        memcpy(host, begin, end - begin);
+        host[end - begin] = '\0';
+
+        if(v6) {
+            sockaddr_in6 *in6 = (sockaddr_in6 *)&m_addr;
+            in6->sin6_family = AF_INET6;
+            in6->sin6_port = htons(port);
+            if(inet_pton(AF_INET6, host, &in6->sin6_addr) != 1) {
+                return false;
+            }
+            m_addrlen = sizeof(sockaddr_in6);
+        }
+        else {
+            sockaddr_in *in = (sockaddr_in *)&m_addr;
+            in->sin_family = AF_INET;
+            in->sin_port = htons(port);
+            if(inet_pton(AF_INET, host, &in->sin_addr) != 1) {
+                return false;
+            }
+            m_addrlen = sizeof(sockaddr_in);
+        }
+    }
+
+    // 选项：backlog=N defer[=秒] fastopen[=队列长度] nodelay
+    while(comma) {
+        const char *opt = comma + 1;
+        comma = strchr(opt, ',');
+        int len = comma ? comma - opt : strlen(opt);
+        const char *eq = (const char *)memchr(opt, '=', len);
+        int name_len = eq ? eq - opt : len;
+        int value = eq ? atoi(eq + 1) : 0;
+        bool tcp_opt = true;
+        if(name_len == 7 && !strncmp(opt, "backlog", 7)) {
+            if(value <= 0) {
+                return false;
+            }
+            m_backlog = value;
+            tcp_opt = false;
+        }
+        else if(name_len == 5 && !strncmp(opt, "defer", 5)) {
+            m_defer_accept = eq ? value : 1;
+        }
+        else if(name_len == 8 && !strncmp(opt, "fastopen", 8)) {
+            m_fastopen = eq ? value : 256;
+        }
+        else if(name_len == 7 && !strncmp(opt, "nodelay", 7)) {
+            m_nodelay = true;
+        }
+        else {
+            return false;
+        }
+        // TCP选项对Unix域套接字没有意义
+        if(tcp_opt && m_addr.ss_family == AF_UNIX) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Listener::open() {
+    m_fd = socket(m_addr.ss_family, SOCK_STREAM, 0);
+    if(m_fd == -1) {
+        perror("create listen socket error");
+        return false;
+    }
+
+    int opt = 1;
+    if(m_addr.ss_family == AF_UNIX) {
+        // 删除上次运行留下的套接字文件
+        unlink(((sockaddr_un *)&m_addr)->sun_path);
+    }
+    else {
+        // 设置端口复用
+        if(setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+            perror("port reuse");
+            return false;
+        }
+        // IPv6只监听v6地址，和同端口的IPv4监听互不冲突
+        if(m_addr.ss_family == AF_INET6) {
+            setsockopt(m_fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+        }
+        // 客户端发来数据后才唤醒accept，减少只建连不发请求的连接占用
+        if(m_defer_accept > 0 && setsockopt(m_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &m_defer_accept, sizeof(m_defer_accept)) == -1) {
+            perror("TCP_DEFER_ACCEPT");
+        }
+        // 允许客户端在SYN中携带请求数据
+        if(m_fastopen > 0 && setsockopt(m_fd, IPPROTO_TCP, TCP_FASTOPEN, &m_fastopen, sizeof(m_fastopen)) == -1) {
+            perror("TCP_FASTOPEN");
+        }
+    }
+
+    if(bind(m_fd, (sockaddr *)&m_addr, m_addrlen) == -1) {
+        perror("bind listen port");
+        return false;
+    }
+    if(listen(m_fd, m_backlog) == -1) {
+        perror("listen");
+        return false;
+    }
+
+    // 设置文件描述符非阻塞
+    int old_flag = fcntl(m_fd, F_GETFL);
+    fcntl(m_fd, F_SETFL, old_flag | O_NONBLOCK);
+    printf("listening on %s backlog=%d\n", m_name, m_backlog);
+    return true;
+}
+
+bool Listener::open_all() {
+    m_owner = getpid();
+    for(size_t i=0; i<m_listeners.size(); i++) {
+        if(!m_listeners[i]->open()) {
+            printf("cannot listen on %s\n", m_listeners[i]->m_name);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Listener::watch_all(int epollfd, bool exclusive) {
+    for(size_t i=0; i<m_listeners.size(); i++) {
+        epoll_event ev;
+        ev.data.fd = m_listeners[i]->m_fd;
+        // EPOLLEXCLUSIVE不能和EPOLLRDHUP一起使用
+        ev.events = exclusive ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN | EPOLLRDHUP;
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, m_listeners[i]->m_fd, &ev) == -1) {
+            perror("epoll add listen fd");
+            return false;
+        }
+    }
+    return true;
+}
+
+void Listener::close_all() {
+    for(size_t i=0; i<m_listeners.size(); i++) {
+        Listener *l = m_listeners[i];
+        if(l->m_fd != -1) {
+            close(l->m_fd);
+            if(l->m_addr.ss_family == AF_UNIX && getpid() == m_owner) {
+                unlink(((sockaddr_un *)&l->m_addr)->sun_path);
+            }
+        }
+        delete l;
+    }
+    m_listeners.clear();
+}
+
+// 监听地址只有几个，顺序查找即可
+Listener *Listener::find(int fd) {
+    for(size_t i=0; i<m_listeners.size(); i++) {
+        if(m_listeners[i]->m_fd == fd) {
+            return m_listeners[i];
+        }
+    }
+    return NULL;
+}
+
+int Listener::accept_conn(sockaddr_storage &addr) {
+    socklen_t addr_len = sizeof(addr);
+    bzero(&addr, sizeof(addr));
+    int connfd = accept(m_fd, (sockaddr *)&addr, &addr_len);
+    if(connfd < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            m_errors++;
+        }
+        return -1;
+    }
+    if(m_nodelay) {
+        int opt = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    m_accepted++;
+    __sync_fetch_and_add(&m_active, 1);
+    return connfd;
+}
+
+void Listener::dump() {
+    for(size_t i=0; i<m_listeners.size(); i++) {
+        Listener *l = m_listeners[i];
+        printf("listener %s: accepted=%lu active=%ld rejected=%lu errors=%lu\n",
+            l->m_name, l->m_accepted, l->m_active, l->m_rejected, l->m_errors);
+    }
+    fflush(stdout);
+}
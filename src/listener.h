@@ -0,0 +1,57 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// 监听套接字
+// 可以同时监听多个地址：IPv4、IPv6和Unix域套接字，都注册在同一个epoll中。
+// 每个监听地址有自己的backlog和套接字选项，并分别统计
+class Listener {
+public:
+    static bool add(const char *spec);          // "0.0.0.0:80,backlog=1024,defer,fastopen,nodelay"、"[::]:80"、"unix:/tmp/web.sock"
+    static bool add_port(int port);             // 命令行第一个参数指定的IPv4端口
+    static bool open_all();                     // 创建并监听所有地址
+    static bool watch_all(int epollfd, bool exclusive);     // 放入epoll，多进程共享时exclusive避免惊群
+    static void close_all();
+    static Listener *find(int fd);              // fd是监听套接字时返回对应的Listener
+    static bool empty() { return m_listeners.empty(); }
+    static void dump();
+
+    int accept_conn(sockaddr_storage &addr);    // 接受一个连接，失败返回-1
+    void on_reject() {                          // 接受后又被拒绝的连接
+        __sync_fetch_and_add(&m_rejected, 1);
+        __sync_fetch_and_sub(&m_active, 1);
+    }
+    void on_close() { __sync_fetch_and_sub(&m_active, 1); }
+
+public:
+    static const int DEFAULT_BACKLOG = 128;
+
+    char m_name[128];
+
+private:
+    Listener();
+    bool parse(const char *spec);
+    bool open();
+
+private:
+    sockaddr_storage m_addr;
+    socklen_t m_addrlen;
+    int m_fd;
+    int m_backlog;
+    int m_defer_accept;                         // TCP_DEFER_ACCEPT的秒数，0表示不设置
+    int m_fastopen;                             // TCP_FASTOPEN的队列长度，0表示不设置
+    bool m_nodelay;                             // 接受的连接设置TCP_NODELAY
+
+    unsigned long m_accepted;
+    unsigned long m_rejected;                   // 连接数已满或被IP限制拒绝
+    unsigned long m_errors;                     // accept失败
+    long m_active;                              // 当前连接数
+
+    static std::vector<Listener *> m_listeners;
+    static pid_t m_owner;                       // 创建套接字的进程，只有它退出时删除Unix域套接字文件
+};
+
+#endif
@@ -11,15 +11,38 @@
 #include <sys/epoll.h>
 #include <sys/errno.h>
 #include <signal.h>
+#include <getopt.h>
 
 #include "locker.h"
 #include "threadpool.h"
 #include "httpconn.h"
+#include "proxy.h"
+#include "trace.h"
+#include "iplimit.h"
+#include "completion.h"
+#include "coldfile.h"
+#include "websocket.h"
+#include "listener.h"
+#include "probes.h"
+#include "prefork.h"
+#include "capture.h"
 
 
 const int MAX_FD = 65535;
 const int MAX_EVENT_NUMBER = 65535;
 
+// 收到SIGUSR1时在主循环中打印统计信息
+static volatile sig_atomic_t dump_stats = 0;
+void on_dump_stats(int) {
+    dump_stats = 1;
+}
+
+// 收到SIGTERM、SIGINT时退出主循环，等待工作线程结束后退出
+static volatile sig_atomic_t stop_server = 0;
+void on_stop(int) {
+    stop_server = 1;
+}
+
 void addsig(int sig, void (handler)(int)) {
     struct sigaction sa;
     bzero(&sa, sizeof(sa));
@@ -32,65 +55,229 @@ extern void addfd(int epollfd, int fd, bool oneshot);
 extern void removefd(int epollfd, int fd);
 extern void modifyfd(int epollfd, int fd, int event);
 
+// 发送响应，发完后把流水线中的下一个请求交给线程池
+static void handle_write(Httpconn *users, Threadpool<Httpconn> *pool, int fd) {
+    if(!users[fd].write()) {
+        users[fd].close_conn();
+    }
+    // 刚升级为WebSocket时缓冲区中剩下的是不完整的帧，由ws_handle继续处理
+    else if(!users[fd].is_websocket() && users[fd].has_pending()) {
+        pool->append(&users[fd], users[fd].sched_class());
+    }
+}
+
+// 处理工作线程投递的完成消息
+static void handle_completions(CompletionQueue *completions, Httpconn *users, Threadpool<Httpconn> *pool) {
+    static const int BATCH = 256;
+    CompletionQueue::Completion done[BATCH];
+    int n;
+    do {
+        n = completions->drain(done, BATCH);
+        for(int i=0; i<n; i++) {
+            int fd = done[i].fd;
+            switch(done[i].type) {
+                case CompletionQueue::WRITE: {
+                    // 直接尝试发送，不用等下一次EPOLLOUT
+                    handle_write(users, pool, fd);
+                    break;
+                }
+                case CompletionQueue::READ: {
+                    modifyfd(Httpconn::m_epollfd, fd, EPOLLIN);
+                    break;
+                }
+                case CompletionQueue::CLOSE: {
+                    users[fd].close_conn();
+                    break;
+                }
+                case CompletionQueue::PUBLISH: {
+                    WebSocket::flush_published();
+                    break;
+                }
+            }
+        }
+    } while(n == BATCH);
+}
+
 int main(int argc, char *argv[]) {
     if(argc < 2) {
-        printf("useage: %s port_number\n", basename(argv[0]));
+        printf("useage: %s port_number [-P prefix=upstream[,upstream...]] [-t] [-s slow_us] [-c max_conns_per_ip] [-r requests_per_sec[:burst]] [-C] [-W websocket_prefix] [-L listen_addr[,option...]] [-U upload_prefix[:max_bytes]] [-Q send_quantum] [-B bytes_per_sec] [-T min_threads:max_threads] [-w worker_processes] [-R capture_file[:buffer_bytes]]\n", basename(argv[0]));
         exit(-1);
     }
 
-    // 获取监听端口
+    // 获取监听端口，为0时只监听-L指定的地址
     int port = atoi(argv[1]);
     if(port < 0 || port > 65535) {
         printf("port_number error!\n");
         exit(-1);
     }
+    if(port > 0) {
+        Listener::add_port(port);
+    }
+
+    // 解析端口后面的可选参数
+    optind = 2;
+    int opt_ch;
+    bool trace = false;
+    long slow_us = 0;
+    int max_conns_per_ip = 0;
+    double rate = 0, burst = 0;
+    long send_quantum = SendSched::DEFAULT_QUANTUM, send_rate = 0;
+    int min_threads = 4, max_threads = 64;
+    int workers = 0;
+    std::string capture_path;
+    long capture_buffer = Capture::DEFAULT_BUFFER;
+    while((opt_ch = getopt(argc, argv, "P:ts:c:r:CW:L:U:Q:B:T:w:R:")) != -1) {
+        switch(opt_ch) {
+            case 'P': {
+                // 反向代理规则，如 -P /api=127.0.0.1:8080,unix:/tmp/app.sock
+                if(!Proxy::add_route(optarg)) {
+                    printf("bad proxy route: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 't': {
+                // 统计请求各阶段耗时，kill -USR1 打印
+                trace = true;
+                break;
+            }
+            case 's': {
+                // 打印总耗时超过slow_us微秒的请求
+                trace = true;
+                slow_us = atol(optarg);
+                break;
+            }
+            case 'C': {
+                // 协程模式，连接在主线程中以协程方式处理，不使用线程池
+                Httpconn::m_coroutine = true;
+                break;
+            }
+            case 'W': {
+                // 允许升级为WebSocket的URL前缀，客户端发来的消息会广播给所有连接
+                WebSocket::set_prefix(optarg);
+                break;
+            }
+            case 'L': {
+                // 额外的监听地址，可以多次指定，如 -L [::]:8080,backlog=1024,defer,fastopen,nodelay -L unix:/tmp/web.sock
+                if(!Listener::add(optarg)) {
+                    printf("bad listen address: %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            }
+            case 'U': {
+                // 允许PUT/POST上传文件的URL前缀，冒号后是单个文件的大小上限
+                const char *colon = strchr(optarg, ':');
+                std::string prefix(optarg, colon ? colon - optarg : strlen(optarg));
+                Upload::set_prefix(prefix.c_str());
+                if(colon) {
+                    Upload::set_max_size(atol(colon + 1));
+                }
+                break;
+            }
+            case 'Q': {
+                // 每次事件最多发送的字节数，0表示一直发到EAGAIN
+                send_quantum = atol(optarg);
+                break;
+            }
+            case 'B': {
+                // 每个连接每秒最多发送的字节数
+                send_rate = atol(optarg);
+                break;
+            }
+            case 'T': {
+                // 线程池的线程数范围，根据排队情况在这个范围内伸缩
+                min_threads = atoi(optarg);
+                const char *colon = strchr(optarg, ':');
+                max_threads = colon ? atoi(colon + 1) : min_threads;
+                break;
+            }
+            case 'w': {
+                // 多进程模式，supervisor启动这么多个工作进程并在崩溃时重启
+                workers = atoi(optarg);
+                break;
+            }
+            case 'R': {
+                // 把收到的请求录制到文件中，用tools/replay重放，冒号后是内存缓冲区的大小
+                const char *colon = strchr(optarg, ':');
+                capture_path.assign(optarg, colon ? colon - optarg : strlen(optarg));
+                if(colon) {
+                    capture_buffer = atol(colon + 1);
+                }
+                break;
+            }
+            case 'c': {
+                // 每个IP的并发连接上限
+                max_conns_per_ip = atoi(optarg);
+                break;
+            }
+            case 'r': {
+                // 每个IP每秒的请求数，冒号后是允许的突发量
+                rate = atof(optarg);
+                const char *colon = strchr(optarg, ':');
+                burst = colon ? atof(colon + 1) : rate;
+                break;
+            }
+            default:
+                exit(-1);
+        }
+    }
+    if(Listener::empty()) {
+        printf("no listen address\n");
+        exit(-1);
+    }
+    // 转发在工作线程中阻塞等待后端，协程模式下会卡住整个主线程
+    if(Httpconn::m_coroutine && !Proxy::empty()) {
+        printf("-P cannot be used with -C\n");
+        exit(-1);
+    }
+    if(trace) {
+        Trace::init(slow_us);
+    }
+    IpLimit::init(max_conns_per_ip, rate, burst);
+    SendSched::init(send_quantum, send_rate);
 
     // 添加信号捕捉
     addsig(SIGPIPE, SIG_IGN);
+    addsig(SIGUSR1, on_dump_stats);
+    addsig(SIGTERM, on_stop);
+    addsig(SIGINT, on_stop);
+
+    // 创建所有监听套接字，多进程模式下由所有工作进程共享
+    if(!Listener::open_all()) {
+        exit(-1);
+    }
+    if(!Prefork::init(workers)) {
+        printf("bad worker process number\n");
+        exit(-1);
+    }
+    // supervisor停止后直接退出，工作进程继续往下创建自己的线程池和epoll
+    if(Prefork::enabled() && !Prefork::run(&stop_server, &dump_stats)) {
+        Listener::close_all();
+        return 0;
+    }
+    // 每个工作进程写自己的日志文件，重放时按时间合并
+    if(!capture_path.empty()) {
+        if(Prefork::enabled()) {
+            capture_path += "." + std::to_string(getpid());
+        }
+        if(!Capture::start(capture_path.c_str(), capture_buffer)) {
+            exit(-1);
+        }
+    }
 
     // 创建线程池
     Threadpool<Httpconn> * pool = NULL;
     try {
-        pool = new Threadpool<Httpconn>;
+        pool = new Threadpool<Httpconn>(min_threads, max_threads);
     } catch (...) {
+        printf("bad thread pool size\n");
         exit(-1);
     }
     // 用来保存所有客户端信息
     Httpconn * users = new Httpconn[MAX_FD];
 
 
-    // 获取监听端口
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-    if(listenfd == -1 ) {
-        perror("create listen socket error");
-        exit(-1);
-    }
-
-    // 设置端口复用
-    int opt = 1;
-    int ret = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    if(ret == -1) {
-        perror("port reuse");
-        exit(-1);
-    }
-
-    // 绑定端口
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    inet_pton(AF_INET, "0.0.0.0", &addr.sin_addr.s_addr);
-    ret = bind(listenfd, (struct sockaddr *)&addr, sizeof(addr));
-    if(ret == -1) {
-        perror("bind listen port");
-        exit(-1);
-    }
-    // 监听
-    ret = listen(listenfd, 5);
-    if(ret == -1) {
-        perror("listen");
-        exit(-1);
-    }
-
     // 设置epoll监听
     epoll_event events[MAX_EVENT_NUMBER];
     int epollfd = epoll_create(6);
@@ -100,35 +287,63 @@ int main(int argc, char *argv[]) {
     }
     Httpconn::m_epollfd = epollfd;
     
-    // 将监听fd放入epoll中
+    // 监听套接字放入epoll中，多个进程共享时每个连接只唤醒一个进程
+    if(!Listener::watch_all(epollfd, Prefork::enabled())) {
+        exit(-1);
+    }
+
+    // 工作线程的完成队列，每个连接最多一条消息，容量和连接数一致
+    CompletionQueue *completions = NULL;
+    try {
+        completions = new CompletionQueue(MAX_FD);
+    } catch (...) {
+        exit(-1);
+    }
+    Httpconn::m_completions = completions;
     {
         epoll_event ev;
-        ev.data.fd = listenfd;
-        ev.events = EPOLLIN | EPOLLRDHUP;
-        int ret = epoll_ctl(epollfd, EPOLL_CTL_ADD, listenfd, &ev);
-        // 设置文件描述符非阻塞
-        int old_flag = fcntl(listenfd, F_GETFL);
-        int new_flag = old_flag | O_NONBLOCK;
-        fcntl(listenfd, F_SETFL, new_flag);
+        ev.data.fd = completions->fd();
+        ev.events = EPOLLIN;
+        epoll_ctl(epollfd, EPOLL_CTL_ADD, completions->fd(), &ev);
     }
-    // addfd(epollfd, listenfd, false);
 
     
-    while(true) {
-        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+    time_t last_tick = time(NULL);
+    while(!stop_server) {
+        // 超时用于执行定时任务，有等待发送的连接时不阻塞
+        int num = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, SendSched::timeout(1000));
         printf("epoll 事件数量： %d\n", num);
         if(num < 0 && errno != EINTR) {
             perror("epoll wait");
             break;
         }
+        if(dump_stats) {
+            dump_stats = 0;
+            Trace::dump();
+            IpLimit::dump();
+            pool->dump();
+            ColdFile::dump();
+            WebSocket::dump();
+            Listener::dump();
+            Upload::dump();
+            SendSched::dump();
+            Prefork::dump();
+            Capture::dump();
+        }
+        time_t now = time(NULL);
+        if(now != last_tick) {
+            last_tick = now;
+            IpLimit::evict();
+            pool->maintain();
+        }
         for(int i=0; i<num; i++) {
             epoll_event &ev = events[i];
             int fd = ev.data.fd;
+            Listener *listener = Listener::find(fd);
             // 检测到新的客户端连接
-            if(fd == listenfd) {
-                struct sockaddr_in client_addr;
-                socklen_t client_addr_len = sizeof(client_addr);
-                int connfd = accept(listenfd, (struct sockaddr *)&client_addr, &client_addr_len);
+            if(listener) {
+                struct sockaddr_storage client_addr;
+                int connfd = listener->accept_conn(client_addr);
 
                 if(connfd < 0) {
                     printf("err sockfd, errno is: %d\n", errno);
@@ -138,21 +353,48 @@ int main(int argc, char *argv[]) {
                 printf("获取到新的client fd = %d\n", connfd);
                 if(Httpconn::m_user_count >= MAX_FD) {
                     // 连接数已满
+                    listener->on_reject();
+                    close(connfd);
+                    continue;
+                }
+                if(!IpLimit::on_accept(client_addr)) {
+                    // 该IP的连接数已达上限
+                    listener->on_reject();
                     close(connfd);
                     continue;
                 }
                 // 将新的客户端数据初始化，并保存下来
-                users[connfd].init(connfd, client_addr);
+                users[connfd].init(connfd, client_addr, listener);
+                PROBE2(accept, connfd, listener->m_name);
+                Prefork::on_accept();
+                if(Httpconn::m_coroutine) {
+                    users[connfd].serve();
+                }
+            }
+            else if(fd == completions->fd()) {
+                handle_completions(completions, users, pool);
             }
             // 对方异常断开
             else if(ev.events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)){
-                users[i].close_conn();
+                users[fd].close_conn();
+            }
+            else if(users[fd].is_websocket()) {
+                if(!users[fd].ws_handle(ev.events)) {
+                    users[fd].close_conn();
+                }
+            }
+            else if(Httpconn::m_coroutine) {
+                users[fd].resume();
+            }
+            else if(users[fd].is_uploading()) {
+                // 上传的请求体由工作线程用splice接收
+                pool->append(&users[fd], 2);
             }
             else if(ev.events & EPOLLIN) {
                 // 一次性把所有数据都读完
                 if(users[fd].read()) {
                     printf("sockfd=%d 有数据了\n", fd);
-                    pool->append(&users[fd]);
+                    pool->append(&users[fd], users[fd].sched_class());
                 }
                 else {
                     users[fd].close_conn();
@@ -160,19 +402,27 @@ int main(int argc, char *argv[]) {
             }
             else if(ev.events & EPOLLOUT) {
                 printf("写！！main start write!\n");
-                if(!users[fd].write()) {
-                    users[fd].close_conn();
-                }
+                handle_write(users, pool, fd);
             }
 
         }
 
+        // 上一次发送用完额度或等待限速的连接，按顺序各发送一个额度
+        int ready[MAX_EVENT_NUMBER];
+        int ready_num = SendSched::ready(ready, MAX_EVENT_NUMBER);
+        for(int i=0; i<ready_num; i++) {
+            handle_write(users, pool, ready[i]);
+        }
+
     }
 
+    // 先等工作线程退出，它们可能还在访问连接
+    delete pool;
+    Capture::stop();
     close(epollfd);
-    close(listenfd);
+    Listener::close_all();
     delete [] users;
-    delete pool;
+    delete completions;
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include "prefork.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+int Prefork::m_workers = 0;
+Prefork::Slot *Prefork::m_slots = NULL;
+Prefork::Slot *Prefork::m_slot = NULL;
+sigset_t Prefork::m_mask;
+
+// 只用来在子进程退出时打断等待，SIGCHLD默认被忽略，不会打断
+static void on_child(int) {
+}
+
+bool Prefork::init(int workers) {
+    if(workers <= 0) {
+        return true;
+    }
+    if(workers > MAX_WORKERS) {
+        return false;
+    }
+    // 匿名共享映射在fork后父子进程共用
+    void *addr = mmap(NULL, sizeof(Slot) * workers, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(addr == MAP_FAILED) {
+        perror("mmap shared stats");
+        return false;
+    }
+    m_slots = (Slot *)addr;
+    for(int i=0; i<workers; i++) {
+        new (&m_slots[i]) Slot();
+        m_slots[i].pid = 0;
+        m_slots[i].started = 0;
+    }
+    m_workers = workers;
+    return true;
+}
+
+pid_t Prefork::spawn(int index) {
+    Slot &slot = m_slots[index];
+    pid_t pid = fork();
+    if(pid == 0) {
+        m_slot = &slot;
+        signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &m_mask, NULL);
+        // supervisor退出时工作进程也退出
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if(getppid() == 1) {
+            _exit(0);
+        }
+        return 0;
+    }
+    if(pid > 0) {
+        slot.pid = pid;
+        slot.started = time(NULL);
+        printf("worker %d started, pid = %d\n", index, pid);
+        fflush(stdout);
+    }
+    return pid;
+}
+
+void Prefork::pause(int seconds) {
+    struct timespec ts = { seconds, 0 };
+    ppoll(NULL, 0, seconds < 0 ? NULL : &ts, &m_mask);
+}
+
+// 信号平时是屏蔽的，只在pause中解除，检查stop之后、开始等待之前收到的SIGTERM不会丢失
+bool Prefork::run(volatile sig_atomic_t *stop, volatile sig_atomic_t *dump_flag) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_child;
+    sa.sa_flags = SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGUSR1);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &m_mask);
+
+    for(int i=0; i<m_workers; i++) {
+        pid_t pid;
+        while((pid = spawn(i)) == -1 && !*stop) {
+            perror("fork");
+            pause(1);
+        }
+        if(pid == 0) {
+            return true;
+        }
+    }
+
+    while(!*stop) {
+        if(*dump_flag) {
+            *dump_flag = 0;
+            dump();
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if(pid == 0) {
+            // 没有退出的工作进程，等SIGCHLD或者退出、打印的信号
+            pause(-1);
+            continue;
+        }
+        if(pid == -1) {
+            pause(1);
+            continue;
+        }
+        int index = -1;
+        for(int i=0; i<m_workers; i++) {
+            if(m_slots[i].pid == pid) {
+                index = i;
+                break;
+            }
+        }
+        if(index == -1) {
+            continue;
+        }
+        Slot &slot = m_slots[index];
+        if(WIFSIGNALED(status)) {
+            printf("worker %d (pid %d) killed by signal %d\n", index, pid, WTERMSIG(status));
+        }
+        else {
+            printf("worker %d (pid %d) exited with %d\n", index, pid, WEXITSTATUS(status));
+        }
+        fflush(stdout);
+        slot.pid = 0;
+        // 进程上的连接都已断开
+        slot.active = 0;
+        if(*stop) {
+            break;
+        }
+        if(time(NULL) - slot.started < MIN_UPTIME) {
+            pause(1);
+        }
+        slot.restarts++;
+        while((pid = spawn(index)) == -1 && !*stop) {
+            perror("fork");
+            pause(1);
+        }
+        if(pid == 0) {
+            return true;
+        }
+    }
+
+    // 通知所有工作进程退出并等待
+    for(int i=0; i<m_workers; i++) {
+        if(m_slots[i].pid > 0) {
+            kill(m_slots[i].pid, SIGTERM);
+        }
+    }
+    while(waitpid(-1, NULL, 0) > 0 || errno == EINTR) {
+    }
+    sigprocmask(SIG_SETMASK, &m_mask, NULL);
+    return false;
+}
+
+// 只在supervisor中打印，工作进程各自打印自己的详细统计
+void Prefork::dump() {
+    if(!m_slots || m_slot) {
+        return;
+    }
+    uint64_t accepted = 0, responses = 0, bytes = 0, restarts = 0;
+    int64_t active = 0;
+    for(int i=0; i<m_workers; i++) {
+        Slot &s = m_slots[i];
+        printf("worker %d pid=%d accepted=%lu active=%ld responses=%lu bytes=%lu restarts=%lu\n",
+            i, (int)s.pid.load(), s.accepted.load(), s.active.load(), s.responses.load(), s.bytes.load(), s.restarts.load());
+        accepted += s.accepted;
+        active += s.active;
+        responses += s.responses;
+        bytes += s.bytes;
+        restarts += s.restarts;
+    }
+    printf("workers total accepted=%lu active=%ld responses=%lu bytes=%lu restarts=%lu\n",
+        accepted, active, responses, bytes, restarts);
+    fflush(stdout);
+}
@@ -0,0 +1,67 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <atomic>
+#include <cstdint>
+#include <csignal>
+#include <ctime>
+#include <sys/types.h>
+
+// 多进程模式
+// 监听套接字创建好以后，主进程(supervisor)fork出N个工作进程，每个工作进程运行自己的
+// epoll主循环和线程池，共享同一组监听套接字。工作进程崩溃时supervisor立即重新fork，
+// 只影响该进程上的连接。各进程的计数器放在fork前创建的共享内存中，由supervisor汇总
+class Prefork {
+public:
+    static bool init(int workers);          // 创建共享内存，workers为0表示单进程模式
+    static bool enabled() { return m_workers > 0; }
+    // supervisor在这里循环，直到stop被置位后返回false；工作进程中返回true，继续运行主循环
+    static bool run(volatile sig_atomic_t *stop, volatile sig_atomic_t *dump_flag);
+    static void dump();                     // 汇总所有工作进程的计数
+
+    // 以下由工作进程的主线程调用，单进程模式下什么也不做
+    static inline void on_accept() {
+        if(m_slot) {
+            m_slot->accepted.fetch_add(1, std::memory_order_relaxed);
+            m_slot->active.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    static inline void on_close() {
+        if(m_slot) {
+            m_slot->active.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+    static inline void on_response(long bytes) {
+        if(m_slot) {
+            m_slot->responses.fetch_add(1, std::memory_order_relaxed);
+            m_slot->bytes.fetch_add(bytes, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    static const int MAX_WORKERS = 256;
+    static const int MIN_UPTIME = 1;        // 启动后这么多秒内就退出的进程，延迟1秒再重启，避免反复fork
+
+private:
+    // 每个工作进程一个槽位，进程重启后继续使用同一个槽位，计数累加
+    struct Slot {
+        std::atomic<pid_t> pid;
+        std::atomic<uint64_t> accepted;
+        std::atomic<int64_t> active;        // 当前连接数，进程重启时清零
+        std::atomic<uint64_t> responses;
+        std::atomic<uint64_t> bytes;
+        std::atomic<uint64_t> restarts;
+        time_t started;                     // 只有supervisor访问
+    };
+
+    static pid_t spawn(int index);          // 启动第index个工作进程，子进程中返回0
+    static void pause(int seconds);         // 解除信号屏蔽并等待，信号处理函数在这里执行，-1表示一直等
+
+private:
+    static int m_workers;
+    static Slot *m_slots;                   // 共享内存
+    static Slot *m_slot;                    // 本工作进程的槽位
+    static sigset_t m_mask;                 // run之前的信号屏蔽字，工作进程中恢复
+};
+
+#endif
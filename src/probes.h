@@ -0,0 +1,34 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT静态探针，provider为webserver，供perf、bpftrace在运行时挂载。
+// 没有挂载时探针只是一条nop指令；编译环境没有sys/sdt.h(systemtap-sdt-dev)时探针为空。
+// 用法见scripts/bpftrace下的脚本，探针列表可以用 bpftrace -l 'usdt:./out/webserver:*' 查看
+//
+//   accept(fd, listener)               新连接
+//   read(fd, bytes)                    读完一批数据，bytes为缓冲区中的数据量
+//   enqueue(conn, cls)                 放入线程池队列
+//   dequeue(conn, cls, wait_ns)        工作线程取出
+//   parse(fd, code)                    process_read的结果，0表示请求还不完整
+//   request(fd, code, url)             do_request的结果
+//   writev(fd, bytes, left)            每次writev，left为还没发送的字节数
+//   close(fd)                          关闭连接
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(NO_PROBES)
+#include <sys/sdt.h>
+#define HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_PROBES
+#define PROBE1(name, a1) DTRACE_PROBE1(webserver, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(webserver, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(webserver, name, a1, a2, a3)
+#else
+#define PROBE1(name, a1) do {} while(0)
+#define PROBE2(name, a1, a2) do {} while(0)
+#define PROBE3(name, a1, a2, a3) do {} while(0)
+#endif
+
+#endif
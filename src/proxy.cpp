@@ -0,0 +1,445 @@
+#include "proxy.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+Proxy *Proxy::m_routes[MAX_ROUTES];
+int Proxy::m_route_count = 0;
+
+Upstream::Upstream(): m_addrlen(0), m_fails(0), m_down_until(0) {
+    bzero(m_name, sizeof(m_name));
+    bzero(&m_addr, sizeof(m_addr));
+}
+
+Upstream::~Upstream() {
+    for(std::list<int>::iterator it = m_idle.begin(); it != m_idle.end(); ++it) {
+        close(*it);
+    }
+}
+
+bool Upstream::parse(const char *spec) {
+    snprintf(m_name, sizeof(m_name), "%s", spec);
+    bzero(&m_addr, sizeof(m_addr));
+
+    // unix:/tmp/app.sock
+    if(!strncmp(spec, "unix:", 5)) {
+        sockaddr_un *un = (sockaddr_un *)&m_addr;
+        const char *path = spec + 5;
+        if(strlen(path) == 0 || strlen(path) >= sizeof(un->sun_path)) {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        m_addrlen = sizeof(sockaddr_un);
+        return true;
+    }
+
+    // 127.0.0.1:8080
+    const char *colon = strrchr(spec, ':');
+    if(!colon || colon == spec) {
+        return false;
+    }
+    char host[64];
+    int host_len = colon - spec;
+    if(host_len >= (int)sizeof(host)) {
+        return false;
+    }
+    memcpy(host, spec, host_len);
+    host[host_len] = '\0';
+    int port = atoi(colon + 1);
+    if(port <= 0 || port > 65535) {
+        return false;
+    }
+
+    sockaddr_in *in = (sockaddr_in *)&m_addr;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    if(inet_pton(AF_INET, host, &in->sin_addr) != 1) {
+        return false;
+    }
+    m_addrlen = sizeof(sockaddr_in);
+    return true;
+}
+
+int Upstream::connect_new() {
+    int fd = socket(m_addr.ss_family, SOCK_STREAM, 0);
+    if(fd == -1) {
+        return -1;
+    }
+    // 后端连接在工作线程中以阻塞方式使用，设置超时防止线程被卡死
+    struct timeval tv = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if(m_addr.ss_family == AF_INET) {
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    }
+    if(connect(fd, (sockaddr *)&m_addr, m_addrlen) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int Upstream::acquire(bool &reused) {
+    m_lock.lock();
+    while(!m_idle.empty()) {
+        int fd = m_idle.front();
+        m_idle.pop_front();
+        // 后端已经关闭的空闲连接先丢掉，免得非幂等请求发出去后才发现不能重试
+        char c;
+        int n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+        if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            close(fd);
+            continue;
+        }
+        m_lock.unlock();
+        reused = true;
+        return fd;
+    }
+    m_lock.unlock();
+    reused = false;
+    return connect_new();
+}
+
+void Upstream::release(int fd, bool reusable) {
+    if(fd < 0) {
+        return;
+    }
+    if(reusable) {
+        m_lock.lock();
+        if((int)m_idle.size() < MAX_IDLE) {
+            m_idle.push_back(fd);
+            m_lock.unlock();
+            return;
+        }
+        m_lock.unlock();
+    }
+    close(fd);
+}
+
+// 被动健康检查：连续失败达到阈值后摘除一段时间，到期后由下一个请求试探
+bool Upstream::healthy() {
+    m_lock.lock();
+    bool ok = m_fails < MAX_FAILS || time(NULL) >= m_down_until;
+    m_lock.unlock();
+    return ok;
+}
+
+void Upstream::mark_ok() {
+    m_lock.lock();
+    m_fails = 0;
+    m_lock.unlock();
+}
+
+void Upstream::mark_fail() {
+    m_lock.lock();
+    if(++m_fails >= MAX_FAILS) {
+        m_down_until = time(NULL) + DOWN_SECONDS;
+        printf("upstream %s is down\n", m_name);
+    }
+    // 连接池里的连接大概率也已失效
+    for(std::list<int>::iterator it = m_idle.begin(); it != m_idle.end(); ++it) {
+        close(*it);
+    }
+    m_idle.clear();
+    m_lock.unlock();
+}
+
+bool Proxy::add_route(const char *spec) {
+    if(m_route_count >= MAX_ROUTES) {
+        return false;
+    }
+    const char *eq = strchr(spec, '=');
+    if(!eq || eq == spec || spec[0] != '/' || eq - spec >= PREFIX_LEN) {
+        return false;
+    }
+
+    Proxy *proxy = new Proxy;
+    proxy->m_prefix_len = eq - spec;
+    memcpy(proxy->m_prefix, spec, proxy->m_prefix_len);
+    proxy->m_prefix[proxy->m_prefix_len] = '\0';
+    proxy->m_next = 0;
+
+    // 逗号分隔的后端列表
+    char item[128];
+    const char *p = eq + 1;
+    while(*p) {
+        const char *end = strchr(p, ',');
+        int len = end ? end - p : strlen(p);
+        if(len == 0 || len >= (int)sizeof(item)) {
+            delete proxy;
+            return false;
+        }
+        memcpy(item, p, len);
+        item[len] = '\0';
+        Upstream *up = new Upstream;
+        if(!up->parse(item)) {
+            delete up;
+            delete proxy;
+            return false;
+        }
+        proxy->m_upstreams.push_back(up);
+        p += len;
+        if(*p == ',') {
+            p++;
+        }
+    }
+    if(proxy->m_upstreams.empty()) {
+        delete proxy;
+        return false;
+    }
+    m_routes[m_route_count++] = proxy;
+    return true;
+}
+
+// 最长前缀匹配
+Proxy *Proxy::match(const char *url) {
+    Proxy *best = NULL;
+    for(int i=0; i<m_route_count; i++) {
+        Proxy *p = m_routes[i];
+        if(strncmp(url, p->m_prefix, p->m_prefix_len) == 0 &&
+            (!best || p->m_prefix_len > best->m_prefix_len)) {
+            best = p;
+        }
+    }
+    return best;
+}
+
+// 轮询选择一个健康的后端，全部不健康时仍然返回一个用于试探
+Upstream *Proxy::pick() {
+    int n = m_upstreams.size();
+    unsigned start = __sync_fetch_and_add(&m_next, 1);
+    for(int i=0; i<n; i++) {
+        Upstream *up = m_upstreams[(start + i) % n];
+        if(up->healthy()) {
+            return up;
+        }
+    }
+    return m_upstreams[start % n];
+}
+
+bool Proxy::forward(const char *req, int req_len, bool idempotent, bool more, ProxyResponse &resp) {
+    resp.fd = -1;
+    int n = m_upstreams.size();
+    for(int i=0; i<n; i++) {
+        Upstream *up = pick();
+        bool reused = false;
+        int fd = up->acquire(reused);
+        if(fd == -1) {
+            up->mark_fail();
+            continue;
+        }
+
+        int sent = 0;
+        EXCHANGE ret = exchange(fd, req, req_len, more, resp, sent);
+        // 复用的空闲连接可能已被后端关闭，换一条新连接重试一次
+        if(ret == EXCHANGE_IO && reused && (idempotent || sent == 0)) {
+            close(fd);
+            fd = up->acquire(reused);
+            sent = 0;
+            ret = fd == -1 ? EXCHANGE_IO : exchange(fd, req, req_len, more, resp, sent);
+        }
+        if(ret == EXCHANGE_OK) {
+            resp.fd = fd;
+            resp.upstream = up;
+            if(!more) {
+                up->mark_ok();
+                if(resp.left == 0) {
+                    finish(resp);
+                }
+            }
+            return true;
+        }
+        if(fd != -1) {
+            close(fd);
+        }
+        // 后端本身是正常的，不摘除，也不把同一个请求再发给别的后端
+        if(ret == EXCHANGE_UNSUPPORTED) {
+            return false;
+        }
+        up->mark_fail();
+        // 请求可能已经被后端处理，非幂等的请求不能再发一次
+        if(!idempotent && sent > 0) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// 发送请求，请求体已经发完时接着读取响应头
+Proxy::EXCHANGE Proxy::exchange(int fd, const char *req, int req_len, bool more, ProxyResponse &resp, int &sent) {
+    while(sent < req_len) {
+        int n = send(fd, req + sent, req_len - sent, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return EXCHANGE_IO;
+        }
+        sent += n;
+    }
+    if(more) {
+        return EXCHANGE_OK;
+    }
+    return recv_head(fd, resp);
+}
+
+// 读取响应头，和头部一起读到的响应体作为第一段
+Proxy::EXCHANGE Proxy::recv_head(int fd, ProxyResponse &resp) {
+    if(!resp.buf) {
+        resp.buf = (char *)malloc(BUFFER_SIZE);
+        if(!resp.buf) {
+            return EXCHANGE_UNSUPPORTED;
+        }
+    }
+    char *buf = resp.buf;
+    int len = 0;
+    char *head_end = NULL;
+    while(!head_end) {
+        if(len == BUFFER_SIZE) {
+            return EXCHANGE_UNSUPPORTED;
+        }
+        int n = recv(fd, buf + len, BUFFER_SIZE - len, 0);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return EXCHANGE_IO;
+        }
+        len += n;
+        head_end = (char *)memmem(buf, len, "\r\n\r\n", 4);
+    }
+    head_end += 4;
+    int head_len = head_end - buf;
+    if(head_len < 16 || strncmp(buf, "HTTP/1.", 7) != 0) {
+        return EXCHANGE_UNSUPPORTED;
+    }
+
+    // 扫描关心的几个头部字段
+    long content_len = -1;                      // 没有Content-Length时以关闭连接作为响应结束
+    bool keep_alive = true;
+    int status = atoi(buf + 9);
+    bool no_body = (status >= 100 && status < 200) || status == 204 || status == 304;
+    char *line = (char *)memmem(buf, head_len, "\r\n", 2) + 2;
+    for( ; line < head_end - 2; line = (char *)memmem(line, head_end - line, "\r\n", 2) + 2) {
+        if(strncasecmp(line, "Content-Length:", 15) == 0) {
+            content_len = atol(line + 15);
+            if(content_len < 0) {
+                return EXCHANGE_UNSUPPORTED;
+            }
+        }
+        else if(strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            // 暂不支持chunked编码的后端响应
+            return EXCHANGE_UNSUPPORTED;
+        }
+        else if(strncasecmp(line, "Connection:", 11) == 0) {
+            const char *v = line + 11 + strspn(line + 11, " \t");
+            if(strncasecmp(v, "close", 5) == 0) {
+                keep_alive = false;
+            }
+        }
+    }
+    if(no_body) {
+        content_len = 0;
+    }
+
+    resp.head_len = head_len;
+    resp.body_len = content_len;
+    resp.data = head_end;
+    resp.len = len - head_len;
+    resp.reusable = keep_alive && content_len >= 0;
+    if(content_len >= 0 && resp.len > content_len) {
+        // 后端多发了数据，连接状态不可信
+        resp.len = content_len;
+        resp.reusable = false;
+    }
+    resp.left = content_len >= 0 ? content_len - resp.len : -1;
+    return EXCHANGE_OK;
+}
+
+// 从客户端收到的请求体，阻塞发送
+bool Proxy::send_body(ProxyResponse &resp, const char *data, int len) {
+    int sent = 0;
+    while(sent < len) {
+        int n = send(resp.fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            resp.upstream->mark_fail();
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// 请求体发完后读取响应头，请求体已经无法重发，失败时不再换后端
+bool Proxy::receive(ProxyResponse &resp) {
+    EXCHANGE ret = recv_head(resp.fd, resp);
+    if(ret == EXCHANGE_IO) {
+        resp.upstream->mark_fail();
+    }
+    if(ret != EXCHANGE_OK) {
+        return false;
+    }
+    resp.upstream->mark_ok();
+    if(resp.left == 0) {
+        finish(resp);
+    }
+    return true;
+}
+
+// 上一段已经发给客户端，buf可以整个覆盖
+bool Proxy::next(ProxyResponse &resp) {
+    long want = resp.left < 0 || resp.left > BUFFER_SIZE ? BUFFER_SIZE : resp.left;
+    int n;
+    do {
+        n = recv(resp.fd, resp.buf, want, 0);
+    } while(n < 0 && errno == EINTR);
+    resp.data = resp.buf;
+    resp.len = 0;
+    // 以关闭连接结束的响应已经读完
+    if(n == 0 && resp.left < 0) {
+        resp.left = 0;
+        finish(resp);
+        return true;
+    }
+    if(n <= 0) {
+        resp.upstream->mark_fail();
+        return false;
+    }
+    resp.len = n;
+    if(resp.left > 0) {
+        resp.left -= n;
+        if(resp.left == 0) {
+            finish(resp);
+        }
+    }
+    return true;
+}
+
+// 响应体已经全部读入，不用等发给客户端就可以归还连接
+void Proxy::finish(ProxyResponse &resp) {
+    resp.upstream->release(resp.fd, resp.reusable);
+    resp.fd = -1;
+}
+
+void Proxy::release(ProxyResponse &resp) {
+    if(resp.fd != -1) {
+        // 请求或响应没有传完，连接上的数据不完整，不能复用
+        resp.upstream->release(resp.fd, false);
+        resp.fd = -1;
+    }
+    free(resp.buf);
+    resp.buf = NULL;
+}
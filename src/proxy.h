@@ -0,0 +1,104 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <ctime>
+#include <list>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "locker.h"
+
+// 反向代理：把指定前缀的请求转发到后端服务
+
+// 一个后端地址，维护一组空闲的长连接
+class Upstream {
+public:
+    Upstream();
+    ~Upstream();
+
+    bool parse(const char *spec);               // 解析 "127.0.0.1:8080" 或 "unix:/path"
+    int acquire(bool &reused);                  // 取一个连接，优先复用空闲连接
+    void release(int fd, bool reusable);        // 归还连接，不可复用则关闭
+    bool healthy();                             // 是否可以接收请求
+    void mark_ok();
+    void mark_fail();
+
+public:
+    static const int MAX_IDLE = 32;             // 每个后端最多保留的空闲连接数
+    static const int MAX_FAILS = 3;             // 连续失败多少次后摘除
+    static const int DOWN_SECONDS = 5;          // 摘除后多久再尝试
+
+    char m_name[128];
+
+private:
+    int connect_new();
+
+private:
+    sockaddr_storage m_addr;
+    socklen_t m_addrlen;
+    std::list<int> m_idle;                      // 空闲连接
+    Locker m_lock;
+    int m_fails;                                // 连续失败次数
+    time_t m_down_until;                        // 摘除截止时间
+};
+
+// 一次转发中后端的连接和响应
+// 响应不整个缓存：buf中先是头部和第一段响应体，之后每发完一段再用next读入下一段，
+// 响应体读完之前后端连接由这个请求占用
+struct ProxyResponse {
+    char *buf;                                  // malloc出来的BUFFER_SIZE字节
+    int head_len;                               // 头部长度，包括最后的空行
+    long body_len;                              // 响应体总长度，-1表示以后端关闭连接结束
+    char *data;                                 // buf中当前这段响应体
+    int len;
+    long left;                                  // 后端还没有读的响应体字节数，-1表示直到连接关闭
+    int fd;                                     // 占用的后端连接，没有时为-1
+    Upstream *upstream;
+    bool reusable;                              // 响应读完后连接可以放回空闲列表
+};
+
+// 一条转发规则：前缀 -> 多个后端，轮询负载均衡
+class Proxy {
+public:
+    static bool add_route(const char *spec);    // "/api=127.0.0.1:8080,unix:/tmp/app.sock"
+    static Proxy *match(const char *url);
+    static bool empty() { return m_route_count == 0; }
+
+    // idempotent为false时，请求可能已经到达后端就不再重试或换后端重发
+    // more为true时请求体还没有发完，只发送req，剩下的由send_body发送，再用receive读取响应头
+    bool forward(const char *req, int req_len, bool idempotent, bool more, ProxyResponse &resp);
+    static bool send_body(ProxyResponse &resp, const char *data, int len);
+    static bool receive(ProxyResponse &resp);
+    static bool next(ProxyResponse &resp);      // 读入下一段响应体，覆盖buf中已经发出去的那一段
+    static void release(ProxyResponse &resp);   // 归还后端连接并释放buf
+
+public:
+    static const int MAX_ROUTES = 16;
+    static const int PREFIX_LEN = 64;
+    static const int BUFFER_SIZE = 64 * 1024;  // 后端响应每次读入的最大长度，头部必须能放下
+
+private:
+    // 一次收发的结果：只有连接层面的失败才说明后端有问题
+    enum EXCHANGE {
+        EXCHANGE_OK = 0,
+        EXCHANGE_IO,            // 连接、发送或接收失败，后端可能已经不可用
+        EXCHANGE_UNSUPPORTED    // 后端正常，但响应无法转发(chunked、头部过大、格式错误)
+    };
+
+    Upstream *pick();
+    static EXCHANGE exchange(int fd, const char *req, int req_len, bool more, ProxyResponse &resp, int &sent);
+    static EXCHANGE recv_head(int fd, ProxyResponse &resp);
+    static void finish(ProxyResponse &resp);
+
+private:
+    char m_prefix[PREFIX_LEN];
+    int m_prefix_len;
+    std::vector<Upstream *> m_upstreams;
+    unsigned m_next;                            // 轮询下标
+
+    static Proxy *m_routes[MAX_ROUTES];
+    static int m_route_count;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include "sendsched.h"
+#include <cstdio>
+#include <ctime>
+
+#include "httpconn.h"
+
+long SendSched::m_quantum = DEFAULT_QUANTUM;
+long SendSched::m_rate = 0;
+long SendSched::m_burst = 0;
+std::deque<SendSched::Entry> SendSched::m_run;
+std::priority_queue<SendSched::Entry, std::vector<SendSched::Entry>, std::greater<SendSched::Entry> > SendSched::m_timers;
+unsigned long SendSched::m_yields = 0;
+unsigned long SendSched::m_throttles = 0;
+unsigned long SendSched::m_resumed = 0;
+uint64_t SendSched::m_wait_ns = 0;
+uint64_t SendSched::m_max_wait_ns = 0;
+size_t SendSched::m_max_run = 0;
+
+uint64_t SendSched::now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void SendSched::init(long quantum, long rate) {
+    m_quantum = quantum;
+    m_rate = rate;
+    m_burst = rate * BURST_MS / 1000;
+    if(m_burst < MIN_BURST) {
+        m_burst = MIN_BURST;
+    }
+}
+
+void SendSched::yield(Httpconn *conn, int fd) {
+    Entry e = { conn, fd, now_ns() };
+    conn->m_send_queued = true;
+    m_run.push_back(e);
+    m_yields++;
+    if(m_run.size() > m_max_run) {
+        m_max_run = m_run.size();
+    }
+}
+
+void SendSched::delay(Httpconn *conn, int fd, uint64_t wake_ns) {
+    Entry e = { conn, fd, wake_ns };
+    conn->m_send_queued = true;
+    m_timers.push(e);
+    m_throttles++;
+}
+
+int SendSched::timeout(int max_ms) {
+    if(!m_run.empty()) {
+        return 0;
+    }
+    if(m_timers.empty()) {
+        return max_ms;
+    }
+    uint64_t now = now_ns();
+    uint64_t wake = m_timers.top().ns;
+    if(wake <= now) {
+        return 0;
+    }
+    // 向上取整，避免提前醒来后空转
+    uint64_t ms = (wake - now + 999999) / 1000000;
+    return ms < (uint64_t)max_ms ? (int)ms : max_ms;
+}
+
+// 只取调用时已经在队列中的连接，本轮再次让出的连接要等下一轮
+int SendSched::ready(int *fds, int max) {
+    uint64_t now = now_ns();
+    while(!m_timers.empty() && m_timers.top().ns <= now) {
+        m_run.push_back(m_timers.top());
+        m_timers.pop();
+    }
+    int n = 0;
+    size_t count = m_run.size();
+    for(size_t i=0; i<count && n<max; i++) {
+        Entry e = m_run.front();
+        m_run.pop_front();
+        // 排队期间连接已经关闭，fd可能已经分给了新连接
+        if(!e.conn->m_send_queued) {
+            continue;
+        }
+        e.conn->m_send_queued = false;
+        uint64_t wait = now > e.ns ? now - e.ns : 0;
+        m_wait_ns += wait;
+        if(wait > m_max_wait_ns) {
+            m_max_wait_ns = wait;
+        }
+        m_resumed++;
+        fds[n++] = e.fd;
+    }
+    return n;
+}
+
+void SendSched::dump() {
+    printf("send: quantum=%ld rate=%ld yields=%lu throttles=%lu queued=%zu delayed=%zu max_queue=%zu avg_wait=%.1fus max_wait=%.1fus\n",
+        m_quantum, m_rate, m_yields, m_throttles, m_run.size(), m_timers.size(), m_max_run,
+        m_resumed ? m_wait_ns / 1000.0 / m_resumed : 0.0, m_max_wait_ns / 1000.0);
+    fflush(stdout);
+}
@@ -0,0 +1,59 @@
+#ifndef SENDSCHED_H
+#define SENDSCHED_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <queue>
+#include <vector>
+
+class Httpconn;
+
+// 发送调度，只在主线程中使用
+// 每次事件最多发送一个额度(quantum)的数据，用完额度的连接排到运行队列末尾，
+// 主循环每轮处理完epoll事件后按顺序轮询一遍，大文件下载不会长期占用主线程。
+// 开启单连接限速时，令牌不够的连接放到定时队列中，到时间后再回到运行队列
+class SendSched {
+public:
+    static void init(long quantum, long rate);
+    static long quantum() { return m_quantum; }
+    static long rate() { return m_rate; }
+    static long burst() { return m_burst; }
+
+    static void yield(Httpconn *conn, int fd);                  // 用完额度，排到队尾
+    static void delay(Httpconn *conn, int fd, uint64_t wake_ns);    // 超过带宽上限，到时间后再发送
+    static int timeout(int max_ms);                             // epoll_wait的超时时间
+    static int ready(int *fds, int max);                        // 取出本轮继续发送的连接
+    static void dump();
+
+    static uint64_t now_ns();
+
+public:
+    static const long DEFAULT_QUANTUM = 1024 * 1024;
+    static const int BURST_MS = 100;                            // 限速时令牌桶的容量，按多少毫秒的流量算
+    static const long MIN_BURST = 16 * 1024;
+
+private:
+    struct Entry {
+        Httpconn *conn;
+        int fd;
+        uint64_t ns;                                            // 入队时间或唤醒时间
+        bool operator>(const Entry &other) const { return ns > other.ns; }
+    };
+
+    static long m_quantum;                                      // 每次事件的发送额度，0表示不限制
+    static long m_rate;                                         // 每个连接每秒最多发送的字节数，0表示不限制
+    static long m_burst;
+    static std::deque<Entry> m_run;
+    static std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > m_timers;
+
+    // 公平性统计
+    static unsigned long m_yields;
+    static unsigned long m_throttles;
+    static unsigned long m_resumed;
+    static uint64_t m_wait_ns;                                  // 从让出到继续发送的总等待时间
+    static uint64_t m_max_wait_ns;
+    static size_t m_max_run;                                    // 运行队列的最大长度
+};
+
+#endif
@@ -5,114 +5,334 @@
 #include <pthread.h>
 #include <list>
 #include <exception>
-#include <pthread.h>
 #include <cstdio>
+#include <cstdint>
+#include <ctime>
 
 
 #include "locker.h"
+#include "probes.h"
 
 // 线程池类，模板类代码复用，T为任务
+// 请求按预估开销分为几个调度类别，各类别有自己的队列，按权重轮询取任务，
+// 某个类别的队头等待超过MAX_WAIT_NS时优先处理，防止被饿死。
+// 线程数在[min, max]之间伸缩：没有空闲线程且队列积压或队头等待过久时增加线程，
+// 线程空闲超过IDLE_NS后退出(不少于min)。线程都是可join的，析构时等待全部退出
 template<typename T>
 class Threadpool {
 public:
+    static const int CLASS_COUNT = 3;                   // 调度类别数，0的开销最小
+    static const uint64_t MAX_WAIT_NS = 50000000;       // 超过50ms的任务优先处理
+    static constexpr int CLASS_WEIGHTS[CLASS_COUNT] = { 8, 4, 1 };     // 各类别的调度权重
+    static const uint64_t GROW_WAIT_NS = 2000000;       // 队头等待超过2ms时扩容
+    static const uint64_t GROW_INTERVAL_NS = 5000000;   // 两次扩容至少间隔5ms，积压持续存在才继续扩容
+    static const uint64_t IDLE_NS = 10000000000ull;     // 空闲10s的线程退出
 
-    Threadpool(int thread_number = 8, int max_requests = 10000);
+    Threadpool(int min_threads = 4, int max_threads = 64, int max_requests = 10000);
     ~Threadpool();
-    bool append(T* request);    // 添加新的任务
+    bool append(T* request, int cls = 0);   // 添加新的任务
+    void maintain();                        // 主循环定期调用，积压持续存在时扩容
+    void dump();                            // 打印各类别的排队时间和线程数
 
 private:
+    // 一个工作线程，退出后由主线程在扩容或析构时join
+    struct Worker {
+        Threadpool *pool;
+        pthread_t thread;
+        bool exited;
+    };
+
     static void * worker(void * arg);
-    void run();
+    void run(Worker *self);
+    int pick(uint64_t now);                 // 选择下一个要处理的类别，需持有队列锁
+    bool spawn();                           // 增加一个线程，需持有队列锁
+    void reap();                            // join已经退出的线程，需持有队列锁
+    bool should_grow(uint64_t now);         // 需持有队列锁
+    void grow(uint64_t now);                // 需持有队列锁
+
+    static uint64_t now_ns() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+    struct Item {
+        T* request;
+        uint64_t enqueue_ns;                // 入队时间
+    };
+
+    // 每个类别的排队统计
+    struct ClassStat {
+        uint64_t count;
+        uint64_t wait_ns;
+        uint64_t max_wait_ns;
+        uint64_t promoted;                  // 因等待过久而优先处理的次数
+    };
 
 private:
-    int m_thread_number;        // 线程数量
-    pthread_t *m_threads;       // 线程池数组
+    int m_min_threads;          // 线程数下限
+    int m_max_threads;          // 线程数上限
+    std::list<Worker> m_workers;    // 所有线程，包括已退出还没join的
+    int m_alive;                // 正在运行的线程数
+    int m_idle;                 // 等待任务的线程数
     int m_max_request;          // 请求中最多允许等待的请求数量
-    std::list<T*> m_workqueue;   // 请求队列
+    std::list<Item> m_workqueue[CLASS_COUNT];   // 每个类别的请求队列
+    int m_queued;               // 所有队列中的请求总数
+    int m_credits[CLASS_COUNT]; // 本轮剩余的调度次数，用完后按权重重新分配
+    ClassStat m_stats[CLASS_COUNT];
     Locker m_queuelocker;       // 请求队列互斥锁
-    Sem m_queuestat;            // 信号量判断是否有任务需要处理
-    bool m_stop;                // 是否结束线程  
+    Cond m_queuecond;           // 有新任务或线程池停止
+    bool m_stop;                // 是否结束线程
 
-};
+    // 伸缩统计
+    uint64_t m_last_grow_ns;
+    unsigned long m_grows;
+    unsigned long m_shrinks;
+    int m_peak;                 // 最多同时运行的线程数
+    uint64_t m_busy_ns;         // 所有线程处理任务的总时间
+    uint64_t m_last_dump_ns;
+    uint64_t m_last_busy_ns;
 
-#include "threadpool.h"
+};
 
 template<typename T>
-Threadpool<T>::Threadpool(int thread_number, int max_requests):
-    m_thread_number(thread_number), m_max_request(max_requests),
-    m_stop(false), m_threads(NULL) {
-    if((thread_number <= 0) || (max_requests <= 0)) {
+Threadpool<T>::Threadpool(int min_threads, int max_threads, int max_requests):
+    m_min_threads(min_threads), m_max_threads(max_threads), m_alive(0), m_idle(0),
+    m_max_request(max_requests), m_stop(false), m_last_grow_ns(0), m_grows(0), m_shrinks(0),
+    m_peak(0), m_busy_ns(0), m_last_busy_ns(0) {
+    if((min_threads <= 0) || (max_threads < min_threads) || (max_requests <= 0)) {
         throw std::exception();
     }
-
-    m_threads = new pthread_t[m_thread_number];
-    if(!m_threads) {
-        throw std::exception();
+    m_queued = 0;
+    for(int i=0; i<CLASS_COUNT; i++) {
+        m_credits[i] = CLASS_WEIGHTS[i];
+        m_stats[i] = ClassStat();
     }
+    m_last_dump_ns = now_ns();
 
-    // 创建线程，设置为分离
-    for(int i=0; i<thread_number; i++ ) {
-        printf("create the %dth thread\n", i);
-        if(pthread_create(m_threads+i, NULL, worker, this) != 0) {
-            delete [] m_threads;
+    // 先创建min个线程
+    m_queuelocker.lock();
+    for(int i=0; i<min_threads; i++ ) {
+        if(!spawn()) {
+            m_queuelocker.unlock();
             throw std::exception();
         }
+    }
+    m_queuelocker.unlock();
+}
 
-        if(pthread_detach(m_threads[i])) {
-            delete [] m_threads;
-            throw std::exception();
+template<typename T>
+Threadpool<T>::~Threadpool() {
+    m_queuelocker.lock();
+    m_stop = true;
+    m_queuecond.broadcast();
+    m_queuelocker.unlock();
+    // 线程退出时不再修改m_workers，这里不需要加锁
+    for(typename std::list<Worker>::iterator it = m_workers.begin(); it != m_workers.end(); ++it) {
+        pthread_join(it->thread, NULL);
+    }
+}
+
+template<typename T>
+bool Threadpool<T>::spawn() {
+    reap();
+    m_workers.push_back(Worker());
+    Worker &w = m_workers.back();
+    w.pool = this;
+    w.exited = false;
+    if(pthread_create(&w.thread, NULL, worker, &w) != 0) {
+        m_workers.pop_back();
+        return false;
+    }
+    m_alive++;
+    if(m_alive > m_peak) {
+        m_peak = m_alive;
+    }
+    printf("create the %dth thread\n", m_alive);
+    return true;
+}
+
+template<typename T>
+void Threadpool<T>::reap() {
+    typename std::list<Worker>::iterator it = m_workers.begin();
+    while(it != m_workers.end()) {
+        if(it->exited) {
+            // 线程已经不再访问队列，join不会等太久
+            pthread_join(it->thread, NULL);
+            it = m_workers.erase(it);
+        }
+        else {
+            ++it;
         }
     }
 }
 
 template<typename T>
-Threadpool<T>::~Threadpool() {
-    delete [] m_threads;
-    m_stop = false;
+bool Threadpool<T>::should_grow(uint64_t now) {
+    if(m_idle > 0 || m_alive >= m_max_threads || now - m_last_grow_ns < GROW_INTERVAL_NS) {
+        return false;
+    }
+    // 积压的任务比线程多，或者有任务已经等了一段时间
+    if(m_queued > m_alive) {
+        return true;
+    }
+    for(int i=0; i<CLASS_COUNT; i++) {
+        if(!m_workqueue[i].empty() && now - m_workqueue[i].front().enqueue_ns > GROW_WAIT_NS) {
+            return true;
+        }
+    }
+    return false;
 }
 
 template<typename T>
-bool Threadpool<T>::append(T* request) {
+void Threadpool<T>::grow(uint64_t now) {
+    if(should_grow(now) && spawn()) {
+        m_last_grow_ns = now;
+        m_grows++;
+    }
+}
+
+// 所有线程都阻塞在慢请求上时不会有新的入队和出队，由主循环检查
+template<typename T>
+void Threadpool<T>::maintain() {
+    m_queuelocker.lock();
+    grow(now_ns());
+    m_queuelocker.unlock();
+}
+
+template<typename T>
+bool Threadpool<T>::append(T* request, int cls) {
+    if(cls < 0 || cls >= CLASS_COUNT) {
+        cls = CLASS_COUNT - 1;
+    }
+    uint64_t now = now_ns();
+    Item item = { request, now };
     m_queuelocker.lock();
-    if(m_workqueue.size() > m_max_request) {
+    if(m_queued > m_max_request) {
         m_queuelocker.unlock();
         return false;
     }
 
-    m_workqueue.push_back(request);
+    m_workqueue[cls].push_back(item);
+    m_queued++;
+    grow(now);
+    m_queuecond.signal();
     m_queuelocker.unlock();
-    m_queuestat.post();
+    PROBE2(enqueue, request, cls);
     return true;
 }
+
+template<typename T>
+int Threadpool<T>::pick(uint64_t now) {
+    // 等待最久且超时的类别优先
+    int oldest = -1;
+    for(int i=0; i<CLASS_COUNT; i++) {
+        if(!m_workqueue[i].empty() && now - m_workqueue[i].front().enqueue_ns > MAX_WAIT_NS &&
+            (oldest == -1 || m_workqueue[i].front().enqueue_ns < m_workqueue[oldest].front().enqueue_ns)) {
+            oldest = i;
+        }
+    }
+    if(oldest != -1) {
+        m_stats[oldest].promoted++;
+        return oldest;
+    }
+
+    // 按权重轮询，非空类别的次数都用完后重新分配
+    for(int round=0; round<2; round++) {
+        for(int i=0; i<CLASS_COUNT; i++) {
+            if(!m_workqueue[i].empty() && m_credits[i] > 0) {
+                m_credits[i]--;
+                return i;
+            }
+        }
+        for(int i=0; i<CLASS_COUNT; i++) {
+            m_credits[i] = CLASS_WEIGHTS[i];
+        }
+    }
+    return -1;
+}
+
+template<typename T>
+void Threadpool<T>::dump() {
+    static const char *class_names[] = { "small", "unknown", "large" };
+    m_queuelocker.lock();
+    for(int i=0; i<CLASS_COUNT; i++) {
+        ClassStat &st = m_stats[i];
+        printf("queue %-8s queued=%zu count=%lu avg_wait=%.1fus max_wait=%.1fus promoted=%lu\n",
+            class_names[i], m_workqueue[i].size(), st.count,
+            st.count ? st.wait_ns / 1000.0 / st.count : 0.0, st.max_wait_ns / 1000.0, st.promoted);
+    }
+    // 利用率按上次打印以来的处理时间和当前线程数估算
+    uint64_t now = now_ns();
+    double util = (m_busy_ns - m_last_busy_ns) * 100.0 / ((now - m_last_dump_ns) * (double)m_alive);
+    m_last_dump_ns = now;
+    m_last_busy_ns = m_busy_ns;
+    printf("pool threads=%d min=%d max=%d idle=%d peak=%d grows=%lu shrinks=%lu util=%.1f%%\n",
+        m_alive, m_min_threads, m_max_threads, m_idle, m_peak, m_grows, m_shrinks, util);
+    m_queuelocker.unlock();
+    fflush(stdout);
+}
 template<typename T>
 void * Threadpool<T>::worker(void * arg) {
-    // Threadpool<T> * pool = (Threadpool<T> *) arg;
-    Threadpool *pool = (Threadpool *)arg;
-    pool->run();
-    return pool;
+    Worker *self = (Worker *)arg;
+    self->pool->run(self);
+    return NULL;
 }
 
 template<typename T>
-void Threadpool<T>::run() {
+void Threadpool<T>::run(Worker *self) {
+    m_queuelocker.lock();
     while(!m_stop) {
-        m_queuestat.wait();
-        m_queuelocker.lock();
-        if(m_workqueue.empty()) {
-            m_queuelocker.unlock();
+        if(m_queued == 0) {
+            // 等待新任务，空闲太久且线程数多于下限时退出
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += IDLE_NS / 1000000000ull;
+            m_idle++;
+            bool signaled = m_queuecond.timedwait(m_queuelocker.get(), deadline);
+            m_idle--;
+            if(!signaled && !m_stop && m_queued == 0 && m_alive > m_min_threads) {
+                m_alive--;
+                m_shrinks++;
+                break;
+            }
             continue;
         }
 
-        T* request = m_workqueue.front();
-        m_workqueue.pop_front();
-        m_queuelocker.unlock();
-
-        if(!request) {
+        uint64_t now = now_ns();
+        int cls = pick(now);
+        if(cls == -1) {
             continue;
         }
 
-        request->process();
+        Item item = m_workqueue[cls].front();
+        m_workqueue[cls].pop_front();
+        m_queued--;
+        ClassStat &st = m_stats[cls];
+        uint64_t wait = now - item.enqueue_ns;
+        st.count++;
+        st.wait_ns += wait;
+        if(wait > st.max_wait_ns) {
+            st.max_wait_ns = wait;
+        }
+        // 取出的任务已经等了很久，说明积压还在
+        grow(now);
+        m_queuelocker.unlock();
+
+        T* request = item.request;
+        PROBE3(dequeue, request, cls, wait);
 
+        if(request) {
+            request->process();
+        }
+
+        uint64_t busy = now_ns() - now;
+        m_queuelocker.lock();
+        m_busy_ns += busy;
     }
+    // 缩容退出的线程由之后的spawn join，其余的由析构函数join
+    self->exited = true;
+    m_queuelocker.unlock();
 }
 
-#endif
\ No newline at end of file
+#endif
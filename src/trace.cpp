@@ -0,0 +1,120 @@
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+
+bool Trace::m_enabled = false;
+double Trace::m_ns_per_tick = 1.0;
+long Trace::m_slow_us = 0;
+Trace::Histogram Trace::m_hist[PHASE_COUNT];
+
+static const char *phase_names[Trace::PHASE_COUNT] = {
+    "accept", "read", "queue", "parse", "request", "wait_write", "write", "total"
+};
+
+// 每个阶段的起止时间戳
+static const Trace::POINT phase_points[Trace::PHASE_COUNT][2] = {
+    { Trace::ACCEPT,      Trace::READ_BEGIN },
+    { Trace::READ_BEGIN,  Trace::READ_END },
+    { Trace::READ_END,    Trace::DEQUEUE },
+    { Trace::DEQUEUE,     Trace::PARSED },
+    { Trace::PARSED,      Trace::PROCESSED },
+    { Trace::PROCESSED,   Trace::WRITE_BEGIN },
+    { Trace::WRITE_BEGIN, Trace::WRITE_END },
+    { Trace::READ_BEGIN,  Trace::WRITE_END },
+};
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void Trace::init(long slow_us) {
+    m_slow_us = slow_us;
+    memset(m_hist, 0, sizeof(m_hist));
+
+    // 用单调时钟校准TSC频率
+    uint64_t ns0 = monotonic_ns(), t0 = now();
+    usleep(20000);
+    uint64_t ns1 = monotonic_ns(), t1 = now();
+    m_ns_per_tick = t1 > t0 ? (double)(ns1 - ns0) / (t1 - t0) : 1.0;
+    m_enabled = true;
+}
+
+// 只在主线程中调用，不需要加锁
+void Trace::record(uint64_t *ts, int fd, const char *url) {
+    uint64_t phase_ns[PHASE_COUNT];
+    for(int i=0; i<PHASE_COUNT; i++) {
+        uint64_t begin = ts[phase_points[i][0]];
+        uint64_t end = ts[phase_points[i][1]];
+        // 没有经过这个阶段，比如错误请求没有PARSED
+        if(!begin || !end || end < begin) {
+            phase_ns[i] = 0;
+            continue;
+        }
+        uint64_t ns = (end - begin) * m_ns_per_tick;
+        phase_ns[i] = ns;
+
+        Histogram &h = m_hist[i];
+        h.count++;
+        h.sum_ns += ns;
+        if(ns > h.max_ns) {
+            h.max_ns = ns;
+        }
+        int b = ns ? 63 - __builtin_clzll(ns) : 0;
+        h.buckets[b < BUCKETS ? b : BUCKETS - 1]++;
+    }
+
+    // 慢请求日志，每秒最多打印10条
+    if(m_slow_us > 0 && phase_ns[P_TOTAL] / 1000 >= (uint64_t)m_slow_us) {
+        static time_t window = 0;
+        static int logged = 0;
+        time_t sec = time(NULL);
+        if(sec != window) {
+            window = sec;
+            logged = 0;
+        }
+        if(logged++ < 10) {
+            printf("slow request fd=%d url=%s total=%luus accept=%lu read=%lu queue=%lu parse=%lu request=%lu wait_write=%lu write=%lu\n",
+                fd, url ? url : "-", phase_ns[P_TOTAL] / 1000, phase_ns[P_ACCEPT] / 1000, phase_ns[P_READ] / 1000,
+                phase_ns[P_QUEUE] / 1000, phase_ns[P_PARSE] / 1000, phase_ns[P_REQUEST] / 1000,
+                phase_ns[P_WAIT_WRITE] / 1000, phase_ns[P_WRITE] / 1000);
+        }
+    }
+
+    memset(ts, 0, sizeof(uint64_t) * POINT_COUNT);
+}
+
+// 按桶的上界估算分位数，不超过最大值
+static uint64_t percentile(const uint64_t *buckets, int n, uint64_t count, uint64_t max, double q) {
+    uint64_t target = count * q, seen = 0;
+    for(int i=0; i<n; i++) {
+        seen += buckets[i];
+        if(seen > target) {
+            return std::min(2ull << i, (unsigned long long)max);
+        }
+    }
+    return max;
+}
+
+void Trace::dump() {
+    if(!m_enabled) {
+        return;
+    }
+    printf("%-10s %10s %10s %10s %10s %10s\n", "phase", "count", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+    for(int i=0; i<PHASE_COUNT; i++) {
+        Histogram &h = m_hist[i];
+        if(!h.count) {
+            continue;
+        }
+        printf("%-10s %10lu %10.1f %10.1f %10.1f %10.1f\n", phase_names[i], h.count,
+            h.sum_ns / 1000.0 / h.count,
+            percentile(h.buckets, BUCKETS, h.count, h.max_ns, 0.5) / 1000.0,
+            percentile(h.buckets, BUCKETS, h.count, h.max_ns, 0.99) / 1000.0,
+            h.max_ns / 1000.0);
+    }
+    fflush(stdout);
+}
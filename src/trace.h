@@ -0,0 +1,74 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <ctime>
+#endif
+
+// 请求各阶段耗时统计
+// 连接上记录各个阶段切换时的时间戳(TSC)，请求结束时累加到每个阶段的直方图中
+class Trace {
+public:
+    // 时间戳记录点
+    enum POINT {
+        ACCEPT = 0,         // 建立连接，只有连接上的第一个请求有
+        READ_BEGIN,         // 开始读请求
+        READ_END,           // 请求读完，准备放入请求队列
+        DEQUEUE,            // 工作线程取出请求
+        PARSED,             // 请求解析完成，开始do_request
+        PROCESSED,          // 响应已生成
+        WRITE_BEGIN,        // 主线程开始发送响应
+        WRITE_END,          // 响应发送完毕
+        POINT_COUNT
+    };
+
+    // 统计的阶段
+    enum PHASE { P_ACCEPT = 0, P_READ, P_QUEUE, P_PARSE, P_REQUEST, P_WAIT_WRITE, P_WRITE, P_TOTAL, PHASE_COUNT };
+
+    static void init(long slow_us);                 // 开启统计，slow_us > 0 时打印慢请求
+    static inline void stamp(uint64_t *ts, POINT p) {
+        if(m_enabled) {
+            ts[p] = now();
+        }
+    }
+    static inline void stamp_once(uint64_t *ts, POINT p) {
+        if(m_enabled && !ts[p]) {
+            ts[p] = now();
+        }
+    }
+    static void record(uint64_t *ts, int fd, const char *url);    // 请求结束，累加并清空时间戳
+    static void dump();                             // 打印各阶段直方图
+    static uint64_t count(PHASE phase) { return m_hist[phase].count; }     // 经过这个阶段的请求数
+
+    static bool m_enabled;
+
+public:
+    static const int BUCKETS = 40;                  // 按2的幂次分桶，单位ns
+
+private:
+    static inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+    }
+
+    struct Histogram {
+        uint64_t count;
+        uint64_t sum_ns;
+        uint64_t max_ns;
+        uint64_t buckets[BUCKETS];
+    };
+
+    static double m_ns_per_tick;
+    static long m_slow_us;
+    static Histogram m_hist[PHASE_COUNT];
+};
+
+#endif
@@ -0,0 +1,210 @@
+#include "upload.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+char Upload::m_prefix[PREFIX_LEN];
+long Upload::m_max_size = 0;
+unsigned long Upload::m_completed = 0;
+unsigned long Upload::m_aborted = 0;
+unsigned long Upload::m_rejected = 0;
+unsigned long Upload::m_bytes = 0;
+
+void Upload::set_prefix(const char *prefix) {
+    snprintf(m_prefix, sizeof(m_prefix), "%s", prefix);
+}
+
+bool Upload::match(const char *url) {
+    return m_prefix[0] && strncmp(url, m_prefix, strlen(m_prefix)) == 0;
+}
+
+void Upload::set_max_size(long bytes) {
+    m_max_size = bytes;
+}
+
+Upload::Upload(): m_fd(-1), m_left(0) {
+    m_tmp[0] = '\0';
+    m_path[0] = '\0';
+}
+
+Upload::~Upload() {
+    if(m_fd != -1) {
+        abort();
+    }
+}
+
+// 线程退出时关闭管道，线程池会回收空闲的线程
+struct ThreadPipe {
+    int fd[2];
+    ThreadPipe() {
+        fd[0] = fd[1] = -1;
+    }
+    ~ThreadPipe() {
+        if(fd[0] != -1) {
+            close(fd[0]);
+            close(fd[1]);
+        }
+    }
+};
+
+// 每个工作线程一个管道，splice只能在管道和其他fd之间搬运数据
+int *Upload::thread_pipe() {
+    static thread_local ThreadPipe tp;
+    int *p = tp.fd;
+    if(p[0] == -1) {
+        if(pipe2(p, O_CLOEXEC) == -1) {
+            p[0] = p[1] = -1;
+            return NULL;
+        }
+        fcntl(p[1], F_SETPIPE_SZ, PIPE_SIZE);
+    }
+    return p;
+}
+
+// 出错时管道里可能还剩数据，直接换一个新的
+void Upload::reset_pipe(int *p) {
+    close(p[0]);
+    close(p[1]);
+    p[0] = p[1] = -1;
+}
+
+Upload::STATUS Upload::begin(const char *path, long size) {
+    if(m_max_size > 0 && size > m_max_size) {
+        __sync_fetch_and_add(&m_rejected, 1);
+        return TOO_LARGE;
+    }
+    // 临时文件和目标文件放在同一目录下，保证rename是原子的
+    const char *slash = strrchr(path, '/');
+    if(!slash || slash[1] == '\0' || (int)strlen(path) >= PATH_LEN - 16) {
+        return NOT_FOUND;
+    }
+    snprintf(m_path, sizeof(m_path), "%s", path);
+    snprintf(m_tmp, sizeof(m_tmp), "%.*s/.upload.XXXXXX", (int)(slash - path), path);
+    m_fd = mkostemp(m_tmp, O_CLOEXEC);
+    if(m_fd == -1) {
+        return errno == ENOENT || errno == ENOTDIR ? NOT_FOUND : FAILED;
+    }
+    fchmod(m_fd, 0644);
+    // 提前分配磁盘空间，空间不够时在接收数据之前就拒绝
+    if(size > 0) {
+        int ret = posix_fallocate(m_fd, 0, size);
+        if(ret == ENOSPC || ret == EFBIG) {
+            close(m_fd);
+            m_fd = -1;
+            unlink(m_tmp);
+            __sync_fetch_and_add(&m_rejected, 1);
+            return NO_SPACE;
+        }
+    }
+    m_left = size;
+    return DONE;
+}
+
+Upload::STATUS Upload::write(const char *data, long len) {
+    while(len > 0) {
+        ssize_t n = ::write(m_fd, data, len);
+        if(n == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno == ENOSPC ? NO_SPACE : FAILED;
+        }
+        data += n;
+        len -= n;
+        m_left -= n;
+    }
+    return DONE;
+}
+
+Upload::STATUS Upload::splice_from(int sockfd) {
+    int *p = thread_pipe();
+    if(!p) {
+        return FAILED;
+    }
+    long slice = 0;
+    while(m_left > 0) {
+        if(slice >= SLICE_BYTES) {
+            return AGAIN;
+        }
+        long want = m_left < PIPE_SIZE ? m_left : PIPE_SIZE;
+        ssize_t n = splice(sockfd, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n == 0) {
+            return CLOSED;
+        }
+        if(n == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return AGAIN;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            return CLOSED;
+        }
+        // 管道中的数据必须全部写入文件，管道是线程共用的
+        long left = n;
+        while(left > 0) {
+            ssize_t w = splice(p[0], NULL, m_fd, NULL, left, SPLICE_F_MOVE);
+            if(w <= 0) {
+                if(w == -1 && errno == EINTR) {
+                    continue;
+                }
+                STATUS st = w == -1 && errno == ENOSPC ? NO_SPACE : FAILED;
+                reset_pipe(p);
+                return st;
+            }
+            left -= w;
+        }
+        m_left -= n;
+        slice += n;
+    }
+    return DONE;
+}
+
+Upload::STATUS Upload::commit() {
+    long size = lseek(m_fd, 0, SEEK_CUR);
+    if(fsync(m_fd) == -1) {
+        abort();
+        return FAILED;
+    }
+    close(m_fd);
+    m_fd = -1;
+    if(rename(m_tmp, m_path) == -1) {
+        unlink(m_tmp);
+        __sync_fetch_and_add(&m_aborted, 1);
+        return FAILED;
+    }
+    // 目录也要fsync，rename才算持久化
+    char *slash = strrchr(m_tmp, '/');
+    *slash = '\0';
+    int dirfd = open(m_tmp, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirfd != -1) {
+        fsync(dirfd);
+        close(dirfd);
+    }
+    __sync_fetch_and_add(&m_completed, 1);
+    __sync_fetch_and_add(&m_bytes, size);
+    return DONE;
+}
+
+void Upload::abort() {
+    if(m_fd == -1) {
+        return;
+    }
+    close(m_fd);
+    m_fd = -1;
+    unlink(m_tmp);
+    m_left = 0;
+    __sync_fetch_and_add(&m_aborted, 1);
+}
+
+void Upload::dump() {
+    if(!m_prefix[0]) {
+        return;
+    }
+    printf("upload: completed=%lu aborted=%lu rejected=%lu bytes=%lu\n", m_completed, m_aborted, m_rejected, m_bytes);
+    fflush(stdout);
+}
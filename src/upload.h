@@ -0,0 +1,58 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+// 文件上传：PUT/POST请求体用splice经过管道从socket直接写入临时文件，不经过用户态缓冲区。
+// 写完后fsync并rename到目标路径，中途失败或连接断开时删除临时文件。
+// 一次上传可能分多轮完成：socket暂时没有数据时返回AGAIN，等EPOLLIN后由线程池继续
+class Upload {
+public:
+    enum STATUS {
+        DONE = 0,       // 请求体已全部写入
+        AGAIN,          // socket暂时没有数据，或本轮写够了SLICE_BYTES
+        TOO_LARGE,      // 超过大小上限
+        NO_SPACE,       // 磁盘空间不足
+        NOT_FOUND,      // 目标目录不存在
+        CLOSED,         // 请求体没传完连接就关闭了
+        FAILED
+    };
+
+    static void set_prefix(const char *prefix);     // 允许上传的URL前缀
+    static bool match(const char *url);
+    static void set_max_size(long bytes);
+    static void dump();
+
+    Upload();
+    ~Upload();
+    bool active() const { return m_fd != -1; }
+    long left() const { return m_left; }
+    STATUS begin(const char *path, long size);      // 创建临时文件并预留空间
+    STATUS write(const char *data, long len);       // 写入已经读到缓冲区中的请求体
+    STATUS splice_from(int sockfd);                 // 从socket接收剩余的请求体
+    STATUS commit();                                // fsync后重命名为目标文件
+    void abort();                                   // 删除临时文件
+
+public:
+    static const int PREFIX_LEN = 64;
+    static const int PATH_LEN = 256;
+    static const long PIPE_SIZE = 1024 * 1024;      // 每个线程的中转管道容量
+    static const long SLICE_BYTES = 8L * 1024 * 1024;   // 一轮最多接收的字节数，避免一个上传长期占用工作线程
+
+private:
+    static int *thread_pipe();
+    static void reset_pipe(int *p);
+
+private:
+    int m_fd;                   // 临时文件
+    long m_left;                // 还没收到的请求体字节数
+    char m_tmp[PATH_LEN];       // 临时文件路径
+    char m_path[PATH_LEN];      // 目标文件路径
+
+    static char m_prefix[PREFIX_LEN];
+    static long m_max_size;     // 单个文件的大小上限，0表示不限制
+    static unsigned long m_completed;
+    static unsigned long m_aborted;
+    static unsigned long m_rejected;
+    static unsigned long m_bytes;
+};
+
+#endif
@@ -0,0 +1,203 @@
+#include "websocket.h"
+#include <cstdio>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "httpconn.h"
+
+char WebSocket::m_prefix[PREFIX_LEN];
+std::unordered_set<Httpconn *> WebSocket::m_subscribers;
+Locker WebSocket::m_publish_lock;
+std::list<std::string> WebSocket::m_published;
+std::atomic<bool> WebSocket::m_publish_pending(false);
+unsigned long WebSocket::m_broadcasts = 0;
+unsigned long WebSocket::m_dropped = 0;
+
+void WebSocket::set_prefix(const char *prefix) {
+    snprintf(m_prefix, sizeof(m_prefix), "%s", prefix);
+}
+
+bool WebSocket::match(const char *url) {
+    return m_prefix[0] && strncmp(url, m_prefix, strlen(m_prefix)) == 0;
+}
+
+// SHA-1，只用于计算握手的Sec-WebSocket-Accept
+static void sha1(const unsigned char *data, size_t len, unsigned char out[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    // 补位后的消息，握手的输入很短
+    size_t total = ((len + 8) / 64 + 1) * 64;
+    unsigned char *msg = new unsigned char[total]();
+    memcpy(msg, data, len);
+    msg[len] = 0x80;
+    uint64_t bits = (uint64_t)len * 8;
+    for(int i=0; i<8; i++) {
+        msg[total - 1 - i] = bits >> (8 * i);
+    }
+
+    for(size_t chunk=0; chunk<total; chunk+=64) {
+        uint32_t w[80];
+        for(int i=0; i<16; i++) {
+            const unsigned char *p = msg + chunk + i * 4;
+            w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        }
+        for(int i=16; i<80; i++) {
+            uint32_t v = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+            w[i] = (v << 1) | (v >> 31);
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for(int i=0; i<80; i++) {
+            uint32_t f, k;
+            if(i < 20) { f = (b & c) | (~b & d); k = 0x5A827999; }
+            else if(i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+            else if(i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+            uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    delete [] msg;
+
+    for(int i=0; i<5; i++) {
+        out[i*4] = h[i] >> 24;
+        out[i*4+1] = h[i] >> 16;
+        out[i*4+2] = h[i] >> 8;
+        out[i*4+3] = h[i];
+    }
+}
+
+static void base64(const unsigned char *in, size_t len, char *out) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i = 0;
+    for( ; i + 2 < len; i += 3) {
+        *out++ = table[in[i] >> 2];
+        *out++ = table[((in[i] & 0x3) << 4) | (in[i+1] >> 4)];
+        *out++ = table[((in[i+1] & 0xf) << 2) | (in[i+2] >> 6)];
+        *out++ = table[in[i+2] & 0x3f];
+    }
+    if(i < len) {
+        *out++ = table[in[i] >> 2];
+        if(i + 1 < len) {
+            *out++ = table[((in[i] & 0x3) << 4) | (in[i+1] >> 4)];
+            *out++ = table[(in[i+1] & 0xf) << 2];
+        }
+        else {
+            *out++ = table[(in[i] & 0x3) << 4];
+            *out++ = '=';
+        }
+        *out++ = '=';
+    }
+    *out = '\0';
+}
+
+void WebSocket::accept_key(const char *key, char *out) {
+    static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    char buf[128];
+    int len = snprintf(buf, sizeof(buf), "%s%s", key, guid);
+    unsigned char digest[20];
+    sha1((const unsigned char *)buf, len < (int)sizeof(buf) ? len : sizeof(buf) - 1, digest);
+    base64(digest, sizeof(digest), out);
+}
+
+// 服务器发出的帧不加掩码
+WsFrame WebSocket::encode(int opcode, const char *data, size_t len) {
+    std::string *frame = new std::string;
+    frame->reserve(len + 10);
+    frame->push_back((char)(0x80 | opcode));
+    if(len < 126) {
+        frame->push_back((char)len);
+    }
+    else if(len <= 0xffff) {
+        frame->push_back((char)126);
+        frame->push_back((char)(len >> 8));
+        frame->push_back((char)len);
+    }
+    else {
+        frame->push_back((char)127);
+        for(int i=7; i>=0; i--) {
+            frame->push_back((char)(len >> (8 * i)));
+        }
+    }
+    frame->append(data, len);
+    return WsFrame(frame);
+}
+
+// 客户端发来的负载需要用4字节掩码循环异或
+void WebSocket::unmask(char *data, size_t len, const uint8_t mask[4]) {
+    size_t i = 0;
+#ifdef __SSE2__
+    uint32_t m32;
+    memcpy(&m32, mask, 4);
+    __m128i m = _mm_set1_epi32(m32);
+    for( ; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, m));
+    }
+#endif
+    // 剩余部分每次处理8字节，i是16的倍数，掩码相位不变
+    uint64_t m64;
+    memcpy(&m64, mask, 4);
+    memcpy((char *)&m64 + 4, mask, 4);
+    for( ; i + 8 <= len; i += 8) {
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        v ^= m64;
+        memcpy(data + i, &v, 8);
+    }
+    for( ; i < len; i++) {
+        data[i] ^= mask[i & 3];
+    }
+}
+
+void WebSocket::subscribe(Httpconn *conn) {
+    m_subscribers.insert(conn);
+}
+
+void WebSocket::unsubscribe(Httpconn *conn) {
+    m_subscribers.erase(conn);
+}
+
+void WebSocket::broadcast(int opcode, const char *data, size_t len) {
+    WsFrame frame = encode(opcode, data, len);
+    m_broadcasts++;
+    for(std::unordered_set<Httpconn *>::iterator it = m_subscribers.begin(); it != m_subscribers.end(); ++it) {
+        if(!(*it)->ws_send(frame)) {
+            m_dropped++;
+        }
+    }
+}
+
+void WebSocket::publish(const char *data, size_t len) {
+    m_publish_lock.lock();
+    m_published.push_back(std::string(data, len));
+    m_publish_lock.unlock();
+    // 主线程还没处理上一次通知时不重复投递
+    if(!m_publish_pending.exchange(true)) {
+        Httpconn::m_completions->post(-1, CompletionQueue::PUBLISH);
+    }
+}
+
+void WebSocket::flush_published() {
+    m_publish_pending.store(false);
+    std::list<std::string> messages;
+    m_publish_lock.lock();
+    messages.swap(m_published);
+    m_publish_lock.unlock();
+    for(std::list<std::string>::iterator it = messages.begin(); it != messages.end(); ++it) {
+        broadcast(TEXT, it->data(), it->size());
+    }
+}
+
+void WebSocket::dump() {
+    if(!m_prefix[0]) {
+        return;
+    }
+    printf("websocket: subscribers=%zu broadcasts=%lu dropped=%lu\n", m_subscribers.size(), m_broadcasts, m_dropped);
+    fflush(stdout);
+}
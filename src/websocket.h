@@ -0,0 +1,58 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_set>
+
+#include "locker.h"
+
+class Httpconn;
+
+// WebSocket(RFC 6455)
+// 握手在线程池中完成，之后帧的收发都在主线程中进行。
+// 广播时帧只编码一次，放在引用计数的缓冲区中，所有订阅者的发送队列共享同一份数据
+typedef std::shared_ptr<const std::string> WsFrame;
+
+class WebSocket {
+public:
+    enum OPCODE { CONTINUATION = 0x0, TEXT = 0x1, BINARY = 0x2, CLOSE = 0x8, PING = 0x9, PONG = 0xA };
+
+    static void set_prefix(const char *prefix);                 // 允许升级的URL前缀
+    static bool match(const char *url);
+    static void accept_key(const char *key, char *out);         // 计算Sec-WebSocket-Accept，out至少29字节
+    static WsFrame encode(int opcode, const char *data, size_t len);
+    static void unmask(char *data, size_t len, const uint8_t mask[4]);
+
+    // 以下只能在主线程中调用
+    static void subscribe(Httpconn *conn);
+    static void unsubscribe(Httpconn *conn);
+    static void broadcast(int opcode, const char *data, size_t len);
+    static void flush_published();                              // 发送其他线程publish的消息
+
+    // 任意线程都可以调用，消息由主线程广播
+    static void publish(const char *data, size_t len);
+
+    static void dump();
+
+public:
+    static const int PREFIX_LEN = 64;
+    static const size_t MAX_QUEUE = 1024;                       // 订阅者发送队列的上限，超过则断开慢连接
+    static const size_t MAX_MESSAGE = 1024 * 1024;              // 一条消息所有分片的总长度上限，超过则以1009关闭
+    static const size_t MAX_CONTROL = 125;                      // 控制帧负载的最大长度
+
+private:
+    static char m_prefix[PREFIX_LEN];
+    static std::unordered_set<Httpconn *> m_subscribers;
+    static Locker m_publish_lock;
+    static std::list<std::string> m_published;
+    static std::atomic<bool> m_publish_pending;
+    static unsigned long m_broadcasts;
+    static unsigned long m_dropped;
+};
+
+#endif
@@ -0,0 +1,237 @@
+// Httpconn的微基准测试：请求解析、响应生成和发送
+// Httpconn的调试输出都重定向到/dev/null，结果输出到原来的stdout
+#include <ext/stdio_filebuf.h>
+#include <benchmark/benchmark.h>
+#include <cstdarg>
+#include <ctime>
+#include <unistd.h>
+
+#include "harness.h"
+#include "httpheader.h"
+#include "upstream.h"
+
+static const char simple_request[] =
+    "GET /index.html HTTP/1.1\r\nHost: bench\r\nConnection: keep-alive\r\n\r\n";
+
+// 浏览器常见的请求头
+static const char browser_request[] =
+    "GET /style.css HTTP/1.1\r\n"
+    "Host: bench.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Referer: https://bench.example.com/index.html\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Pragma: no-cache\r\n"
+    "\r\n";
+
+// 只解析请求行和头部
+static void BM_ParseHeaders(benchmark::State &state, const char *request) {
+    Harness h;
+    Httpconn &c = h.conn(h.open());
+    int len = strlen(request);
+    for(auto _ : state) {
+        Harness::reset(c);
+        Harness::load(c, request, len);
+        benchmark::DoNotOptimize(Harness::parse_headers(c));
+    }
+    state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK_CAPTURE(BM_ParseHeaders, simple, simple_request);
+BENCHMARK_CAPTURE(BM_ParseHeaders, browser, browser_request);
+
+// 解析并执行do_request(stat、open、mmap)
+static void BM_ProcessRead(benchmark::State &state) {
+    Harness h;
+    Httpconn &c = h.conn(h.open());
+    int len = strlen(simple_request);
+    for(auto _ : state) {
+        Harness::reset(c);
+        Harness::load(c, simple_request, len);
+        benchmark::DoNotOptimize(Harness::process_read(c));
+    }
+}
+BENCHMARK(BM_ProcessRead);
+
+// 生成文件响应的状态行和头部
+static void BM_ProcessWrite(benchmark::State &state) {
+    Harness h;
+    Httpconn &c = h.conn(h.open());
+    Harness::reset(c);
+    Harness::load(c, simple_request, strlen(simple_request));
+    Harness::process_read(c);
+    for(auto _ : state) {
+        Harness::rewind_write(c);
+        benchmark::DoNotOptimize(Harness::process_write(c, Httpconn::FILE_REQUEST));
+    }
+    Harness::reset(c);
+}
+BENCHMARK(BM_ProcessWrite);
+
+// 只生成响应头：状态行、Content-Length、Content-Type、Date、Connection和空行，新连接的m_linger为false
+static void BM_HeaderFragments(benchmark::State &state) {
+    Harness h;
+    Httpconn &c = h.conn(h.open());
+    for(auto _ : state) {
+        Harness::rewind_write(c);
+        benchmark::DoNotOptimize(Harness::build_head(c, 200, 15, "/index.html"));
+    }
+    state.counters["bytes"] = Harness::write_idx(c);
+}
+BENCHMARK(BM_HeaderFragments);
+
+// 对照：原来的add_response，每一行都经过vsnprintf
+static bool add_response(char *buf, int *idx, const char *format, ...) {
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(buf + *idx, Httpconn::WRITE_BUFFER_SIZE - 1 - *idx, format, arg_list);
+    va_end(arg_list);
+    if(len >= Httpconn::WRITE_BUFFER_SIZE - 1 - *idx) {
+        return false;
+    }
+    *idx += len;
+    return true;
+}
+
+// 生成和上面字节相同的响应头；cached_date为false时Date每次都用strftime格式化
+static int build_formatted(char *buf, bool cached_date) {
+    int idx = 0;
+    add_response(buf, &idx, "%s %d %s\r\n", "HTTP/1.1", 200, "OK");
+    add_response(buf, &idx, "Content-Length: %ld\r\n", 15L);
+    add_response(buf, &idx, "Content-Type: %s\r\n", "text/html");
+    if(cached_date) {
+        const Fragment &date = date_header();
+        add_response(buf, &idx, "%.*s", date.len, date.data);
+    }
+    else {
+        char date[64];
+        time_t now = time(NULL);
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        add_response(buf, &idx, "Date: %s\r\n", date);
+    }
+    add_response(buf, &idx, "Connection: %s\r\n", "close");
+    add_response(buf, &idx, "%s", "\r\n");
+    return idx;
+}
+
+static void BM_HeaderFormatted(benchmark::State &state) {
+    char buf[Httpconn::WRITE_BUFFER_SIZE];
+    int len = 0;
+    for(auto _ : state) {
+        len = build_formatted(buf, state.range(0));
+        benchmark::DoNotOptimize(buf);
+    }
+    state.counters["bytes"] = len;
+}
+BENCHMARK(BM_HeaderFormatted)->ArgName("cached_date")->Arg(0)->Arg(1);
+
+// 按扩展名查Content-Type
+static void BM_ContentType(benchmark::State &state) {
+    static const char *paths[] = { "/index.html", "/style.css", "/app.js", "/logo.PNG", "/README", "/a.tar.gz" };
+    size_t i = 0;
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(content_type(paths[i++ % 6]));
+    }
+}
+BENCHMARK(BM_ContentType);
+
+// Date缓存命中时只有一次time()
+static void BM_DateHeader(benchmark::State &state) {
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(date_header());
+    }
+}
+BENCHMARK(BM_DateHeader);
+
+// 发送路径：生成错误响应，writev到socketpair，客户端读走
+static void BM_WriteError(benchmark::State &state) {
+    Harness h;
+    int id = h.open();
+    Httpconn &c = h.conn(id);
+    for(auto _ : state) {
+        Harness::reset(c);
+        Harness::process_write(c, Httpconn::NO_RESOURCE);
+        Harness::write(c);
+        h.pump();
+        benchmark::DoNotOptimize(h.take(id));
+    }
+}
+BENCHMARK(BM_WriteError);
+
+// 完整的一次请求：客户端发送，服务端读取、解析、生成响应、发送，客户端收完
+static void BM_RoundTrip(benchmark::State &state) {
+    static const char *urls[] = { "/index.html", "/big.bin" };
+    Harness h;
+    int id = h.open();
+    std::string req = std::string("GET ") + urls[state.range(0)] + " HTTP/1.1\r\nHost: bench\r\n\r\n";
+    size_t bytes = 0;
+    for(auto _ : state) {
+        h.send(id, req);
+        h.pump();
+        bytes += h.take(id).size();
+    }
+    state.SetBytesProcessed(bytes);
+}
+BENCHMARK(BM_RoundTrip)->Arg(0)->Arg(1);
+
+// 流水线中的多个请求一次发送
+static void BM_Pipelined(benchmark::State &state) {
+    Harness h;
+    int id = h.open();
+    std::string req;
+    for(int i=0; i<state.range(0); i++) {
+        req += "GET /index.html HTTP/1.1\r\nHost: bench\r\n\r\n";
+    }
+    for(auto _ : state) {
+        h.send(id, req);
+        h.pump();
+        benchmark::DoNotOptimize(h.take(id));
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Pipelined)->Arg(4)->Arg(16);
+
+// 经反向代理转发到本地后端，后端连接应当一直复用
+static void BM_Proxy(benchmark::State &state) {
+    static StubUpstream up(StubUpstream::response(std::string(128, 'p')));
+    static bool routed = up.route("/bench");
+    if(!routed) {
+        state.SkipWithError("cannot add proxy route");
+        return;
+    }
+    Harness h;
+    int id = h.open();
+    std::string req = "GET /bench/item HTTP/1.1\r\nHost: bench\r\n\r\n";
+    for(auto _ : state) {
+        h.send(id, req);
+        h.pump();
+        benchmark::DoNotOptimize(h.take(id));
+    }
+    // 后端累计接受的连接数，复用正常时一直是1
+    state.counters["upstream_conns"] = up.accepted();
+}
+BENCHMARK(BM_Proxy);
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    if(benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    __gnu_cxx::stdio_filebuf<char> console(dup(STDOUT_FILENO), std::ios::out);
+    std::ostream out(&console);
+    if(!freopen("/dev/null", "w", stdout)) {
+        return 1;
+    }
+    Harness::set_quiet(false);
+
+    benchmark::ConsoleReporter reporter;
+    reporter.SetOutputStream(&out);
+    reporter.SetErrorStream(&out);
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Httpconn请求解析的模糊测试
+// 用clang编译时加-DLIBFUZZER -fsanitize=fuzzer交给libFuzzer驱动；
+// 否则用下面的main：读入语料，做确定的随机变异，配合-fsanitize=address,undefined运行
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <dirent.h>
+
+#include "harness.h"
+
+// 每个响应都必须是完整的HTTP/1.1响应
+static void check(const std::string &data) {
+    std::string rest;
+    std::vector<Harness::Response> responses = Harness::split(data, &rest);
+    if(!rest.empty()) {
+        fprintf(stderr, "incomplete response: %zu bytes left\n", rest.size());
+        abort();
+    }
+    for(size_t i=0; i<responses.size(); i++) {
+        if(responses[i].head.compare(0, 9, "HTTP/1.1 ")) {
+            fprintf(stderr, "bad status line: %.40s\n", responses[i].head.c_str());
+            abort();
+        }
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static Harness h;
+    if(size == 0) {
+        return 0;
+    }
+    // 第一个字节决定每次发送的长度，其余是请求
+    size_t piece = data[0] % 64 + 1;
+    data++;
+    size--;
+
+    int id = h.open();
+    if(id == -1) {
+        return 0;
+    }
+    for(size_t off=0; off<size && !h.closed(id); off+=piece) {
+        h.send(id, (const char *)data + off, off + piece > size ? size - off : piece);
+        h.pump();
+    }
+    check(h.take(id));
+    h.close(id);
+    return 0;
+}
+
+#ifndef LIBFUZZER
+static std::vector<std::string> load_corpus(const char *dir) {
+    std::vector<std::string> seeds;
+    DIR *d = opendir(dir);
+    if(!d) {
+        perror(dir);
+        return seeds;
+    }
+    dirent *entry;
+    while((entry = readdir(d)) != NULL) {
+        if(entry->d_name[0] == '.') {
+            continue;
+        }
+        std::string path = std::string(dir) + "/" + entry->d_name;
+        FILE *f = fopen(path.c_str(), "rb");
+        if(!f) {
+            continue;
+        }
+        std::string seed;
+        char buf[4096];
+        size_t n;
+        while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            seed.append(buf, n);
+        }
+        fclose(f);
+        seeds.push_back(seed);
+    }
+    closedir(d);
+    return seeds;
+}
+
+// 翻转、插入、删除字节，或者拼接另一个种子的片段
+static std::string mutate(const std::vector<std::string> &seeds, unsigned *rnd) {
+    std::string s = seeds[rand_r(rnd) % seeds.size()];
+    int rounds = rand_r(rnd) % 8 + 1;
+    for(int i=0; i<rounds; i++) {
+        size_t pos = s.empty() ? 0 : rand_r(rnd) % s.size();
+        switch(rand_r(rnd) % 4) {
+            case 0: {
+                if(!s.empty()) {
+                    s[pos] ^= 1 << (rand_r(rnd) % 8);
+                }
+                break;
+            }
+            case 1: {
+                static const char special[] = "\r\n :/.%\0";
+                s.insert(pos, 1, special[rand_r(rnd) % (sizeof(special) - 1)]);
+                break;
+            }
+            case 2: {
+                if(!s.empty()) {
+                    s.erase(pos, rand_r(rnd) % 16 + 1);
+                }
+                break;
+            }
+            case 3: {
+                const std::string &other = seeds[rand_r(rnd) % seeds.size()];
+                if(!other.empty()) {
+                    size_t from = rand_r(rnd) % other.size();
+                    s.insert(pos, other, from, rand_r(rnd) % 256);
+                }
+                break;
+            }
+        }
+    }
+    s.insert(s.begin(), (char)rand_r(rnd));
+    return s;
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        printf("usage: %s corpus_dir [runs] [seed]\n", argv[0]);
+        return 1;
+    }
+    std::vector<std::string> seeds = load_corpus(argv[1]);
+    if(seeds.empty()) {
+        printf("empty corpus: %s\n", argv[1]);
+        return 1;
+    }
+    int runs = argc > 2 ? atoi(argv[2]) : 10000;
+    unsigned rnd = argc > 3 ? atoi(argv[3]) : 1;
+
+    // 种子本身按几种不同的分片方式各跑一遍
+    for(size_t i=0; i<seeds.size(); i++) {
+        for(int piece=0; piece<64; piece+=21) {
+            std::string input = (char)piece + seeds[i];
+            LLVMFuzzerTestOneInput((const uint8_t *)input.data(), input.size());
+        }
+    }
+    for(int i=0; i<runs; i++) {
+        std::string input = mutate(seeds, &rnd);
+        LLVMFuzzerTestOneInput((const uint8_t *)input.data(), input.size());
+    }
+    fprintf(stderr, "%zu seeds, %d mutations: ok\n", seeds.size(), runs);
+    return 0;
+}
+#endif
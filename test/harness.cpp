@@ -0,0 +1,381 @@
+#include "harness.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ftw.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+extern const char *doc_root;
+extern void modifyfd(int epollfd, int fd, int event);
+
+bool Harness::m_quiet = true;
+
+// pump期间把stdout指向/dev/null，Httpconn的调试输出不会混进测试结果
+class Quiet {
+public:
+    explicit Quiet(bool quiet): m_saved(-1) {
+        if(quiet) {
+            fflush(stdout);
+            m_saved = dup(STDOUT_FILENO);
+            int fd = ::open("/dev/null", O_WRONLY);
+            dup2(fd, STDOUT_FILENO);
+            ::close(fd);
+        }
+    }
+    ~Quiet() {
+        if(m_saved != -1) {
+            fflush(stdout);
+            dup2(m_saved, STDOUT_FILENO);
+            ::close(m_saved);
+        }
+    }
+
+private:
+    int m_saved;
+};
+
+static char root_dir[] = "/tmp/httpconn_test.XXXXXX";
+
+static int remove_entry(const char *path, const struct stat *, int, struct FTW *) {
+    return remove(path);
+}
+
+static void remove_root() {
+    nftw(root_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void put_file(const char *name, const std::string &data, mode_t mode = 0644) {
+    std::string path = std::string(root_dir) + name;
+    FILE *f = fopen(path.c_str(), "wb");
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+    chmod(path.c_str(), mode);
+}
+
+const char *Harness::root() {
+    static bool created = false;
+    if(!created) {
+        if(!mkdtemp(root_dir)) {
+            perror("mkdtemp");
+            exit(-1);
+        }
+        chmod(root_dir, 0755);
+        created = true;
+        atexit(remove_root);
+
+        put_file("/index.html", "<h1>hello</h1>\n");
+        put_file("/empty.txt", "");
+        put_file("/style.css", "body { margin: 0; }\n");
+        put_file("/secret.txt", "secret\n", 0600);
+        std::string big(1024 * 1024, '\0');
+        for(size_t i=0; i<big.size(); i++) {
+            big[i] = (char)(i * 7 % 251);
+        }
+        put_file("/big.bin", big);
+        mkdir((std::string(root_dir) + "/sub").c_str(), 0755);
+        mkdir((std::string(root_dir) + "/up").c_str(), 0755);
+        doc_root = root_dir;
+    }
+    return root_dir;
+}
+
+Harness::Harness() {
+    root();
+    m_users = new Httpconn[MAX_CONNS];
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    m_completions = new CompletionQueue(MAX_CONNS);
+    m_saved_epollfd = Httpconn::m_epollfd;
+    m_saved_completions = Httpconn::m_completions;
+    Httpconn::m_epollfd = m_epollfd;
+    Httpconn::m_completions = m_completions;
+}
+
+Harness::~Harness() {
+    {
+        Quiet q(m_quiet);
+        for(size_t i=0; i<m_clients.size(); i++) {
+            Client &c = m_clients[i];
+            if(c.server_fd != -1) {
+                m_users[c.server_fd].close_conn();
+                c.server_fd = -1;
+            }
+            if(c.fd != -1) {
+                ::close(c.fd);
+                c.fd = -1;
+            }
+        }
+        // 丢掉SendSched中还指向这些连接的记录
+        int ready[MAX_CONNS];
+        while(SendSched::ready(ready, MAX_CONNS) > 0) {
+        }
+    }
+    Httpconn::m_epollfd = m_saved_epollfd;
+    Httpconn::m_completions = m_saved_completions;
+    delete [] m_users;
+    delete m_completions;
+    ::close(m_epollfd);
+}
+
+int Harness::open() {
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+    if(sv[0] >= MAX_CONNS) {
+        ::close(sv[0]);
+        ::close(sv[1]);
+        return -1;
+    }
+    fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+    sockaddr_storage addr;
+    bzero(&addr, sizeof(addr));
+    addr.ss_family = AF_UNIX;
+    {
+        Quiet q(m_quiet);
+        m_users[sv[0]].init(sv[0], addr, NULL);
+    }
+    Client c = { sv[1], sv[0], std::string() };
+    m_clients.push_back(c);
+    return m_clients.size() - 1;
+}
+
+void Harness::close(int id) {
+    Client &c = m_clients[id];
+    if(c.fd != -1) {
+        ::close(c.fd);
+        c.fd = -1;
+    }
+    pump();
+}
+
+void Harness::send(int id, const char *data, size_t len) {
+    Client &c = m_clients[id];
+    size_t sent = 0;
+    while(sent < len) {
+        ssize_t n = ::send(c.fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if(n == -1) {
+            if(errno != EAGAIN) {
+                return;
+            }
+            // 服务端还没读走，先处理一轮
+            pump();
+            continue;
+        }
+        sent += n;
+    }
+}
+
+std::string Harness::take(int id) {
+    std::string data;
+    data.swap(m_clients[id].received);
+    return data;
+}
+
+bool Harness::closed(int id) const {
+    return m_clients[id].server_fd == -1;
+}
+
+Httpconn &Harness::conn(int id) {
+    return m_users[m_clients[id].server_fd];
+}
+
+std::vector<Harness::Response> Harness::request(int id, const std::string &data) {
+    send(id, data);
+    pump();
+    return split(take(id));
+}
+
+// 和main.cpp中的分发相同，线程池的append改为直接调用process
+void Harness::dispatch(int fd, unsigned events) {
+    Httpconn &c = m_users[fd];
+    if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        c.close_conn();
+    }
+    else if(c.is_websocket()) {
+        if(!c.ws_handle(events)) {
+            c.close_conn();
+        }
+    }
+    else if(c.is_uploading()) {
+        c.process();
+    }
+    else if(events & EPOLLIN) {
+        if(c.read()) {
+            c.process();
+        }
+        else {
+            c.close_conn();
+        }
+    }
+    else if(events & EPOLLOUT) {
+        handle_write(fd);
+    }
+}
+
+void Harness::handle_write(int fd) {
+    Httpconn &c = m_users[fd];
+    if(!c.write()) {
+        c.close_conn();
+    }
+    else if(!c.is_websocket() && c.has_pending()) {
+        c.process();
+    }
+}
+
+bool Harness::drain_completions() {
+    CompletionQueue::Completion done[64];
+    bool busy = false;
+    int n;
+    do {
+        n = m_completions->drain(done, 64);
+        for(int i=0; i<n; i++) {
+            int fd = done[i].fd;
+            switch(done[i].type) {
+                case CompletionQueue::WRITE: {
+                    handle_write(fd);
+                    break;
+                }
+                case CompletionQueue::READ: {
+                    modifyfd(m_epollfd, fd, EPOLLIN);
+                    break;
+                }
+                case CompletionQueue::CLOSE: {
+                    m_users[fd].close_conn();
+                    break;
+                }
+                case CompletionQueue::PUBLISH: {
+                    WebSocket::flush_published();
+                    break;
+                }
+            }
+        }
+        busy |= n > 0;
+    } while(n == 64);
+    return busy;
+}
+
+bool Harness::drain_clients() {
+    static char buf[64 * 1024];
+    bool busy = false;
+    for(size_t i=0; i<m_clients.size(); i++) {
+        Client &c = m_clients[i];
+        if(c.fd == -1 || c.server_fd == -1) {
+            continue;
+        }
+        while(true) {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if(n > 0) {
+                c.received.append(buf, n);
+                busy = true;
+                continue;
+            }
+            // 服务端关闭了连接
+            if(n == 0 || errno != EAGAIN) {
+                c.server_fd = -1;
+                busy = true;
+            }
+            break;
+        }
+    }
+    return busy;
+}
+
+bool Harness::pump(int max_rounds) {
+    Quiet q(m_quiet);
+    for(int round=0; round<max_rounds; round++) {
+        bool busy = drain_completions();
+        epoll_event events[64];
+        int num = epoll_wait(m_epollfd, events, 64, 0);
+        for(int i=0; i<num; i++) {
+            dispatch(events[i].data.fd, events[i].events);
+        }
+        busy |= num > 0;
+        int ready[MAX_CONNS];
+        int ready_num = SendSched::ready(ready, MAX_CONNS);
+        for(int i=0; i<ready_num; i++) {
+            handle_write(ready[i]);
+        }
+        busy |= ready_num > 0;
+        busy |= drain_clients();
+        if(!busy) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string Harness::Response::header(const char *name) const {
+    size_t name_len = strlen(name);
+    size_t pos = head.find("\r\n");
+    while(pos != std::string::npos && pos + 2 < head.size()) {
+        const char *line = head.c_str() + pos + 2;
+        if(!strncasecmp(line, name, name_len) && line[name_len] == ':') {
+            size_t begin = pos + 2 + name_len + 1;
+            while(begin < head.size() && head[begin] == ' ') {
+                begin++;
+            }
+            return head.substr(begin, head.find("\r\n", begin) - begin);
+        }
+        pos = head.find("\r\n", pos + 2);
+    }
+    return std::string();
+}
+
+std::vector<Harness::Response> Harness::split(const std::string &data, std::string *rest) {
+    std::vector<Response> out;
+    size_t pos = 0;
+    while(pos < data.size()) {
+        size_t end = data.find("\r\n\r\n", pos);
+        if(end == std::string::npos) {
+            break;
+        }
+        Response r;
+        r.head = data.substr(pos, end + 4 - pos);
+        r.status = r.head.size() > 12 && !r.head.compare(0, 5, "HTTP/") ? atoi(r.head.c_str() + 9) : 0;
+        // 101、100这样没有Content-Length的响应没有响应体
+        std::string len = r.header("Content-Length");
+        size_t body_len = len.empty() ? 0 : strtoul(len.c_str(), NULL, 10);
+        if(end + 4 + body_len > data.size()) {
+            break;
+        }
+        r.body = data.substr(end + 4, body_len);
+        out.push_back(r);
+        pos = end + 4 + body_len;
+    }
+    if(rest) {
+        *rest = data.substr(pos);
+    }
+    return out;
+}
+
+void Harness::reset(Httpconn &c) {
+    c.unmap();
+    c.init();
+    c.m_read_idx = 0;
+}
+
+void Harness::load(Httpconn &c, const char *data, int len) {
+    memcpy(c.m_read_buf, data, len);
+    c.m_read_idx = len;
+}
+
+// process_read去掉do_request的部分
+Httpconn::HTTP_CODE Harness::parse_headers(Httpconn &c) {
+    Httpconn::LINE_STATUS status;
+    while((status = c.parse_line()) == Httpconn::LINE_OK) {
+        char *text = c.m_read_buf + c.m_start_line;
+        c.m_start_line = c.m_checked_index;
+        Httpconn::HTTP_CODE ret = c.m_check_state == Httpconn::CHECK_STATE_REQUESTLINE ?
+            c.parse_request_line(text) : c.parse_headers(text);
+        if(ret != Httpconn::NO_REQUEST) {
+            return ret;
+        }
+    }
+    return status == Httpconn::LINE_BAD ? Httpconn::BAD_REQUEST : Httpconn::NO_REQUEST;
+}
@@ -0,0 +1,85 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <string>
+#include <vector>
+
+#include "httpconn.h"
+
+// 进程内驱动Httpconn的测试夹具
+// 每个连接是一对socketpair，服务端一侧交给Httpconn，客户端一侧由测试读写。
+// 构造时安装自己的CompletionQueue和一个只由夹具自己等待的epoll，pump()按main.cpp主循环的
+// 方式分发事件，只是把交给线程池的process()改为在当前线程中直接执行，结果是确定的
+class Harness {
+public:
+    // 一个完整的响应
+    struct Response {
+        int status;
+        std::string head;               // 状态行和头部，包括最后的空行
+        std::string body;
+        std::string header(const char *name) const;     // 找不到返回空串
+    };
+
+    Harness();
+    ~Harness();
+
+    int open();                                         // 新连接，返回连接编号
+    void close(int id);                                 // 客户端关闭
+    void send(int id, const char *data, size_t len);
+    void send(int id, const std::string &data) { send(id, data.data(), data.size()); }
+    bool pump(int max_rounds = 100000);                 // 处理所有事件直到空闲，超过轮数返回false
+    std::string take(int id);                           // 取出已经收到的数据
+    bool closed(int id) const;                          // 服务端已经关闭连接
+    Httpconn &conn(int id);
+
+    // 一次发完请求并等待，返回这期间收到的所有响应
+    std::vector<Response> request(int id, const std::string &data);
+    // 把字节流切分为响应，按Content-Length划分；剩下的不完整数据放回rest
+    static std::vector<Response> split(const std::string &data, std::string *rest = NULL);
+
+    // 测试用的网站根目录，第一次调用时在/tmp下创建，进程退出时删除
+    static const char *root();
+    // 关闭调试输出，pump期间Httpconn的printf重定向到/dev/null
+    static void set_quiet(bool quiet) { m_quiet = quiet; }
+
+    // 直接调用Httpconn内部的解析和响应生成，基准测试用
+    static void reset(Httpconn &c);                     // 清空请求状态，读缓冲区不保留
+    static void load(Httpconn &c, const char *data, int len);   // 放入读缓冲区
+    static Httpconn::HTTP_CODE parse_headers(Httpconn &c);      // 只解析请求行和头部，不执行do_request
+    static Httpconn::HTTP_CODE process_read(Httpconn &c) { return c.process_read(); }
+    static bool process_write(Httpconn &c, Httpconn::HTTP_CODE code) { return c.process_write(code); }
+    static bool write(Httpconn &c) { return c.write(); }
+    static bool build_head(Httpconn &c, int status, long content_length, const char *path) {
+        return c.add_status_line(status) && c.add_headers(content_length, path);
+    }
+    static void rewind_write(Httpconn &c) { c.m_write_idx = 0; }   // 丢掉已生成的响应头，保留请求
+    static int write_idx(const Httpconn &c) { return c.m_write_idx; }
+    static const char *write_buf(const Httpconn &c) { return c.m_write_buf; }
+
+public:
+    static const int MAX_CONNS = 1024;
+
+private:
+    struct Client {
+        int fd;                         // 客户端一侧
+        int server_fd;                  // Httpconn一侧，关闭后为-1
+        std::string received;
+    };
+
+    void dispatch(int fd, unsigned events);
+    void handle_write(int fd);
+    bool drain_completions();
+    bool drain_clients();
+
+private:
+    Httpconn *m_users;                  // 和main.cpp一样按fd索引
+    std::vector<Client> m_clients;
+    int m_epollfd;
+    CompletionQueue *m_completions;
+    int m_saved_epollfd;
+    CompletionQueue *m_saved_completions;
+
+    static bool m_quiet;
+};
+
+#endif
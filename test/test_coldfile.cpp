@@ -0,0 +1,53 @@
+// 冷文件预热测试
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "harness.h"
+
+typedef std::vector<Harness::Response> Responses;
+
+// 匿名映射中没有访问过的页不在内存中
+TEST(ColdFile, ResidentBytesStopsAtFirstMissingPage) {
+    long page = sysconf(_SC_PAGESIZE);
+    char *addr = (char *)mmap(NULL, 4 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(addr, MAP_FAILED);
+    addr[0] = 1;
+    addr[page] = 1;
+    EXPECT_EQ(ColdFile::resident_bytes(addr, 0, 4 * page), 2 * page);
+    EXPECT_EQ(ColdFile::resident_bytes(addr, 100, 4 * page - 100), 2 * page - 100);
+    EXPECT_EQ(ColdFile::resident_bytes(addr, 0, page / 2), page / 2);
+    EXPECT_EQ(ColdFile::resident_bytes(addr, 2 * page, 2 * page), 0);
+
+    ColdFile::warm(addr, 2 * page + 10, page);
+    EXPECT_EQ(ColdFile::resident_bytes(addr, 0, 4 * page), 4 * page);
+    munmap(addr, 4 * page);
+}
+
+// 超过WARM_BYTES的部分在发送时才发现不在页缓存中，由工作线程预热后继续发送
+TEST(ColdFile, ServesEvictedTail) {
+    std::string path = std::string(Harness::root()) + "/cold.bin";
+    std::string data(ColdFile::WARM_BYTES + 3 * 1024 * 1024 + 5, '\0');
+    for(size_t i=0; i<data.size(); i++) {
+        data[i] = (char)(i * 31 % 253);
+    }
+    FILE *f = fopen(path.c_str(), "wb");
+    ASSERT_TRUE(f);
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+    int fd = open(path.c_str(), O_RDONLY);
+    ASSERT_NE(fd, -1);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, "GET /cold.bin HTTP/1.1\r\nHost: test\r\n\r\n");
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+    EXPECT_TRUE(r[0].body == data);
+    EXPECT_FALSE(h.closed(c));
+    unlink(path.c_str());
+}
@@ -0,0 +1,387 @@
+// Httpconn的请求解析和响应测试，连接都在进程内通过socketpair驱动
+#include <dirent.h>
+#include <gtest/gtest.h>
+
+#include "harness.h"
+#include "httpheader.h"
+
+typedef std::vector<Harness::Response> Responses;
+
+static std::string get(const char *url, const char *extra = "") {
+    return std::string("GET ") + url + " HTTP/1.1\r\nHost: test\r\n" + extra + "\r\n";
+}
+
+// ---------- 正常请求 ----------
+
+TEST(Request, ServesFile) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/index.html"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+    EXPECT_EQ(r[0].body, "<h1>hello</h1>\n");
+    EXPECT_EQ(r[0].header("Content-Type"), "text/html");
+    EXPECT_EQ(r[0].header("Connection"), "keep-alive");
+    EXPECT_FALSE(r[0].header("Date").empty());
+    EXPECT_FALSE(h.closed(c));
+}
+
+TEST(Request, ContentTypeFromExtension) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/style.css"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].header("Content-Type"), "text/css");
+}
+
+TEST(Request, EmptyFile) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/empty.txt"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+    EXPECT_EQ(r[0].header("Content-Length"), "0");
+}
+
+TEST(Request, LargeFile) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/big.bin"));
+    ASSERT_EQ(r.size(), 1u);
+    ASSERT_EQ(r[0].body.size(), 1024u * 1024);
+    for(size_t i=0; i<r[0].body.size(); i += 4093) {
+        ASSERT_EQ(r[0].body[i], (char)(i * 7 % 251)) << "offset " << i;
+    }
+}
+
+TEST(Request, AbsoluteUrl) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("http://test:80/index.html"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+}
+
+TEST(Request, Http10Closes) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, "GET /index.html HTTP/1.0\r\n\r\n");
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].header("Connection"), "close");
+    EXPECT_TRUE(h.closed(c));
+}
+
+TEST(Request, ConnectionClose) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/index.html", "Connection: close\r\n"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_TRUE(h.closed(c));
+}
+
+TEST(Request, KeepAliveSequential) {
+    Harness h;
+    int c = h.open();
+    for(int i=0; i<20; i++) {
+        Responses r = h.request(c, get("/index.html"));
+        ASSERT_EQ(r.size(), 1u) << "request " << i;
+        EXPECT_EQ(r[0].status, 200);
+    }
+    EXPECT_FALSE(h.closed(c));
+}
+
+TEST(Request, ClientCloseReleasesConnection) {
+    Harness h;
+    int c = h.open();
+    int users = Httpconn::m_user_count;
+    h.close(c);
+    EXPECT_EQ(Httpconn::m_user_count, users - 1);
+}
+
+// ---------- 响应头 ----------
+
+// 片段拼出的响应头和逐行格式化的结果相同
+TEST(Header, FragmentsMatchFormatted) {
+    Harness h;
+    Httpconn &c = h.conn(h.open());
+    Harness::rewind_write(c);
+    ASSERT_TRUE(Harness::build_head(c, 404, 1234567, "/a/b.CSS"));
+    const Fragment &date = date_header();
+    std::string expected = "HTTP/1.1 404 Not Found\r\nContent-Length: 1234567\r\nContent-Type: text/css\r\n" +
+        std::string(date.data, date.len) + "Connection: close\r\n\r\n";
+    EXPECT_EQ(std::string(Harness::write_buf(c), Harness::write_idx(c)), expected);
+}
+
+TEST(Header, ContentType) {
+    EXPECT_STREQ(content_type("/x.html").data, "Content-Type: text/html\r\n");
+    EXPECT_STREQ(content_type("/x.JS").data, "Content-Type: application/javascript\r\n");
+    EXPECT_STREQ(content_type("/dir.d/file").data, content_type("/file").data);
+    EXPECT_STREQ(content_type("/x.toolongext").data, content_type("/file").data);
+}
+
+TEST(Header, DateFormat) {
+    const Fragment &date = date_header();
+    ASSERT_EQ(date.len, (int)strlen("Date: Mon, 19 Oct 2026 16:57:25 GMT\r\n"));
+    EXPECT_EQ(std::string(date.data, 6), "Date: ");
+    EXPECT_EQ(std::string(date.data + date.len - 6, 6), " GMT\r\n");
+}
+
+// ---------- 分片 ----------
+
+TEST(Fragmented, ByteByByte) {
+    Harness h;
+    int c = h.open();
+    std::string req = get("/index.html", "User-Agent: harness\r\n");
+    for(size_t i=0; i<req.size(); i++) {
+        h.send(c, req.data() + i, 1);
+        ASSERT_TRUE(h.pump());
+        if(i + 1 < req.size()) {
+            ASSERT_TRUE(h.take(c).empty()) << "response before byte " << i;
+        }
+    }
+    Responses r = Harness::split(h.take(c));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+}
+
+TEST(Fragmented, SplitBetweenCrLf) {
+    Harness h;
+    int c = h.open();
+    h.send(c, std::string("GET /index.html HTTP/1.1\r"));
+    h.pump();
+    h.send(c, std::string("\nHost: test\r"));
+    h.pump();
+    h.send(c, std::string("\n\r"));
+    h.pump();
+    EXPECT_TRUE(h.take(c).empty());
+    Responses r = h.request(c, "\n");
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+}
+
+// 请求体分几次到达，后面流水线中的请求不能被吞掉
+TEST(Fragmented, BodyThenPipelined) {
+    Harness h;
+    int c = h.open();
+    h.send(c, std::string("POST /index.html HTTP/1.1\r\nContent-Length: 5\r\n\r\nhe"));
+    h.pump();
+    h.send(c, std::string("l"));
+    h.pump();
+    EXPECT_TRUE(h.take(c).empty());
+    Responses r = h.request(c, "lo" + get("/index.html"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 400);
+}
+
+// ---------- 流水线 ----------
+
+TEST(Pipelined, ResponsesInOrder) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/index.html") + get("/empty.txt") + get("/missing") + get("/style.css"));
+    ASSERT_EQ(r.size(), 4u);
+    EXPECT_EQ(r[0].status, 200);
+    EXPECT_EQ(r[0].body, "<h1>hello</h1>\n");
+    EXPECT_EQ(r[1].status, 200);
+    EXPECT_EQ(r[1].body, "");
+    EXPECT_EQ(r[2].status, 404);
+    EXPECT_EQ(r[3].header("Content-Type"), "text/css");
+    EXPECT_FALSE(h.closed(c));
+}
+
+TEST(Pipelined, PartialLastRequest) {
+    Harness h;
+    int c = h.open();
+    std::string second = get("/style.css");
+    Responses r = h.request(c, get("/index.html") + second.substr(0, 10));
+    ASSERT_EQ(r.size(), 1u);
+    r = h.request(c, second.substr(10));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].header("Content-Type"), "text/css");
+}
+
+// 缓冲区中的后续请求不经过read()，同样要统计各阶段耗时
+TEST(Pipelined, RequestsAreTraced) {
+    Trace::init(0);
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/index.html") + get("/empty.txt") + get("/style.css"));
+    Trace::m_enabled = false;
+    ASSERT_EQ(r.size(), 3u);
+    EXPECT_EQ(Trace::count(Trace::P_READ), 3u);
+    EXPECT_EQ(Trace::count(Trace::P_QUEUE), 3u);
+    EXPECT_EQ(Trace::count(Trace::P_TOTAL), 3u);
+}
+
+TEST(Pipelined, StopsAfterClose) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/index.html", "Connection: close\r\n") + get("/style.css"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_TRUE(h.closed(c));
+}
+
+TEST(Pipelined, ErrorStopsPipeline) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, std::string("BREW /pot HTTP/1.1\r\n\r\n") + get("/index.html"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 400);
+    EXPECT_TRUE(h.closed(c));
+}
+
+// ---------- 超长 ----------
+
+TEST(Oversized, RequestLine) {
+    Harness h;
+    int c = h.open();
+    std::string url = "/" + std::string(Httpconn::READ_BUFFER_SIZE, 'a');
+    Responses r = h.request(c, get(url.c_str()));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 400);
+    EXPECT_TRUE(h.closed(c));
+}
+
+TEST(Oversized, HeaderBlock) {
+    Harness h;
+    int c = h.open();
+    std::string extra;
+    for(int i=0; i<100; i++) {
+        extra += "X-Padding-" + std::to_string(i) + ": aaaaaaaaaaaaaaaaaaaa\r\n";
+    }
+    Responses r = h.request(c, get("/index.html", extra.c_str()));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 400);
+    EXPECT_TRUE(h.closed(c));
+}
+
+// 拼上网站根目录后放不进m_real_file的URL直接拒绝，不截断
+TEST(Oversized, FilePath) {
+    Harness h;
+    int c = h.open();
+    std::string url = "/" + std::string(Httpconn::FILENAME_LEN, 'a');
+    Responses r = h.request(c, get(url.c_str()));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 414);
+    EXPECT_FALSE(h.closed(c));
+}
+
+TEST(Oversized, ContentLength) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, "POST /index.html HTTP/1.1\r\nContent-Length: 100000\r\n\r\n");
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 400);
+}
+
+TEST(Oversized, ManyShortHeaders) {
+    Harness h;
+    int c = h.open();
+    // 很多行但总长度放得进读缓冲区
+    std::string extra;
+    for(int i=0; i<200; i++) {
+        extra += "A: b\r\n";
+    }
+    Responses r = h.request(c, get("/index.html", extra.c_str()));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+}
+
+// ---------- 格式错误 ----------
+
+struct Malformed {
+    const char *name;
+    const char *request;
+    int status;
+};
+
+static const Malformed malformed[] = {
+    { "unknown_method",      "BREW /index.html HTTP/1.1\r\n\r\n", 400 },
+    { "missing_version",     "GET /index.html\r\n\r\n", 400 },
+    { "missing_url",         "GET\r\n\r\n", 400 },
+    { "bad_version",         "GET /index.html HTTP/2.0\r\n\r\n", 400 },
+    { "relative_url",        "GET index.html HTTP/1.1\r\n\r\n", 400 },
+    { "bare_lf",             "GET /index.html HTTP/1.1\n\n", 400 },
+    { "stray_cr",            "GET /index.html HTTP/1.1\rX\r\n\r\n", 400 },
+    { "negative_length",     "POST /index.html HTTP/1.1\r\nContent-Length: -5\r\n\r\n", 400 },
+    { "post_to_file",        "POST /index.html HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc", 400 },
+    { "directory",           "GET /sub HTTP/1.1\r\n\r\n", 400 },
+    { "dot_dot",             "GET /../etc/passwd HTTP/1.1\r\n\r\n", 403 },
+    { "dot_dot_end",         "GET /sub/.. HTTP/1.1\r\n\r\n", 403 },
+    { "not_readable",        "GET /secret.txt HTTP/1.1\r\n\r\n", 403 },
+    { "missing_file",        "GET /nothing.html HTTP/1.1\r\n\r\n", 404 },
+};
+
+class MalformedTest : public testing::TestWithParam<Malformed> {
+};
+
+TEST_P(MalformedTest, Status) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, GetParam().request);
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, GetParam().status);
+    EXPECT_EQ(r[0].header("Content-Length"), std::to_string(r[0].body.size()));
+}
+
+INSTANTIATE_TEST_SUITE_P(Request, MalformedTest, testing::ValuesIn(malformed),
+    [](const testing::TestParamInfo<Malformed> &info) { return std::string(info.param.name); });
+
+// ---------- 语料 ----------
+
+// test/corpus下的每个文件作为一个连接上收到的全部数据，按不同的大小分片发送，
+// 要求服务端不崩溃，发出的都是完整的HTTP响应，分片方式不影响结果
+TEST(Corpus, FragmentationDoesNotChangeResult) {
+    DIR *dir = opendir(CORPUS_DIR);
+    ASSERT_TRUE(dir != NULL) << CORPUS_DIR;
+    int files = 0;
+    while(dirent *entry = readdir(dir)) {
+        if(entry->d_name[0] == '.') {
+            continue;
+        }
+        std::string path = std::string(CORPUS_DIR) + "/" + entry->d_name;
+        FILE *f = fopen(path.c_str(), "rb");
+        ASSERT_TRUE(f != NULL) << path;
+        std::string data;
+        char buf[4096];
+        size_t n;
+        while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            data.append(buf, n);
+        }
+        fclose(f);
+        files++;
+
+        std::string expected;
+        static const size_t pieces[] = { 0, 1, 2, 7, 64 };
+        for(size_t p=0; p<sizeof(pieces)/sizeof(pieces[0]); p++) {
+            Harness h;
+            int c = h.open();
+            size_t step = pieces[p] ? pieces[p] : data.size();
+            for(size_t off=0; off<data.size() && !h.closed(c); off += step) {
+                h.send(c, data.data() + off, std::min(step, data.size() - off));
+                ASSERT_TRUE(h.pump()) << path;
+            }
+            std::string rest;
+            std::string received = h.take(c);
+            Responses r = Harness::split(received, &rest);
+            EXPECT_TRUE(rest.empty()) << path << ": incomplete response";
+            for(size_t i=0; i<r.size(); i++) {
+                EXPECT_EQ(r[i].head.compare(0, 9, "HTTP/1.1 "), 0) << path;
+                EXPECT_GE(r[i].status, 100) << path;
+            }
+            // Date头每秒变化，比较时去掉
+            std::string normalized;
+            for(size_t i=0; i<r.size(); i++) {
+                normalized += std::to_string(r[i].status) + ":" + r[i].body + "\n";
+            }
+            if(p == 0) {
+                expected = normalized;
+            }
+            else {
+                EXPECT_EQ(normalized, expected) << path << " split every " << step << " bytes";
+            }
+        }
+    }
+    closedir(dir);
+    EXPECT_GT(files, 0);
+}
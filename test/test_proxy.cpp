@@ -0,0 +1,251 @@
+// 反向代理测试，后端是同一进程中的StubUpstream
+#include <gtest/gtest.h>
+
+#include "harness.h"
+#include "upstream.h"
+
+typedef std::vector<Harness::Response> Responses;
+
+static std::string get(const char *url) {
+    return std::string("GET ") + url + " HTTP/1.1\r\nHost: test\r\n\r\n";
+}
+
+TEST(Proxy, ForwardsResponse) {
+    StubUpstream up(StubUpstream::response("from upstream\n", "X-Upstream: stub\r\nKeep-Alive: timeout=5\r\n"));
+    ASSERT_TRUE(up.route("/fwd"));
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/fwd/x"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+    EXPECT_EQ(r[0].body, "from upstream\n");
+    EXPECT_EQ(r[0].header("X-Upstream"), "stub");
+    // 逐跳字段由本服务器重新生成
+    EXPECT_EQ(r[0].header("Keep-Alive"), "");
+    EXPECT_EQ(r[0].header("Connection"), "keep-alive");
+    EXPECT_FALSE(h.closed(c));
+}
+
+// 端到端的头部原样转发，逐跳的头部只在客户端这一段有效
+TEST(Proxy, ForwardsEndToEndHeaders) {
+    StubUpstream up(StubUpstream::response("ok\n"));
+    ASSERT_TRUE(up.route("/hdr"));
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, "POST /hdr/form HTTP/1.1\r\nHost: test\r\nCookie: a=1\r\n"
+        "Content-Type: text/plain\r\nConnection: keep-alive, X-Hop\r\nX-Hop: 1\r\nKeep-Alive: 5\r\n"
+        "X-Forwarded-For: 10.0.0.1\r\nContent-Length: 4\r\n\r\nbody");
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+    std::string req = up.last_request();
+    EXPECT_EQ(req.find("POST /hdr/form HTTP/1.1\r\n"), 0u) << req;
+    EXPECT_NE(req.find("\r\nHost: test\r\n"), std::string::npos) << req;
+    EXPECT_NE(req.find("\r\nCookie: a=1\r\n"), std::string::npos) << req;
+    EXPECT_NE(req.find("\r\nContent-Type: text/plain\r\n"), std::string::npos) << req;
+    EXPECT_NE(req.find("\r\nX-Forwarded-For: 10.0.0.1, unix\r\n"), std::string::npos) << req;
+    EXPECT_NE(req.find("\r\nConnection: keep-alive\r\n"), std::string::npos) << req;
+    EXPECT_NE(req.find("\r\nContent-Length: 4\r\n\r\nbody"), std::string::npos) << req;
+    EXPECT_EQ(req.find("X-Hop"), std::string::npos) << req;
+    EXPECT_EQ(req.find("Keep-Alive"), std::string::npos) << req;
+}
+
+// 顺序的请求都复用同一条后端连接
+TEST(Proxy, ReusesUpstreamConnection) {
+    StubUpstream up(StubUpstream::response("ok\n"));
+    ASSERT_TRUE(up.route("/reuse"));
+    Harness h;
+    int a = h.open();
+    int b = h.open();
+    for(int i=0; i<20; i++) {
+        Responses r = h.request(i % 2 ? a : b, get("/reuse/item"));
+        ASSERT_EQ(r.size(), 1u) << "request " << i;
+        EXPECT_EQ(r[0].body, "ok\n");
+    }
+    EXPECT_EQ(up.requests(), 20);
+    EXPECT_EQ(up.accepted(), 1);
+}
+
+TEST(Proxy, PipelinedRequests) {
+    StubUpstream up(StubUpstream::response("ok\n"));
+    ASSERT_TRUE(up.route("/pipe"));
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/pipe/1") + get("/pipe/2") + get("/pipe/3"));
+    ASSERT_EQ(r.size(), 3u);
+    EXPECT_EQ(up.requests(), 3);
+}
+
+// 后端的头部超过写缓冲区时返回502，而不是直接关闭连接
+TEST(Proxy, OversizedUpstreamHeaderIsBadGateway) {
+    std::string big = "X-Big: " + std::string(3000, 'b') + "\r\n";
+    StubUpstream up(StubUpstream::response("never sent\n", big));
+    ASSERT_TRUE(up.route("/bighead"));
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/bighead"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 502);
+    EXPECT_EQ(r[0].header("X-Big"), "");
+    // 连接仍然可用
+    r = h.request(c, get("/index.html"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+}
+
+TEST(Proxy, UnreachableUpstreamIsBadGateway) {
+    int port;
+    {
+        StubUpstream up(StubUpstream::response(""));
+        port = up.port();
+    }
+    std::string spec = "/down=127.0.0.1:" + std::to_string(port);
+    ASSERT_TRUE(Proxy::add_route(spec.c_str()));
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/down/x"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 502);
+}
+
+// 一条规则对应两个后端，轮询从第一个开始
+static bool route2(const char *prefix, const StubUpstream &a, const StubUpstream &b) {
+    std::string spec = std::string(prefix) + "=127.0.0.1:" + std::to_string(a.port()) +
+        ",127.0.0.1:" + std::to_string(b.port());
+    return Proxy::add_route(spec.c_str());
+}
+
+// 无法转发的响应不是后端的故障：返回502，不摘除后端，也不把请求发给下一个后端
+TEST(Proxy, UnsupportedResponseDoesNotFailOver) {
+    std::string chunked = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n";
+    StubUpstream a(chunked);
+    StubUpstream b(chunked);
+    ASSERT_TRUE(route2("/chunked", a, b));
+    Harness h;
+    int c = h.open();
+    for(int i=0; i<4; i++) {
+        Responses r = h.request(c, get("/chunked/x"));
+        ASSERT_EQ(r.size(), 1u);
+        EXPECT_EQ(r[0].status, 502);
+    }
+    // 轮询交替使用两个后端，没有被摘除
+    EXPECT_EQ(a.requests(), 2);
+    EXPECT_EQ(b.requests(), 2);
+}
+
+// 后端在处理中途断开时，GET换下一个后端重发
+TEST(Proxy, GetFailsOver) {
+    StubUpstream crash("");
+    StubUpstream ok(StubUpstream::response("ok\n"));
+    ASSERT_TRUE(route2("/getfo", crash, ok));
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/getfo/x"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+    EXPECT_EQ(crash.requests(), 1);
+    EXPECT_EQ(ok.requests(), 1);
+}
+
+// POST已经发给了后端，不能再发给另一个后端
+TEST(Proxy, PostIsNotResent) {
+    StubUpstream crash("");
+    StubUpstream ok(StubUpstream::response("ok\n"));
+    ASSERT_TRUE(route2("/postfo", crash, ok));
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, "POST /postfo/x HTTP/1.1\r\nHost: test\r\nContent-Length: 5\r\n\r\nhello");
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 502);
+    EXPECT_EQ(crash.requests(), 1);
+    EXPECT_EQ(ok.requests(), 0);
+}
+
+// 后端关闭的空闲连接在取出时就被发现，POST不会因此失败
+TEST(Proxy, StaleIdleConnectionIsSkipped) {
+    StubUpstream up(StubUpstream::response("ok\n"));
+    ASSERT_TRUE(up.route("/stale"));
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, get("/stale/1"));
+    ASSERT_EQ(r.size(), 1u);
+    up.drop_connections();
+    r = h.request(c, "POST /stale/2 HTTP/1.1\r\nHost: test\r\nContent-Length: 2\r\n\r\nhi");
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+    EXPECT_EQ(up.accepted(), 2);
+}
+
+// 响应体一段一段地转发，不整个缓存；读完后后端连接照常复用
+TEST(Proxy, StreamsLargeResponse) {
+    std::string body(3 * 1024 * 1024 + 17, '\0');
+    for(size_t i=0; i<body.size(); i++) {
+        body[i] = (char)(i * 13 % 251);
+    }
+    StubUpstream up(StubUpstream::response(body));
+    ASSERT_TRUE(up.route("/bigresp"));
+    Harness h;
+    int c = h.open();
+    for(int i=0; i<2; i++) {
+        Responses r = h.request(c, get("/bigresp/file"));
+        ASSERT_EQ(r.size(), 1u);
+        EXPECT_EQ(r[0].status, 200);
+        EXPECT_EQ(r[0].header("Content-Length"), std::to_string(body.size()));
+        EXPECT_TRUE(r[0].body == body);
+    }
+    EXPECT_FALSE(h.closed(c));
+    EXPECT_EQ(up.accepted(), 1);
+}
+
+// 超过读缓冲区的请求体边收边转发，后面流水线中的请求照常处理
+TEST(Proxy, StreamsLargeRequestBody) {
+    StubUpstream up(StubUpstream::response("stored\n"));
+    ASSERT_TRUE(up.route("/bigreq"));
+    std::string body(200 * 1024, 'q');
+    body[0] = '<';
+    body[body.size() - 1] = '>';
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, "POST /bigreq/item HTTP/1.1\r\nHost: test\r\nContent-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n" + body + get("/bigreq/after"));
+    ASSERT_EQ(r.size(), 2u);
+    EXPECT_EQ(r[0].status, 200);
+    EXPECT_EQ(r[0].body, "stored\n");
+    EXPECT_EQ(r[1].status, 200);
+    EXPECT_EQ(up.requests(), 2);
+    EXPECT_EQ(up.last_request(), "GET /bigreq/after HTTP/1.1\r\nHost: test\r\nX-Forwarded-For: unix\r\n"
+        "Connection: keep-alive\r\nContent-Length: 0\r\n\r\n");
+}
+
+// 客户端等100 Continue才发送请求体
+TEST(Proxy, LargeRequestBodyWithExpectContinue) {
+    StubUpstream up(StubUpstream::response("stored\n"));
+    ASSERT_TRUE(up.route("/bigcont"));
+    std::string body(8 * 1024, 'e');
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, "PUT /bigcont/item HTTP/1.1\r\nHost: test\r\nExpect: 100-continue\r\nContent-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n");
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 100);
+    r = h.request(c, body);
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+    std::string req = up.last_request();
+    EXPECT_EQ(req.find("Expect"), std::string::npos);
+    EXPECT_EQ(req.substr(req.size() - body.size()), body);
+}
+
+// 协程模式在主线程中执行do_request，不能阻塞等待后端
+TEST(Proxy, RefusedInCoroutineMode) {
+    StubUpstream up(StubUpstream::response("ok\n"));
+    ASSERT_TRUE(up.route("/coro"));
+    Harness h;
+    int c = h.open();
+    Httpconn::m_coroutine = true;
+    Responses r = h.request(c, get("/coro/x"));
+    Httpconn::m_coroutine = false;
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 502);
+    EXPECT_TRUE(h.closed(c));
+    EXPECT_EQ(up.requests(), 0);
+}
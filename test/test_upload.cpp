@@ -0,0 +1,101 @@
+// 上传测试，允许上传的前缀是网站根目录下的/up
+#include <gtest/gtest.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <thread>
+
+#include "harness.h"
+#include "upstream.h"
+
+typedef std::vector<Harness::Response> Responses;
+
+static std::string put(const std::string &url, const std::string &body, const char *method = "PUT") {
+    return std::string(method) + " " + url + " HTTP/1.1\r\nHost: test\r\nContent-Length: " +
+        std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+static std::string read_file(const std::string &path) {
+    std::string data;
+    FILE *f = fopen(path.c_str(), "rb");
+    if(!f) {
+        return data;
+    }
+    char buf[4096];
+    size_t n;
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.append(buf, n);
+    }
+    fclose(f);
+    return data;
+}
+
+static int open_fds() {
+    int n = 0;
+    DIR *d = opendir("/proc/self/fd");
+    while(d && readdir(d)) {
+        n++;
+    }
+    if(d) {
+        closedir(d);
+    }
+    return n;
+}
+
+class UploadTest : public testing::Test {
+protected:
+    void SetUp() override { Upload::set_prefix("/up"); }
+    void TearDown() override { Upload::set_prefix(""); }
+};
+
+TEST_F(UploadTest, CreatesFile) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, put("/up/hello.txt", "hello upload\n"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 201);
+    EXPECT_EQ(read_file(std::string(Harness::root()) + "/up/hello.txt"), "hello upload\n");
+}
+
+// 同时命中上传和反向代理的请求按反向代理转发，请求体原样交给后端
+TEST_F(UploadTest, ProxyTakesPrecedence) {
+    StubUpstream up(StubUpstream::response("proxied\n"));
+    ASSERT_TRUE(up.route("/up/api"));
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, put("/up/api/x", "hello", "POST"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+    EXPECT_EQ(r[0].body, "proxied\n");
+    std::string req = up.last_request();
+    EXPECT_EQ(req.compare(0, 15, "POST /up/api/x "), 0) << req;
+    EXPECT_EQ(req.substr(req.size() - 5), "hello");
+}
+
+// 目标路径过长时拒绝，请求体没有读，连接随后关闭
+TEST_F(UploadTest, LongPathIsRejected) {
+    Harness h;
+    int c = h.open();
+    std::string name = "/up/" + std::string(Httpconn::FILENAME_LEN, 'a');
+    Responses r = h.request(c, put(name, "data"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 414);
+    EXPECT_TRUE(h.closed(c));
+    // 截断后的文件名也不能被创建
+    std::string truncated = std::string(Harness::root()) + name;
+    truncated.resize(Httpconn::FILENAME_LEN - 1);
+    EXPECT_NE(access(truncated.c_str(), F_OK), 0);
+}
+
+// 工作线程退出时关闭它的中转管道，线程池回收空闲线程不会泄漏fd
+TEST_F(UploadTest, ThreadPipeClosedOnThreadExit) {
+    Harness h;
+    int c = h.open();
+    int before = open_fds();
+    std::thread worker([&]() {
+        Responses r = h.request(c, put("/up/spliced.bin", std::string(256 * 1024, 's')));
+        ASSERT_EQ(r.size(), 1u);
+        EXPECT_EQ(r[0].status, 201);
+    });
+    worker.join();
+    EXPECT_EQ(open_fds(), before);
+}
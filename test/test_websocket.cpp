@@ -0,0 +1,223 @@
+// WebSocket握手和帧收发测试，允许升级的前缀是/ws
+#include <gtest/gtest.h>
+
+#include "harness.h"
+
+typedef std::vector<Harness::Response> Responses;
+
+static const char ws_key[] = "dGhlIHNhbXBsZSBub25jZQ==";
+static const char ws_accept[] = "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=";
+
+static std::string upgrade(const char *url) {
+    return std::string("GET ") + url + " HTTP/1.1\r\nHost: test\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+        "Sec-WebSocket-Key: " + ws_key + "\r\nSec-WebSocket-Version: 13\r\n\r\n";
+}
+
+static std::string get(const char *url) {
+    return std::string("GET ") + url + " HTTP/1.1\r\nHost: test\r\n\r\n";
+}
+
+// 客户端发出的帧，带掩码
+static std::string client_frame(const std::string &payload, const char mask[4]) {
+    std::string f;
+    f += (char)0x81;
+    f += (char)(0x80 | payload.size());
+    f.append(mask, 4);
+    for(size_t i=0; i<payload.size(); i++) {
+        f += payload[i] ^ mask[i % 4];
+    }
+    return f;
+}
+
+// 任意长度、类型的客户端帧，fin为false时是消息的一个分片
+static std::string client_frame(int opcode, bool fin, const std::string &payload, const char mask[4]) {
+    std::string f;
+    f += (char)((fin ? 0x80 : 0) | opcode);
+    if(payload.size() < 126) {
+        f += (char)(0x80 | payload.size());
+    }
+    else if(payload.size() <= 0xffff) {
+        f += (char)(0x80 | 126);
+        f += (char)(payload.size() >> 8);
+        f += (char)payload.size();
+    }
+    else {
+        f += (char)(0x80 | 127);
+        for(int i=7; i>=0; i--) {
+            f += (char)((uint64_t)payload.size() >> (8 * i));
+        }
+    }
+    f.append(mask, 4);
+    for(size_t i=0; i<payload.size(); i++) {
+        f += payload[i] ^ mask[i % 4];
+    }
+    return f;
+}
+
+// 服务端发出的文本帧，不带掩码
+static std::string server_frame(const std::string &payload) {
+    return std::string(1, (char)0x81) + (char)payload.size() + payload;
+}
+
+class WebSocketTest : public testing::Test {
+protected:
+    static void SetUpTestSuite() { WebSocket::set_prefix("/ws"); }
+};
+
+TEST_F(WebSocketTest, Handshake) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, upgrade("/ws/chat"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 101);
+    EXPECT_EQ(r[0].header("Sec-WebSocket-Accept"), ws_accept);
+    EXPECT_TRUE(h.conn(c).is_websocket());
+
+    static const char mask[4] = { 1, 2, 3, 4 };
+    h.send(c, client_frame("hi", mask));
+    h.pump();
+    EXPECT_EQ(h.take(c), server_frame("hi"));
+}
+
+// 请求头要求升级但URL不在前缀下，按普通请求处理，连接仍然是HTTP
+TEST_F(WebSocketTest, UpgradeHeaderWithoutUpgrade) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, upgrade("/index.html"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+    EXPECT_FALSE(h.conn(c).is_websocket());
+    r = h.request(c, get("/style.css"));
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 200);
+}
+
+// 握手后紧跟着半个帧：剩下的数据是WebSocket帧，不能再交给HTTP解析
+TEST_F(WebSocketTest, PartialFrameAfterHandshake) {
+    Harness h;
+    int c = h.open();
+    // 掩码中有\r\n，被当作HTTP解析时是一行无效的请求行
+    static const char mask[4] = { '\r', '\n', 'x', 'y' };
+    std::string frame = client_frame("ping", mask);
+    h.send(c, upgrade("/ws/chat") + frame.substr(0, 7));
+    h.pump();
+    std::string rest;
+    Responses r = Harness::split(h.take(c), &rest);
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 101);
+    EXPECT_EQ(rest, "");
+    ASSERT_FALSE(h.closed(c));
+
+    h.send(c, frame.substr(7));
+    h.pump();
+    EXPECT_EQ(h.take(c), server_frame("ping"));
+}
+
+// Connection可以有多个值
+TEST_F(WebSocketTest, ConnectionTokenList) {
+    Harness h;
+    int c = h.open();
+    std::string req = upgrade("/ws/chat");
+    req.replace(req.find("Connection: Upgrade"), 19, "Connection: keep-alive, Upgrade");
+    Responses r = h.request(c, req);
+    ASSERT_EQ(r.size(), 1u);
+    EXPECT_EQ(r[0].status, 101);
+    EXPECT_TRUE(h.conn(c).is_websocket());
+}
+
+// 不合法的握手回复400并关闭连接，不能升级
+TEST_F(WebSocketTest, InvalidHandshakeIsRejected) {
+    std::string post = upgrade("/ws/chat");
+    post.replace(0, 3, "POST");
+    post.insert(post.size() - 2, "Content-Length: 0\r\n");
+    std::string no_connection = upgrade("/ws/chat");
+    no_connection.replace(no_connection.find("Connection: Upgrade"), 19, "Connection: keep-alive");
+    std::string no_key = upgrade("/ws/chat");
+    no_key.erase(no_key.find("Sec-WebSocket-Key"), 19 + strlen(ws_key) + 2);
+    const std::string requests[] = { post, no_connection, no_key };
+    for(size_t i=0; i<3; i++) {
+        Harness h;
+        int c = h.open();
+        Responses r = h.request(c, requests[i]);
+        ASSERT_EQ(r.size(), 1u) << i;
+        EXPECT_EQ(r[0].status, 400) << i;
+        EXPECT_EQ(r[0].header("Sec-WebSocket-Version"), "13") << i;
+        EXPECT_FALSE(h.conn(c).is_websocket());
+        EXPECT_TRUE(h.closed(c)) << i;
+    }
+}
+
+// 不支持的协议版本回复426，告知支持的版本
+TEST_F(WebSocketTest, UnsupportedVersion) {
+    for(int i=0; i<2; i++) {
+        std::string req = upgrade("/ws/chat");
+        size_t pos = req.find("Sec-WebSocket-Version: 13\r\n");
+        if(i == 0) {
+            req.replace(pos, 25, "Sec-WebSocket-Version: 8");
+        }
+        else {
+            req.erase(pos, 27);
+        }
+        Harness h;
+        int c = h.open();
+        Responses r = h.request(c, req);
+        ASSERT_EQ(r.size(), 1u);
+        EXPECT_EQ(r[0].status, 426);
+        EXPECT_EQ(r[0].header("Sec-WebSocket-Version"), "13");
+        EXPECT_EQ(r[0].header("Upgrade"), "websocket");
+        EXPECT_TRUE(h.closed(c));
+    }
+}
+
+// 比读缓冲区大的消息边收边拼接，完整后广播
+TEST_F(WebSocketTest, LargeMessage) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, upgrade("/ws/chat"));
+    ASSERT_EQ(r.size(), 1u);
+    std::string msg(4096, '\0');
+    for(size_t i=0; i<msg.size(); i++) {
+        msg[i] = 'a' + i % 26;
+    }
+    static const char mask[4] = { 9, 8, 7, 6 };
+    h.send(c, client_frame(WebSocket::TEXT, true, msg, mask));
+    h.pump();
+    EXPECT_EQ(h.take(c), *WebSocket::encode(WebSocket::TEXT, msg.data(), msg.size()));
+    EXPECT_FALSE(h.closed(c));
+}
+
+// 分片的消息拼接后作为一条消息广播，分片之间可以插入控制帧
+TEST_F(WebSocketTest, FragmentedMessage) {
+    Harness h;
+    int c = h.open();
+    Responses r = h.request(c, upgrade("/ws/chat"));
+    ASSERT_EQ(r.size(), 1u);
+    static const char mask[4] = { 1, 3, 5, 7 };
+    h.send(c, client_frame(WebSocket::TEXT, false, "hello, ", mask) + client_frame(WebSocket::PING, true, "p", mask));
+    h.pump();
+    EXPECT_EQ(h.take(c), std::string("\x8a\x01p", 3));
+    h.send(c, client_frame(WebSocket::CONTINUATION, true, "world", mask));
+    h.pump();
+    EXPECT_EQ(h.take(c), server_frame("hello, world"));
+    EXPECT_FALSE(h.closed(c));
+}
+
+// 超过上限的消息以1009关闭，没有开始的分片以1002关闭
+TEST_F(WebSocketTest, BadMessagesCloseWithStatus) {
+    static const char mask[4] = { 1, 1, 1, 1 };
+    const std::string frames[] = {
+        client_frame(WebSocket::BINARY, true, std::string(WebSocket::MAX_MESSAGE + 1, 'x'), mask),
+        client_frame(WebSocket::CONTINUATION, true, "orphan", mask),
+    };
+    const std::string expected[] = { std::string("\x88\x02\x03\xf1", 4), std::string("\x88\x02\x03\xea", 4) };
+    for(int i=0; i<2; i++) {
+        Harness h;
+        int c = h.open();
+        Responses r = h.request(c, upgrade("/ws/chat"));
+        ASSERT_EQ(r.size(), 1u);
+        h.send(c, frames[i].substr(0, 64 * 1024));
+        h.pump();
+        EXPECT_EQ(h.take(c), expected[i]) << i;
+        EXPECT_TRUE(h.closed(c)) << i;
+    }
+}
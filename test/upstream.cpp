@@ -0,0 +1,157 @@
+#include "upstream.h"
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <poll.h>
+#include <strings.h>
+#include <unistd.h>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "proxy.h"
+
+StubUpstream::StubUpstream(const std::string &response)
+    : m_response(response), m_port(-1), m_drops(0), m_accepted(0), m_requests(0) {
+    m_listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if(bind(m_listenfd, (sockaddr *)&addr, sizeof(addr)) == 0 && listen(m_listenfd, 64) == 0 &&
+        getsockname(m_listenfd, (sockaddr *)&addr, &len) == 0) {
+        m_port = ntohs(addr.sin_port);
+    }
+    if(pipe(m_stop) == -1) {
+        abort();
+    }
+    m_thread = std::thread(&StubUpstream::run, this);
+}
+
+StubUpstream::~StubUpstream() {
+    char c = 0;
+    if(::write(m_stop[1], &c, 1) != 1) {
+        abort();
+    }
+    m_thread.join();
+    close(m_stop[0]);
+    close(m_stop[1]);
+    close(m_listenfd);
+}
+
+bool StubUpstream::route(const char *prefix) {
+    std::string spec = std::string(prefix) + "=127.0.0.1:" + std::to_string(m_port);
+    return Proxy::add_route(spec.c_str());
+}
+
+void StubUpstream::drop_connections() {
+    int target = m_drops + 1;
+    char c = 1;
+    if(::write(m_stop[1], &c, 1) != 1) {
+        abort();
+    }
+    while(m_drops < target) {
+        usleep(1000);
+    }
+}
+
+std::string StubUpstream::last_request() {
+    std::lock_guard<std::mutex> guard(m_last_lock);
+    return m_last;
+}
+
+std::string StubUpstream::response(const std::string &body, const std::string &extra_headers) {
+    return "HTTP/1.1 200 OK\r\nContent-Length: " + std::to_string(body.size()) +
+        "\r\nConnection: keep-alive\r\n" + extra_headers + "\r\n" + body;
+}
+
+// 所有连接在一个poll循环中处理，按Content-Length划分请求
+void StubUpstream::run() {
+    std::map<int, std::string> conns;
+    char buf[16 * 1024];
+    while(true) {
+        std::vector<pollfd> fds;
+        pollfd stop = { m_stop[0], POLLIN, 0 };
+        pollfd listen = { m_listenfd, POLLIN, 0 };
+        fds.push_back(stop);
+        fds.push_back(listen);
+        for(std::map<int, std::string>::iterator it = conns.begin(); it != conns.end(); ++it) {
+            pollfd p = { it->first, POLLIN, 0 };
+            fds.push_back(p);
+        }
+        if(poll(fds.data(), fds.size(), -1) <= 0) {
+            continue;
+        }
+        if(fds[0].revents) {
+            char c;
+            if(::read(m_stop[0], &c, 1) != 1 || c == 0) {
+                break;
+            }
+            for(std::map<int, std::string>::iterator it = conns.begin(); it != conns.end(); ++it) {
+                close(it->first);
+            }
+            conns.clear();
+            m_drops++;
+            continue;
+        }
+        if(fds[1].revents & POLLIN) {
+            int fd = accept4(m_listenfd, NULL, NULL, SOCK_CLOEXEC);
+            if(fd != -1) {
+                conns[fd] = std::string();
+                m_accepted++;
+            }
+        }
+        for(size_t i=2; i<fds.size(); i++) {
+            if(!fds[i].revents) {
+                continue;
+            }
+            int fd = fds[i].fd;
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if(n <= 0) {
+                close(fd);
+                conns.erase(fd);
+                continue;
+            }
+            std::string &in = conns[fd];
+            in.append(buf, n);
+            while(true) {
+                size_t end = in.find("\r\n\r\n");
+                if(end == std::string::npos) {
+                    break;
+                }
+                long body = 0;
+                const char *cl = strcasestr(in.c_str(), "\r\nContent-Length:");
+                if(cl && cl < in.c_str() + end) {
+                    body = atol(cl + 17);
+                }
+                if(in.size() < end + 4 + body) {
+                    break;
+                }
+                {
+                    std::lock_guard<std::mutex> guard(m_last_lock);
+                    m_last = in.substr(0, end + 4 + body);
+                }
+                in.erase(0, end + 4 + body);
+                m_requests++;
+                if(m_response.empty()) {
+                    close(fd);
+                    conns.erase(fd);
+                    break;
+                }
+                size_t sent = 0;
+                while(sent < m_response.size()) {
+                    ssize_t w = send(fd, m_response.data() + sent, m_response.size() - sent, MSG_NOSIGNAL);
+                    if(w <= 0) {
+                        break;
+                    }
+                    sent += w;
+                }
+            }
+        }
+    }
+    for(std::map<int, std::string>::iterator it = conns.begin(); it != conns.end(); ++it) {
+        close(it->first);
+    }
+}
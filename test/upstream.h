@@ -0,0 +1,44 @@
+#ifndef UPSTREAM_STUB_H
+#define UPSTREAM_STUB_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// 反向代理测试用的本地后端
+// 在127.0.0.1的空闲端口上监听，每个完整的请求都回复同一个响应，支持长连接。
+// 响应为空串时收到请求后直接关闭连接，模拟处理中途崩溃的后端。
+// 在单独的线程中运行，因为Proxy::forward在调用线程中阻塞等待后端
+class StubUpstream {
+public:
+    explicit StubUpstream(const std::string &response);
+    ~StubUpstream();
+
+    // 注册一条转发规则 prefix -> 本后端，规则是全局的，每个前缀只能注册一次
+    bool route(const char *prefix);
+    int port() const { return m_port; }
+    int accepted() const { return m_accepted; }     // 接受过的连接数
+    int requests() const { return m_requests; }
+    std::string last_request();                     // 最近收到的完整请求，包括请求体
+    void drop_connections();                        // 关闭所有已建立的连接，返回时已经关闭
+
+    static std::string response(const std::string &body, const std::string &extra_headers = "");
+
+private:
+    void run();
+
+private:
+    std::string m_response;
+    int m_listenfd;
+    int m_port;
+    int m_stop[2];                      // 通知线程：0退出，1关闭所有连接
+    std::atomic<int> m_drops;           // 已经处理的关闭请求数
+    std::atomic<int> m_accepted;
+    std::atomic<int> m_requests;
+    std::mutex m_last_lock;
+    std::string m_last;
+    std::thread m_thread;
+};
+
+#endif
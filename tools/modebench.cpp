@@ -0,0 +1,395 @@
+// 线程池模式和协程模式(-C)的吞吐量对比
+// 在空闲端口上依次启动两次webserver，每次用固定数量的长连接做闭环压测：
+// 每个连接收完一个响应马上发下一个请求。统计每秒响应数和延迟分位数，最后打印两种模式的比值
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// 一种模式的结果
+struct Result {
+    unsigned long responses;
+    unsigned long reconnects;           // 服务端关闭后重新建立的连接
+    unsigned long errors;               // 连接失败或响应无法解析
+    unsigned long status[6];            // 按状态码的百位统计
+    unsigned long bytes_in;
+    double seconds;
+    std::vector<uint64_t> latency_ns;
+};
+
+struct Conn {
+    int fd;
+    uint64_t send_ns;
+    std::string in;
+    size_t out_off;
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 绑定端口0由内核分配一个空闲端口
+static int free_port() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int port = -1;
+    if(bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0 && getsockname(fd, (sockaddr *)&addr, &len) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+    close(fd);
+    return port;
+}
+
+static int connect_to(int port, bool nonblock) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(nonblock) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    return fd;
+}
+
+// 启动服务器，stdout重定向到/dev/null，等到端口可以连接为止
+static pid_t start_server(const char *server, int port, const std::vector<std::string> &args) {
+    pid_t pid = fork();
+    if(pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+        std::string port_str = std::to_string(port);
+        std::vector<char *> argv;
+        argv.push_back((char *)server);
+        argv.push_back((char *)port_str.c_str());
+        for(size_t i=0; i<args.size(); i++) {
+            argv.push_back((char *)args[i].c_str());
+        }
+        argv.push_back(NULL);
+        execv(server, argv.data());
+        perror(server);
+        _exit(127);
+    }
+    if(pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    for(int i=0; i<500; i++) {
+        int fd = connect_to(port, false);
+        if(fd != -1) {
+            close(fd);
+            return pid;
+        }
+        int status;
+        if(waitpid(pid, &status, WNOHANG) == pid) {
+            printf("%s exited before listening\n", server);
+            return -1;
+        }
+        usleep(10000);
+    }
+    printf("%s is not listening on %d\n", server, port);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stop_server(pid_t pid) {
+    kill(pid, SIGTERM);
+    for(int i=0; i<300; i++) {
+        if(waitpid(pid, NULL, WNOHANG) == pid) {
+            return;
+        }
+        usleep(10000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+// 响应完整时返回它的长度和状态码，不完整返回0，无法解析返回-1
+static long parse_response(const std::string &in, int *status, bool *close_after) {
+    size_t end = in.find("\r\n\r\n");
+    if(end == std::string::npos) {
+        return 0;
+    }
+    if(in.compare(0, 9, "HTTP/1.1 ")) {
+        return -1;
+    }
+    *status = atoi(in.c_str() + 9);
+    long body = 0;
+    *close_after = false;
+    size_t pos = in.find("\r\n");
+    while(pos < end) {
+        const char *line = in.c_str() + pos + 2;
+        if(!strncasecmp(line, "Content-Length:", 15)) {
+            body = atol(line + 15);
+        }
+        else if(!strncasecmp(line, "Connection: close", 17)) {
+            *close_after = true;
+        }
+        pos = in.find("\r\n", pos + 2);
+    }
+    if(in.size() < end + 4 + body) {
+        return 0;
+    }
+    return end + 4 + body;
+}
+
+// 发送请求中还没发出的部分，出错返回false
+static bool send_request(Conn &c, const std::string &request) {
+    while(c.out_off < request.size()) {
+        ssize_t n = send(c.fd, request.data() + c.out_off, request.size() - c.out_off, MSG_NOSIGNAL);
+        if(n == -1) {
+            return errno == EAGAIN;
+        }
+        c.out_off += n;
+    }
+    return true;
+}
+
+static bool open_conn(int epollfd, Conn &c, int index, int port, const std::string &request) {
+    c.fd = connect_to(port, true);
+    if(c.fd == -1) {
+        return false;
+    }
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = index;
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+    c.in.clear();
+    c.out_off = 0;
+    c.send_ns = now_ns();
+    return send_request(c, request);
+}
+
+// 闭环压测，warmup期间的响应不计入结果
+static Result run(int port, int conns, double seconds, double warmup, const std::string &request) {
+    Result r = Result();
+    int epollfd = epoll_create1(0);
+    std::vector<Conn> pool(conns);
+    for(int i=0; i<conns; i++) {
+        if(!open_conn(epollfd, pool[i], i, port, request)) {
+            r.errors++;
+        }
+    }
+
+    uint64_t start = now_ns();
+    uint64_t measure = start + (uint64_t)(warmup * 1e9);
+    uint64_t stop = measure + (uint64_t)(seconds * 1e9);
+    static char buf[64 * 1024];
+    epoll_event events[256];
+    uint64_t now = start;
+    while(now < stop) {
+        int num = epoll_wait(epollfd, events, 256, 100);
+        now = now_ns();
+        for(int i=0; i<num; i++) {
+            Conn &c = pool[events[i].data.u32];
+            bool closed = false;
+            while(true) {
+                ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+                if(n > 0) {
+                    c.in.append(buf, n);
+                    continue;
+                }
+                closed = n == 0 || errno != EAGAIN;
+                break;
+            }
+            bool close_after = false;
+            int status = 0;
+            long len = parse_response(c.in, &status, &close_after);
+            if(len > 0) {
+                if(now >= measure) {
+                    r.responses++;
+                    r.status[status / 100 % 6]++;
+                    r.bytes_in += len;
+                    r.latency_ns.push_back(now - c.send_ns);
+                }
+                c.in.erase(0, len);
+                if(!closed && !close_after) {
+                    c.out_off = 0;
+                    c.send_ns = now;
+                    closed = !send_request(c, request);
+                }
+                else {
+                    closed = true;
+                }
+            }
+            else if(len == -1) {
+                r.errors++;
+                closed = true;
+            }
+            if(closed) {
+                epoll_ctl(epollfd, EPOLL_CTL_DEL, c.fd, NULL);
+                close(c.fd);
+                r.reconnects++;
+                if(!open_conn(epollfd, c, events[i].data.u32, port, request)) {
+                    r.errors++;
+                }
+            }
+        }
+    }
+    r.seconds = (now - measure) / 1e9;
+    for(int i=0; i<conns; i++) {
+        if(pool[i].fd != -1) {
+            close(pool[i].fd);
+        }
+    }
+    close(epollfd);
+    std::sort(r.latency_ns.begin(), r.latency_ns.end());
+    return r;
+}
+
+static double percentile(const Result &r, double p) {
+    if(r.latency_ns.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (r.latency_ns.size() - 1));
+    return r.latency_ns[i] / 1000.0;
+}
+
+static double rate(const Result &r) {
+    return r.seconds > 0 ? r.responses / r.seconds : 0;
+}
+
+// 按空格拆分额外的服务器参数
+static std::vector<std::string> split_args(const char *s) {
+    std::vector<std::string> args;
+    std::string cur;
+    for( ; s && *s; s++) {
+        if(*s == ' ') {
+            if(!cur.empty()) {
+                args.push_back(cur);
+            }
+            cur.clear();
+        }
+        else {
+            cur += *s;
+        }
+    }
+    if(!cur.empty()) {
+        args.push_back(cur);
+    }
+    return args;
+}
+
+int main(int argc, char *argv[]) {
+    const char *server = "./out/webserver";
+    const char *url = "/index.html";
+    const char *extra = NULL;
+    int conns = 64;
+    double seconds = 3;
+    double warmup = 0.5;
+    int opt_ch;
+    while((opt_ch = getopt(argc, argv, "s:u:a:c:d:w:")) != -1) {
+        switch(opt_ch) {
+            case 's': {
+                // webserver的路径
+                server = optarg;
+                break;
+            }
+            case 'u': {
+                // 请求的URL，服务器的网站根目录是/home/ubuntu/www
+                url = optarg;
+                break;
+            }
+            case 'a': {
+                // 两种模式都附加的服务器参数，如 "-T 8:8"
+                extra = optarg;
+                break;
+            }
+            case 'c': {
+                // 并发连接数
+                conns = atoi(optarg);
+                break;
+            }
+            case 'd': {
+                // 每种模式统计的秒数
+                seconds = atof(optarg);
+                break;
+            }
+            case 'w': {
+                // 每种模式开始统计前的预热秒数
+                warmup = atof(optarg);
+                break;
+            }
+            default:
+                printf("useage: %s [-s server] [-u url] [-a \"server args\"] [-c connections] [-d seconds] [-w warmup_seconds]\n", basename(argv[0]));
+                exit(-1);
+        }
+    }
+    if(conns <= 0 || seconds <= 0) {
+        printf("bad connections or seconds\n");
+        exit(-1);
+    }
+
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string request = std::string("GET ") + url + " HTTP/1.1\r\nHost: 127.0.0.1\r\nConnection: keep-alive\r\n\r\n";
+    const char *names[2] = { "threadpool", "coroutine" };
+    Result results[2];
+    for(int i=0; i<2; i++) {
+        int port = free_port();
+        std::vector<std::string> args = split_args(extra);
+        if(i == 1) {
+            args.push_back("-C");
+        }
+        pid_t pid = start_server(server, port, args);
+        if(pid == -1) {
+            exit(-1);
+        }
+        printf("%s: %d connections, GET %s, %.1fs\n", names[i], conns, url, seconds);
+        fflush(stdout);
+        results[i] = run(port, conns, seconds, warmup, request);
+        stop_server(pid);
+    }
+
+    printf("%-16s %14s %14s\n", "", names[0], names[1]);
+    printf("%-16s %14.0f %14.0f\n", "responses/s", rate(results[0]), rate(results[1]));
+    printf("%-16s %14.1f %14.1f\n", "latency_p50_us", percentile(results[0], 0.5), percentile(results[1], 0.5));
+    printf("%-16s %14.1f %14.1f\n", "latency_p99_us", percentile(results[0], 0.99), percentile(results[1], 0.99));
+    printf("%-16s %14lu %14lu\n", "non_2xx", results[0].responses - results[0].status[2],
+        results[1].responses - results[1].status[2]);
+    printf("%-16s %14lu %14lu\n", "reconnects", results[0].reconnects, results[1].reconnects);
+    printf("%-16s %14lu %14lu\n", "errors", results[0].errors, results[1].errors);
+    if(rate(results[0]) > 0) {
+        printf("coroutine/threadpool throughput: %.2fx\n", rate(results[1]) / rate(results[0]));
+    }
+    if(results[0].status[2] == 0 || results[1].status[2] == 0) {
+        printf("warning: no 2xx responses, check that %s exists under the document root\n", url);
+    }
+    return 0;
+}
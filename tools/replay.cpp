@@ -0,0 +1,639 @@
+// 流量重放工具
+// 读取webserver -R录制的日志，按原来的时间间隔(可以加速)向目标服务器重新发起连接、发送请求，
+// 统计每个请求的延迟和吞吐量。指定两个目标时依次重放，并打印两次结果的差异，用来比较两个版本。
+//
+// 请求按录制时的时间点发送，不等待前面的响应(开环)，服务器变慢时表现为排队和延迟上升，
+// 而不是请求变少。响应按Content-Length划分，和请求按顺序一一对应
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../src/capture.h"
+
+static const int MAX_HEADER = 64 * 1024;
+
+// 日志中的一条事件，DATA的数据在g_data中
+struct Event {
+    uint64_t ts_ns;
+    int conn;
+    int type;
+    size_t offset;
+    uint32_t len;
+};
+
+static std::vector<Event> g_events;
+static std::string g_data;
+static int g_conn_count = 0;
+
+// 一次重放的结果
+struct Result {
+    unsigned long conns;
+    unsigned long connect_errors;
+    unsigned long requests;
+    unsigned long responses;
+    unsigned long unanswered;           // 连接断开或超时时还没收到响应的请求
+    unsigned long status[6];            // 按状态码的百位统计
+    unsigned long bytes_in;
+    unsigned long bytes_out;
+    double seconds;
+    std::vector<uint64_t> latency_ns;
+};
+
+// 从发出的字节流中识别请求边界，从收到的字节流中识别响应边界
+struct Stream {
+    std::string header;
+    long body_left;                     // -1表示读到连接关闭为止
+    bool in_body;
+};
+
+struct Pending {
+    uint64_t send_ns;
+    bool head;                          // HEAD请求的响应没有响应体
+};
+
+struct Conn {
+    int fd;
+    bool connecting;
+    bool closing;                       // 录制的连接已经关闭，收完响应后关闭
+    bool done;
+    bool upgraded;                      // 升级为WebSocket后不再统计
+    std::string out;
+    size_t out_off;
+    Stream req;
+    Stream resp;
+    std::deque<Pending> pending;
+};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 读入一个日志文件，连接编号重新分配，多个文件的连接互不冲突
+static bool load(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if(!f) {
+        perror(path);
+        return false;
+    }
+    char magic[sizeof(Capture::MAGIC)];
+    if(fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, Capture::MAGIC, sizeof(magic))) {
+        printf("%s: not a capture file\n", path);
+        fclose(f);
+        return false;
+    }
+    std::map<uint32_t, int> conns;
+    Capture::Record rec;
+    while(fread(&rec, sizeof(rec), 1, f) == 1) {
+        Event ev = { rec.ts_ns, 0, rec.type, g_data.size(), rec.len };
+        if(rec.type == Capture::DATA) {
+            g_data.resize(g_data.size() + rec.len);
+            if(fread(&g_data[ev.offset], rec.len, 1, f) != 1) {
+                // 进程被杀死时最后一条记录可能不完整
+                g_data.resize(ev.offset);
+                break;
+            }
+        }
+        uint32_t conn = rec.conn;
+        std::map<uint32_t, int>::iterator it = conns.find(conn);
+        if(it == conns.end()) {
+            it = conns.insert(std::make_pair(conn, g_conn_count++)).first;
+        }
+        ev.conn = it->second;
+        g_events.push_back(ev);
+    }
+    fclose(f);
+    return true;
+}
+
+static bool parse_target(const char *spec, sockaddr_storage &addr, socklen_t &len) {
+    bzero(&addr, sizeof(addr));
+    if(!strncmp(spec, "unix:", 5)) {
+        sockaddr_un *un = (sockaddr_un *)&addr;
+        if(strlen(spec + 5) == 0 || strlen(spec + 5) >= sizeof(un->sun_path)) {
+            return false;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, spec + 5);
+        len = sizeof(sockaddr_un);
+        return true;
+    }
+    const char *colon = strrchr(spec, ':');
+    if(!colon) {
+        return false;
+    }
+    std::string host(spec, colon - spec);
+    int port = atoi(colon + 1);
+    if(host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+        sockaddr_in6 *in6 = (sockaddr_in6 *)&addr;
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        len = sizeof(sockaddr_in6);
+        return inet_pton(AF_INET6, host.substr(1, host.size() - 2).c_str(), &in6->sin6_addr) == 1;
+    }
+    sockaddr_in *in = (sockaddr_in *)&addr;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    len = sizeof(sockaddr_in);
+    return inet_pton(AF_INET, host.c_str(), &in->sin_addr) == 1;
+}
+
+// 在头部中找某个字段的值，找不到返回NULL
+static const char *find_header(const std::string &header, const char *name) {
+    size_t name_len = strlen(name);
+    size_t pos = header.find("\r\n");
+    while(pos != std::string::npos && pos + 2 < header.size()) {
+        const char *line = header.c_str() + pos + 2;
+        if(!strncasecmp(line, name, name_len) && line[name_len] == ':') {
+            line += name_len + 1;
+            while(*line == ' ' || *line == '\t') {
+                line++;
+            }
+            return line;
+        }
+        pos = header.find("\r\n", pos + 2);
+    }
+    return NULL;
+}
+
+// 追加数据到头部缓冲区，返回头部结束后剩余数据的位置，头部还不完整时返回-1
+static long feed_header(Stream &s, const char *data, size_t len) {
+    size_t old = s.header.size();
+    s.header.append(data, len);
+    // 可能跨越两次调用
+    size_t from = old >= 3 ? old - 3 : 0;
+    size_t end = s.header.find("\r\n\r\n", from);
+    if(end == std::string::npos) {
+        return -1;
+    }
+    end += 4;
+    long rest = end - old;
+    s.header.resize(end);
+    return rest;
+}
+
+// 发出的数据，识别出的请求放入pending队列
+static void track_request(Conn &c, const char *data, size_t len, uint64_t now, Result &r) {
+    while(len > 0 && !c.upgraded) {
+        Stream &s = c.req;
+        if(s.in_body) {
+            size_t n = (size_t)s.body_left < len ? s.body_left : len;
+            s.body_left -= n;
+            data += n;
+            len -= n;
+            if(s.body_left == 0) {
+                s.in_body = false;
+            }
+            continue;
+        }
+        long used = feed_header(s, data, len);
+        if(used < 0) {
+            if(s.header.size() > MAX_HEADER) {
+                // 不是HTTP请求，不再统计这个连接
+                c.upgraded = true;
+            }
+            return;
+        }
+        data += used;
+        len -= used;
+        const char *cl = find_header(s.header, "Content-Length");
+        s.body_left = cl ? atol(cl) : 0;
+        s.in_body = s.body_left > 0;
+        Pending p = { now, !strncmp(s.header.c_str(), "HEAD ", 5) };
+        c.pending.push_back(p);
+        s.header.clear();
+        r.requests++;
+    }
+}
+
+static void finish_response(Conn &c, int code, uint64_t now, Result &r) {
+    r.responses++;
+    r.status[code / 100 < 6 ? code / 100 : 0]++;
+    if(!c.pending.empty()) {
+        r.latency_ns.push_back(now - c.pending.front().send_ns);
+        c.pending.pop_front();
+    }
+}
+
+// 收到的数据，每个完整的响应对应pending队头的请求
+static void track_response(Conn &c, const char *data, size_t len, uint64_t now, Result &r) {
+    while(len > 0 && !c.upgraded) {
+        Stream &s = c.resp;
+        if(s.in_body) {
+            if(s.body_left < 0) {
+                return;
+            }
+            size_t n = (size_t)s.body_left < len ? s.body_left : len;
+            s.body_left -= n;
+            data += n;
+            len -= n;
+            if(s.body_left == 0) {
+                s.in_body = false;
+                finish_response(c, atoi(s.header.c_str() + 9), now, r);
+                s.header.clear();
+            }
+            continue;
+        }
+        long used = feed_header(s, data, len);
+        if(used < 0) {
+            if(s.header.size() > MAX_HEADER) {
+                c.upgraded = true;
+            }
+            return;
+        }
+        data += used;
+        len -= used;
+        int code = s.header.size() > 12 ? atoi(s.header.c_str() + 9) : 0;
+        if(code == 101) {
+            finish_response(c, code, now, r);
+            c.upgraded = true;
+            return;
+        }
+        // 100 Continue之类的中间响应，后面还有最终响应
+        if(code >= 100 && code < 200) {
+            s.header.clear();
+            continue;
+        }
+        const char *cl = find_header(s.header, "Content-Length");
+        bool head = !c.pending.empty() && c.pending.front().head;
+        s.body_left = head ? 0 : (cl ? atol(cl) : -1);
+        if(s.body_left == 0) {
+            finish_response(c, code, now, r);
+            s.header.clear();
+        }
+        else {
+            s.in_body = true;
+        }
+    }
+}
+
+// 连接结束，读到关闭为止的响应在这里完成
+static void close_conn(int epollfd, Conn &c, uint64_t now, Result &r) {
+    if(c.done) {
+        return;
+    }
+    if(c.resp.in_body && c.resp.body_left < 0) {
+        finish_response(c, atoi(c.resp.header.c_str() + 9), now, r);
+    }
+    if(!c.upgraded) {
+        r.unanswered += c.pending.size();
+    }
+    c.pending.clear();
+    if(c.fd != -1) {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, c.fd, NULL);
+        close(c.fd);
+        c.fd = -1;
+    }
+    c.done = true;
+}
+
+static void update_events(int epollfd, Conn &c, int index) {
+    epoll_event ev;
+    ev.data.u32 = index;
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    if(c.connecting || c.out_off < c.out.size()) {
+        ev.events |= EPOLLOUT;
+    }
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+static void flush(int epollfd, Conn &c, int index, uint64_t now, Result &r) {
+    if(c.connecting) {
+        return;
+    }
+    while(c.out_off < c.out.size()) {
+        ssize_t n = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+        if(n == -1) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_conn(epollfd, c, now, r);
+                return;
+            }
+            break;
+        }
+        c.out_off += n;
+        r.bytes_out += n;
+    }
+    if(c.out_off == c.out.size()) {
+        c.out.clear();
+        c.out_off = 0;
+    }
+    update_events(epollfd, c, index);
+}
+
+// 按录制的时间点发起连接和发送数据，speed为0时不等待
+static Result replay(const char *target, double speed, int drain_sec) {
+    Result r = Result();
+
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    parse_target(target, addr, addr_len);
+
+    std::vector<Conn> conns(g_conn_count);
+    for(size_t i=0; i<conns.size(); i++) {
+        conns[i].fd = -1;
+        conns[i].connecting = conns[i].closing = conns[i].done = conns[i].upgraded = false;
+        conns[i].out_off = 0;
+        conns[i].req.in_body = conns[i].resp.in_body = false;
+    }
+    int epollfd = epoll_create(1);
+    std::vector<epoll_event> events(1024);
+    static char buf[256 * 1024];
+
+    uint64_t first_ts = g_events.empty() ? 0 : g_events[0].ts_ns;
+    uint64_t start = now_ns();
+    uint64_t last_done = start;
+    uint64_t deadline = 0;
+    size_t next = 0;
+    int active = 0;
+    while(true) {
+        uint64_t now = now_ns();
+        // 执行到期的事件
+        while(next < g_events.size()) {
+            const Event &e = g_events[next];
+            uint64_t due = start + (speed > 0 ? (uint64_t)((e.ts_ns - first_ts) / speed) : 0);
+            if(due > now) {
+                break;
+            }
+            next++;
+            Conn &c = conns[e.conn];
+            if(e.type == Capture::OPEN) {
+                c.fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+                r.conns++;
+                if(c.fd == -1 || (connect(c.fd, (sockaddr *)&addr, addr_len) == -1 && errno != EINPROGRESS)) {
+                    r.connect_errors++;
+                    if(c.fd != -1) {
+                        close(c.fd);
+                        c.fd = -1;
+                    }
+                    c.done = true;
+                    continue;
+                }
+                c.connecting = true;
+                epoll_event ev;
+                ev.data.u32 = e.conn;
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+                epoll_ctl(epollfd, EPOLL_CTL_ADD, c.fd, &ev);
+                active++;
+                continue;
+            }
+            // 连接已经被服务器关闭，之后的数据无法发送
+            if(c.done || c.fd == -1) {
+                continue;
+            }
+            if(e.type == Capture::DATA || e.type == Capture::SKIP) {
+                size_t old = c.out.size();
+                if(e.type == Capture::DATA) {
+                    c.out.append(g_data, e.offset, e.len);
+                }
+                else {
+                    c.out.append(e.len, '\0');
+                }
+                track_request(c, c.out.data() + old, e.len, now, r);
+                flush(epollfd, c, e.conn, now, r);
+            }
+            else if(e.type == Capture::CLOSE) {
+                c.closing = true;
+                if(c.pending.empty() && c.out.empty()) {
+                    close_conn(epollfd, c, now, r);
+                }
+            }
+            if(c.done) {
+                active--;
+                last_done = now;
+            }
+        }
+
+        if(next == g_events.size()) {
+            if(active == 0) {
+                break;
+            }
+            // 所有事件都执行完后，最多再等drain_sec秒的响应
+            if(!deadline) {
+                deadline = now + drain_sec * 1000000000ull;
+            }
+            if(now >= deadline) {
+                break;
+            }
+        }
+        int timeout = 100;
+        if(next < g_events.size()) {
+            uint64_t due = start + (speed > 0 ? (uint64_t)((g_events[next].ts_ns - first_ts) / speed) : 0);
+            timeout = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+            timeout = timeout < 100 ? timeout : 100;
+        }
+
+        int num = epoll_wait(epollfd, events.data(), events.size(), timeout);
+        now = now_ns();
+        for(int i=0; i<num; i++) {
+            int index = events[i].data.u32;
+            Conn &c = conns[index];
+            if(c.done) {
+                continue;
+            }
+            if(c.connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if(err) {
+                    r.connect_errors++;
+                    close_conn(epollfd, c, now, r);
+                    active--;
+                    continue;
+                }
+                c.connecting = false;
+            }
+            if(events[i].events & EPOLLOUT) {
+                flush(epollfd, c, index, now, r);
+            }
+            if(!c.done && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) {
+                while(true) {
+                    ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+                    if(n > 0) {
+                        r.bytes_in += n;
+                        track_response(c, buf, n, now, r);
+                        continue;
+                    }
+                    if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                        close_conn(epollfd, c, now, r);
+                    }
+                    break;
+                }
+            }
+            if(!c.done && c.closing && c.pending.empty() && c.out.empty()) {
+                close_conn(epollfd, c, now, r);
+            }
+            if(c.done) {
+                active--;
+                last_done = now;
+            }
+        }
+    }
+
+    // 超时后还没结束的连接
+    uint64_t now = now_ns();
+    for(size_t i=0; i<conns.size(); i++) {
+        close_conn(epollfd, conns[i], now, r);
+    }
+    close(epollfd);
+    r.seconds = (last_done - start) / 1e9;
+    std::sort(r.latency_ns.begin(), r.latency_ns.end());
+    return r;
+}
+
+static double percentile(const Result &r, double p) {
+    if(r.latency_ns.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)(p * (r.latency_ns.size() - 1));
+    return r.latency_ns[i] / 1000.0;
+}
+
+static double mean(const Result &r) {
+    if(r.latency_ns.empty()) {
+        return 0;
+    }
+    double sum = 0;
+    for(size_t i=0; i<r.latency_ns.size(); i++) {
+        sum += r.latency_ns[i];
+    }
+    return sum / r.latency_ns.size() / 1000.0;
+}
+
+// 打印一个或两个结果，两个时附上变化的百分比
+static void report(const char **names, const Result *r, int n) {
+    struct Row {
+        const char *name;
+        double value[2];
+    };
+    Row rows[] = {
+        { "connections",    { (double)r[0].conns, n > 1 ? (double)r[1].conns : 0 } },
+        { "connect_errors", { (double)r[0].connect_errors, n > 1 ? (double)r[1].connect_errors : 0 } },
+        { "requests",       { (double)r[0].requests, n > 1 ? (double)r[1].requests : 0 } },
+        { "responses",      { (double)r[0].responses, n > 1 ? (double)r[1].responses : 0 } },
+        { "unanswered",     { (double)r[0].unanswered, n > 1 ? (double)r[1].unanswered : 0 } },
+        { "2xx",            { (double)r[0].status[2], n > 1 ? (double)r[1].status[2] : 0 } },
+        { "3xx",            { (double)r[0].status[3], n > 1 ? (double)r[1].status[3] : 0 } },
+        { "4xx",            { (double)r[0].status[4], n > 1 ? (double)r[1].status[4] : 0 } },
+        { "5xx",            { (double)r[0].status[5], n > 1 ? (double)r[1].status[5] : 0 } },
+        { "seconds",        { r[0].seconds, n > 1 ? r[1].seconds : 0 } },
+        { "responses/s",    { r[0].seconds > 0 ? r[0].responses / r[0].seconds : 0,
+                              n > 1 && r[1].seconds > 0 ? r[1].responses / r[1].seconds : 0 } },
+        { "MB_in/s",        { r[0].seconds > 0 ? r[0].bytes_in / r[0].seconds / 1048576 : 0,
+                              n > 1 && r[1].seconds > 0 ? r[1].bytes_in / r[1].seconds / 1048576 : 0 } },
+        { "latency_avg_us", { mean(r[0]), n > 1 ? mean(r[1]) : 0 } },
+        { "latency_p50_us", { percentile(r[0], 0.5), n > 1 ? percentile(r[1], 0.5) : 0 } },
+        { "latency_p90_us", { percentile(r[0], 0.9), n > 1 ? percentile(r[1], 0.9) : 0 } },
+        { "latency_p99_us", { percentile(r[0], 0.99), n > 1 ? percentile(r[1], 0.99) : 0 } },
+        { "latency_max_us", { percentile(r[0], 1.0), n > 1 ? percentile(r[1], 1.0) : 0 } },
+    };
+    if(n > 1) {
+        printf("%-16s %16s %16s %9s\n", "", names[0], names[1], "change");
+    }
+    else {
+        printf("%-16s %16s\n", "", names[0]);
+    }
+    for(size_t i=0; i<sizeof(rows)/sizeof(rows[0]); i++) {
+        printf("%-16s %16.1f", rows[i].name, rows[i].value[0]);
+        if(n > 1) {
+            printf(" %16.1f", rows[i].value[1]);
+            if(rows[i].value[0] != 0) {
+                printf(" %+8.1f%%", (rows[i].value[1] - rows[i].value[0]) * 100 / rows[i].value[0]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double speed = 1;
+    int drain_sec = 10;
+    const char *compare = NULL;
+    int opt_ch;
+    while((opt_ch = getopt(argc, argv, "x:d:c:")) != -1) {
+        switch(opt_ch) {
+            case 'x': {
+                // 重放速度的倍数，0表示不等待，尽快发送
+                speed = atof(optarg);
+                break;
+            }
+            case 'd': {
+                // 事件都执行完后等待响应的秒数
+                drain_sec = atoi(optarg);
+                break;
+            }
+            case 'c': {
+                // 第二个目标，和第一个目标的结果比较
+                compare = optarg;
+                break;
+            }
+            default:
+                exit(-1);
+        }
+    }
+    if(argc - optind < 2 || speed < 0) {
+        printf("useage: %s [-x speed] [-d drain_seconds] [-c compare_target] target capture_file [capture_file...]\n", basename(argv[0]));
+        printf("target: 127.0.0.1:8080, [::1]:8080 or unix:/tmp/web.sock\n");
+        exit(-1);
+    }
+    const char *targets[2] = { argv[optind], compare };
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    for(int i=0; i<2; i++) {
+        if(targets[i] && !parse_target(targets[i], addr, addr_len)) {
+            printf("bad target: %s\n", targets[i]);
+            exit(-1);
+        }
+    }
+
+    // 多进程模式下每个工作进程一个文件，按时间合并
+    for(int i=optind+1; i<argc; i++) {
+        if(!load(argv[i])) {
+            exit(-1);
+        }
+    }
+    std::stable_sort(g_events.begin(), g_events.end(),
+        [](const Event &a, const Event &b) { return a.ts_ns < b.ts_ns; });
+    if(g_events.empty()) {
+        printf("no events\n");
+        exit(-1);
+    }
+    printf("%zu events, %d connections, %zu bytes, %.1f seconds\n", g_events.size(), g_conn_count,
+        g_data.size(), (g_events.back().ts_ns - g_events.front().ts_ns) / 1e9);
+
+    // 连接数可能很多
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    Result results[2];
+    int n = compare ? 2 : 1;
+    for(int i=0; i<n; i++) {
+        printf("replaying against %s at %gx\n", targets[i], speed);
+        fflush(stdout);
+        results[i] = replay(targets[i], speed, drain_sec);
+    }
+    report(targets, results, n);
+    return 0;
+}